@@ -0,0 +1,450 @@
+
+// Copyright 2004-2006 Dave Cridland <dave@cridland.net>
+
+// Benchmark suite: skip::map, skip::multimap, skip::compact_map and
+// std::map side by side, over several workloads, key types and sizes.
+// Usage: skiplist-bench [size...]
+// Output is tab-separated, one line per map/key/workload/size, with a
+// header line; lines starting with # are commentary.
+
+#include "skiplist.h"
+#include "skiplist_compact.h"
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <iostream>
+#include <new>
+#include <thread>
+#include <unistd.h>
+
+// Count every heap allocation, as skiplist.cc does.
+static unsigned long s_allocs( 0 );
+static unsigned long long s_alloc_bytes( 0 );
+
+static void * counted_alloc( std::size_t sz ) {
+    ++s_allocs;
+    s_alloc_bytes += sz;
+    if( void * p = std::malloc( sz ) ) {
+	return p;
+    }
+    throw std::bad_alloc();
+}
+
+void * operator new( std::size_t sz ) {
+    return counted_alloc( sz );
+}
+void * operator new[]( std::size_t sz ) {
+    return counted_alloc( sz );
+}
+void operator delete( void * p ) noexcept {
+    std::free( p );
+}
+void operator delete[]( void * p ) noexcept {
+    std::free( p );
+}
+void operator delete( void * p, std::size_t ) noexcept {
+    std::free( p );
+}
+void operator delete[]( void * p, std::size_t ) noexcept {
+    std::free( p );
+}
+
+namespace {
+    typedef std::uint64_t bench_value;
+    typedef std::chrono::steady_clock bench_clock;
+
+    // Resident set size now, unlike ru_maxrss, which only ever grows.
+    long rss_kib() {
+	long pages( 0 ), resident( 0 );
+	if( FILE * f = std::fopen( "/proc/self/statm", "r" ) ) {
+	    if( std::fscanf( f, "%ld %ld", &pages, &resident ) != 2 ) resident = 0;
+	    std::fclose( f );
+	}
+	return resident * ( ::sysconf( _SC_PAGESIZE ) / 1024 );
+    }
+
+    std::uint64_t mix( std::uint64_t x ) {
+	x += 0x9E3779B97F4A7C15ull;
+	x = ( x ^ ( x >> 30 ) ) * 0xBF58476D1CE4E5B9ull;
+	x = ( x ^ ( x >> 27 ) ) * 0x94D049BB133111EBull;
+	return x ^ ( x >> 31 );
+    }
+
+    class rng {
+	std::uint64_t m_state;
+    public:
+	explicit rng( std::uint64_t seed ) : m_state( seed ) {}
+	std::uint64_t operator()() {
+	    return mix( m_state++ );
+	}
+	double uniform() {
+	    return ( (*this)() >> 11 ) * ( 1.0 / 9007199254740992.0 );
+	}
+    };
+
+    /*
+      Zipfian ranks in [0,n), after Gray et al, "Quickly generating
+      billion-record synthetic databases"; the generator YCSB uses.
+    */
+    class zipf {
+	std::size_t m_n;
+	double m_theta, m_alpha, m_zetan, m_eta;
+    public:
+	zipf( std::size_t n, double theta=0.99 ) : m_n( n ), m_theta( theta ) {
+	    double zeta2( 0 );
+	    m_zetan = 0;
+	    for( std::size_t i(1); i<=n; ++i ) {
+		m_zetan += 1.0 / std::pow( double( i ), theta );
+		if( i == 2 ) zeta2 = m_zetan;
+	    }
+	    if( n < 2 ) zeta2 = m_zetan;
+	    m_alpha = 1.0 / ( 1.0 - theta );
+	    m_eta = ( 1.0 - std::pow( 2.0 / n, 1.0 - theta ) ) / ( 1.0 - zeta2 / m_zetan );
+	}
+	std::size_t operator()( rng & r ) const {
+	    double u( r.uniform() );
+	    double uz( u * m_zetan );
+	    if( uz < 1.0 ) return 0;
+	    if( uz < 1.0 + std::pow( 0.5, m_theta ) ) return 1 < m_n ? 1 : 0;
+	    std::size_t k( static_cast<std::size_t>( m_n * std::pow( m_eta * u - m_eta + 1.0, m_alpha ) ) );
+	    return k < m_n ? k : m_n - 1;
+	}
+    };
+
+    // Key i of a run, scattered so insertion order isn't key order.
+    template< typename K > struct key_maker;
+    template<> struct key_maker<std::uint64_t> {
+	static char const * name() {
+	    return "u64";
+	}
+	static std::uint64_t make( std::uint64_t i ) {
+	    return mix( i );
+	}
+	static std::uint64_t sequential( std::uint64_t i ) {
+	    return i;
+	}
+    };
+    template<> struct key_maker<std::string> {
+	static char const * name() {
+	    return "string";
+	}
+	static std::string make( std::uint64_t i ) {
+	    char buf[32];
+	    std::snprintf( buf, sizeof(buf), "user:%016llx", static_cast<unsigned long long>( mix( i ) ) );
+	    return buf;
+	}
+	static std::string sequential( std::uint64_t i ) {
+	    char buf[32];
+	    std::snprintf( buf, sizeof(buf), "user:%016llx", static_cast<unsigned long long>( i ) );
+	    return buf;
+	}
+    };
+
+    /*
+      Timing for one workload. Every 16th operation is timed on its own
+      for the percentiles; the rate comes from the loop as a whole.
+    */
+    class stopwatch {
+	bench_clock::time_point m_start;
+	std::vector<std::uint32_t> m_samples;
+	unsigned long m_allocs;
+	unsigned long long m_alloc_bytes;
+	long m_rss;
+    public:
+	static const unsigned int sample_every = 16;
+	// Reserves room for the samples first, so they aren't counted.
+	explicit stopwatch( std::size_t ops ) {
+	    m_samples.reserve( ops / sample_every + 1 );
+	    m_allocs = s_allocs;
+	    m_alloc_bytes = s_alloc_bytes;
+	    m_rss = rss_kib();
+	    m_start = bench_clock::now();
+	}
+	void sample( bench_clock::time_point from ) {
+	    m_samples.push_back( static_cast<std::uint32_t>( std::chrono::duration_cast<std::chrono::nanoseconds>( bench_clock::now() - from ).count() ) );
+	}
+	void report( char const * map, char const * key, char const * workload, std::size_t size, std::size_t ops ) {
+	    double secs( std::chrono::duration<double>( bench_clock::now() - m_start ).count() );
+	    unsigned long allocs( s_allocs - m_allocs );
+	    unsigned long long alloc_bytes( s_alloc_bytes - m_alloc_bytes );
+	    long rss( rss_kib() - m_rss );
+	    std::cout << map << '\t' << key << '\t' << workload << '\t' << size << '\t' << ops << '\t'
+		      << static_cast<unsigned long>( ops / secs ) << '\t'
+		      << percentile( 0.5 ) << '\t' << percentile( 0.99 ) << '\t' << percentile( 0.999 ) << '\t'
+		      << allocs << '\t' << alloc_bytes << '\t' << rss << std::endl;
+	}
+    private:
+	std::uint32_t percentile( double p ) {
+	    if( m_samples.empty() ) return 0;
+	    std::size_t i( static_cast<std::size_t>( p * ( m_samples.size() - 1 ) ) );
+	    std::nth_element( m_samples.begin(), m_samples.begin() + i, m_samples.end() );
+	    return m_samples[i];
+	}
+    };
+
+    // Runs op(i) for i in [0,ops), timing a sample of them.
+    template< typename F > void timed( stopwatch & w, std::size_t ops, F op ) {
+	for( std::size_t i(0); i<ops; ++i ) {
+	    if( i % stopwatch::sample_every ) {
+		op( i );
+	    } else {
+		bench_clock::time_point t( bench_clock::now() );
+		op( i );
+		w.sample( t );
+	    }
+	}
+    }
+
+    // Defeats dead code elimination of lookups.
+    volatile bench_value s_sink;
+
+    template< typename M, typename K > bool lookup( M & m, K const & k ) {
+	typename M::iterator i( m.lower_bound( k ) );
+	if( i == m.end() || (*i).first != k ) return false;
+	s_sink = (*i).second;
+	return true;
+    }
+
+    template< typename M > void run( char const * name, std::size_t n ) {
+	typedef typename M::key_type K;
+	typedef key_maker<K> keys;
+	char const * kname( keys::name() );
+	std::size_t ops( n < 100000 ? 10 * n : n );
+
+	{
+	    stopwatch w( n );
+	    M m;
+	    timed( w, n, [&]( std::size_t i ) {
+		m.insert( std::make_pair( keys::sequential( i ), bench_value( i ) ) );
+	    } );
+	    w.report( name, kname, "seq_insert", n, n );
+	}
+
+	// The rest share one map, built at random.
+	std::vector<K> present;
+	present.reserve( n );
+	for( std::size_t i(0); i<n; ++i ) {
+	    present.push_back( keys::make( i ) );
+	}
+	M m;
+	{
+	    stopwatch w( n );
+	    timed( w, n, [&]( std::size_t i ) {
+		m.insert( std::make_pair( present[i], bench_value( i ) ) );
+	    } );
+	    w.report( name, kname, "rand_insert", n, n );
+	}
+	{
+	    rng r( 1 );
+	    stopwatch w( ops );
+	    timed( w, ops, [&]( std::size_t ) {
+		lookup( m, present[r() % n] );
+	    } );
+	    w.report( name, kname, "rand_find", n, ops );
+	}
+	{
+	    // In key order, as a merge join would.
+	    std::vector<K> ordered( present );
+	    std::sort( ordered.begin(), ordered.end() );
+	    stopwatch w( ops );
+	    timed( w, ops, [&]( std::size_t i ) {
+		lookup( m, ordered[i % n] );
+	    } );
+	    w.report( name, kname, "seq_find", n, ops );
+	}
+	zipf z( n );
+	{
+	    rng r( 3 );
+	    stopwatch w( ops );
+	    timed( w, ops, [&]( std::size_t ) {
+		lookup( m, present[z( r )] );
+	    } );
+	    w.report( name, kname, "zipf_find", n, ops );
+	}
+	{
+	    // Scans of 100 entries from random places.
+	    rng r( 4 );
+	    std::size_t scans( ops / 100 );
+	    stopwatch w( scans );
+	    timed( w, scans, [&]( std::size_t ) {
+		typename M::iterator i( m.lower_bound( present[r() % n] ) );
+		bench_value sum( 0 );
+		for( int j(0); j<100 && i!=m.end(); ++j, ++i ) {
+		    sum += (*i).second;
+		}
+		s_sink = sum;
+	    } );
+	    w.report( name, kname, "range_scan", n, scans );
+	}
+	{
+	    // 90% zipfian reads, the rest split between new keys and erasures.
+	    rng r( 5 );
+	    std::uint64_t next( n );
+	    stopwatch w( ops );
+	    timed( w, ops, [&]( std::size_t ) {
+		std::uint64_t op( r() % 100 );
+		std::size_t at( z( r ) % present.size() );
+		if( op < 90 ) {
+		    lookup( m, present[at] );
+		} else if( op & 1 ) {
+		    K k( keys::make( next++ ) );
+		    m.insert( std::make_pair( k, bench_value( op ) ) );
+		    present.push_back( k );
+		} else if( present.size() > 1 ) {
+		    m.erase( present[at] );
+		    present[at] = present.back();
+		    present.pop_back();
+		}
+	    } );
+	    w.report( name, kname, "mixed_90_10", n, ops );
+	}
+	{
+	    // Erase a random entry, insert a fresh one; size stays put.
+	    rng r( 6 );
+	    std::uint64_t next( 2 * n + ops );
+	    stopwatch w( ops );
+	    timed( w, ops, [&]( std::size_t ) {
+		std::size_t at( r() % present.size() );
+		m.erase( present[at] );
+		K k( keys::make( next++ ) );
+		m.insert( std::make_pair( k, bench_value( at ) ) );
+		present[at] = k;
+	    } );
+	    w.report( name, kname, "erase_churn", n, ops );
+	}
+    }
+
+    /*
+      Scheduler churn: n timers pending; each op expires the earliest
+      and schedules a new one a random delay after it.
+    */
+    typedef std::pair<std::uint64_t,bench_value> timer;
+
+    template< typename M > struct timer_queue {
+	M m_queue;
+	void push( timer const & t ) {
+	    m_queue.insert( t );
+	}
+	timer pop() {
+	    timer t( *m_queue.begin() );
+	    m_queue.erase( m_queue.begin() );
+	    return t;
+	}
+    };
+    template< typename K, typename V > struct timer_queue< skip::multimap<K,V> > {
+	skip::multimap<K,V> m_queue;
+	void push( timer const & t ) {
+	    m_queue.insert( t );
+	}
+	timer pop() {
+	    timer t( m_queue.front() );
+	    m_queue.pop_front();
+	    return t;
+	}
+    };
+    template< typename T, typename C, typename L > struct timer_queue< std::priority_queue<T,C,L> > {
+	std::priority_queue<T,C,L> m_queue;
+	void push( timer const & t ) {
+	    m_queue.push( t );
+	}
+	timer pop() {
+	    timer t( m_queue.top() );
+	    m_queue.pop();
+	    return t;
+	}
+    };
+
+    template< typename Q > void run_scheduler( char const * name, std::size_t n ) {
+	std::size_t ops( n < 100000 ? 10 * n : n );
+	rng r( 7 );
+	Q q;
+	for( std::size_t i(0); i<n; ++i ) {
+	    q.push( timer( r() % ( 4 * n ), i ) );
+	}
+	stopwatch w( ops );
+	timed( w, ops, [&]( std::size_t i ) {
+	    timer t( q.pop() );
+	    q.push( timer( t.first + 1 + r() % ( 4 * n ), i ) );
+	} );
+	w.report( name, "u64", "sched_churn", n, ops );
+    }
+
+    /*
+      Whole-map passes on 1, 2, 4... threads, up to the core count: a
+      build from sorted input, a for_each and a reduction.
+    */
+    void run_parallel( std::size_t n ) {
+	typedef skip::map<std::uint64_t,bench_value> M;
+	std::vector< std::pair<std::uint64_t,bench_value> > sorted;
+	sorted.reserve( n );
+	for( std::size_t i(0); i<n; ++i ) {
+	    sorted.push_back( std::make_pair( std::uint64_t( i ), bench_value( i ) ) );
+	}
+	unsigned int cores( std::thread::hardware_concurrency() );
+	for( unsigned int t(1); t<=( cores ? cores : 1 ); t = ( t*2 > cores && t < cores ) ? cores : t*2 ) {
+	    char name[32];
+	    M m;
+	    {
+		stopwatch w( 0 );
+		m.parallel_build( sorted.begin(), sorted.end(), t );
+		std::snprintf( name, sizeof(name), "par_build_%ut", t );
+		w.report( "skip::map", "u64", name, n, n );
+	    }
+	    {
+		stopwatch w( 0 );
+		m.parallel_for_each( m.begin(), m.end(), []( M::value_type & v ) {
+		    v.second = mix( v.second );
+		}, t );
+		std::snprintf( name, sizeof(name), "par_for_each_%ut", t );
+		w.report( "skip::map", "u64", name, n, n );
+	    }
+	    {
+		stopwatch w( 0 );
+		s_sink = m.parallel_reduce( m.begin(), m.end(), bench_value( 0 ), []( bench_value a, M::value_type const & v ) {
+		    return a ^ v.second;
+		}, []( bench_value a, bench_value b ) {
+		    return a ^ b;
+		}, t );
+		std::snprintf( name, sizeof(name), "par_reduce_%ut", t );
+		w.report( "skip::map", "u64", name, n, n );
+	    }
+	}
+    }
+
+    template< typename K > void run_all( std::size_t n ) {
+	run< skip::map<K,bench_value> >( "skip::map", n );
+	run< skip::multimap<K,bench_value> >( "skip::multimap", n );
+	run< skip::compact_map<K,bench_value> >( "skip::compact_map", n );
+	run< std::map<K,bench_value> >( "std::map", n );
+    }
+}
+
+int main( int argc, char ** argv ) {
+    std::vector<std::size_t> sizes;
+    for( int i(1); i<argc; ++i ) {
+	sizes.push_back( std::strtoul( argv[i], 0, 10 ) );
+    }
+    if( sizes.empty() ) {
+	sizes.push_back( 10000 );
+	sizes.push_back( 100000 );
+	sizes.push_back( 1000000 );
+    }
+    std::cout << "# latencies in ns, sampled every " << stopwatch::sample_every << " ops; allocations and rss_kib are deltas over the workload" << std::endl;
+    std::cout << "map\tkey\tworkload\tsize\tops\tops_per_sec\tp50_ns\tp99_ns\tp999_ns\tallocs\talloc_bytes\trss_kib" << std::endl;
+    for( std::size_t s(0); s<sizes.size(); ++s ) {
+	if( !sizes[s] ) continue;
+	run_all<std::uint64_t>( sizes[s] );
+	run_all<std::string>( sizes[s] );
+	run_scheduler< timer_queue< skip::multimap<std::uint64_t,bench_value> > >( "skip::multimap", sizes[s] );
+	run_scheduler< timer_queue< std::multimap<std::uint64_t,bench_value> > >( "std::multimap", sizes[s] );
+	run_scheduler< timer_queue< std::priority_queue< timer, std::vector<timer>, std::greater<timer> > > >( "std::priority_queue", sizes[s] );
+	run_parallel( sizes[s] );
+    }
+}
@@ -0,0 +1,380 @@
+// Copyright 2004-2006 Dave Cridland <dave@cridland.net>
+
+// Random operations on skip::map, skip::multimap, skip::set and
+// skip::multiset under each policy, checked after every step against
+// their std counterparts, with every level of the list verified by
+// check(). Indexed policies have nth, rank, index_of and distance
+// checked against positions counted in the std container. erase_if,
+// range erase, reverse_lower_bound and pops from either end are among
+// the steps, iteration is checked both ways, and each trial ends by
+// popping the container empty. Under std::less<>, find, count, the
+// bounds and erase are also given long keys, some out of int's range.
+// skip::unrolled_map, with small blocks so that they split and merge
+// often, is checked against std::map in the same way. Exits non-zero on
+// the first fault.
+// Usage: skiplist-compare [trials]
+
+#define SK_DEBUG_CHECK
+#include "skiplist.h"
+#include "skiplist_unrolled.h"
+#include <vector>
+#include <functional>
+#include <map>
+#include <set>
+#include <iterator>
+#include <iostream>
+#include <stdexcept>
+#include <type_traits>
+#include <cstdlib>
+#include <cstdint>
+
+namespace {
+    const int range( 600 );
+
+    class rng {
+	std::uint64_t m_state;
+    public:
+	rng( std::uint64_t seed ) : m_state( seed * 0x9E3779B97F4A7C15ull + 1 ) {}
+	std::uint64_t operator()() {
+	    m_state ^= m_state << 13;
+	    m_state ^= m_state >> 7;
+	    m_state ^= m_state << 17;
+	    return m_state;
+	}
+    };
+
+    void require( bool ok, char const * what ) {
+	if( !ok ) {
+	    throw std::runtime_error( what );
+	}
+    }
+
+    int key_of( std::pair<const int,int> const & v ) {
+	return v.first;
+    }
+    int key_of( int v ) {
+	return v;
+    }
+
+    // What a step inserts: an entry into a map, the key alone into a set.
+    std::pair<const int,int> entry( int k, int op, std::false_type ) {
+	return std::make_pair( k, op );
+    }
+    int entry( int k, int, std::true_type ) {
+	return k;
+    }
+
+    template< typename M, typename R > void same_keys( M const & m, R const & r ) {
+	require( m.size() == r.size(), "size differs" );
+	typename R::const_iterator j( r.begin() );
+	for( typename M::const_iterator i( m.begin() ); i!=m.end(); ++i, ++j ) {
+	    require( key_of( *i ) == key_of( *j ), "keys differ" );
+	}
+	typename R::const_reverse_iterator rj( r.rbegin() );
+	for( typename M::const_reverse_iterator i( m.rbegin() ); i!=m.rend(); ++i, ++rj ) {
+	    require( key_of( *i ) == key_of( *rj ), "reverse iteration differs" );
+	}
+    }
+
+    // Where k would go in r, counted from the front.
+    template< typename R > std::size_t position( R const & r, int k ) {
+	return std::distance( r.begin(), r.lower_bound( k ) );
+    }
+
+    template< typename M, typename R > void positions( M &, R const &, rng &, std::false_type ) {
+    }
+
+    // A few positions and keys at random; std::next costs O(n), so not every one.
+    template< typename M, typename R > void positions( M & m, R const & r, rng & rnd, std::true_type ) {
+	std::size_t p( rnd() % ( m.size() + 1 ) );
+	typename M::iterator i( m.nth( p ) );
+	typename R::const_iterator j( std::next( r.begin(), p ) );
+	require( ( i == m.end() ) == ( j == r.end() ), "nth disagrees about the end" );
+	require( j == r.end() || key_of( *i ) == key_of( *j ), "nth found the wrong key" );
+	require( m.index_of( i ) == p, "index_of disagrees with nth" );
+	int a( rnd() % range ), b( rnd() % range );
+	require( m.rank( a ) == position( r, a ), "rank differs" );
+	std::ptrdiff_t d( static_cast<std::ptrdiff_t>( position( r, b ) ) - static_cast<std::ptrdiff_t>( position( r, a ) ) );
+	require( m.distance( m.lower_bound( a ), m.lower_bound( b ) ) == d, "distance differs" );
+    }
+
+    template< typename M, typename R > void walk_positions( M &, R const &, std::false_type ) {
+    }
+
+    // Every position, after a trial.
+    template< typename M, typename R > void walk_positions( M & m, R const & r, std::true_type ) {
+	std::size_t p( 0 );
+	typename M::const_iterator i( m.begin() );
+	for( typename R::const_iterator j( r.begin() ); j!=r.end(); ++j, ++i, ++p ) {
+	    require( key_of( *m.nth( p ) ) == key_of( *j ), "nth found the wrong key" );
+	    require( m.index_of( i ) == p, "index_of differs" );
+	}
+	require( m.nth( p ) == m.end() && m.index_of( m.end() ) == p, "end isn't at size()" );
+    }
+
+    // Keys in [lo,hi), or with a given remainder.
+    class doomed {
+	int m_lo;
+	int m_hi;
+	int m_mod;
+    public:
+	doomed( int lo, int hi, int mod ) : m_lo( lo ), m_hi( hi ), m_mod( mod ) {}
+	template< typename V > bool operator()( V const & v ) const {
+	    int k( key_of( v ) );
+	    return ( m_lo <= k && k < m_hi ) || k % 97 == m_mod;
+	}
+    };
+
+    template< typename C, typename=void > struct transparent : std::false_type {
+    };
+    template< typename C > struct transparent< C, std::void_t<typename C::is_transparent> > : std::true_type {
+    };
+
+    template< typename M, typename R > void lookups( M &, R &, rng &, std::false_type ) {
+    }
+
+    /*
+      By a long, through the transparent overloads. Half the keys are
+      beyond int's range, so they must miss; converted to int, they'd
+      wrap round onto keys that are there.
+    */
+    template< typename M, typename R > void lookups( M & m, R & r, rng & rnd, std::true_type ) {
+	long k( rnd() % range );
+	if( rnd() & 1 ) k += ( rnd() & 1 ) ? ( 1L << 32 ) : -( 1L << 32 );
+	require( m.count( k ) == r.count( k ), "transparent count differs" );
+	require( ( m.find( k ) == m.end() ) == ( r.find( k ) == r.end() ), "transparent find differs" );
+	require( m.lower_bound( k ) == m.end() ? r.lower_bound( k ) == r.end() : key_of( *m.lower_bound( k ) ) == key_of( *r.lower_bound( k ) ), "transparent lower_bound differs" );
+	require( m.upper_bound( k ) == m.end() ? r.upper_bound( k ) == r.end() : key_of( *m.upper_bound( k ) ) == key_of( *r.upper_bound( k ) ), "transparent upper_bound differs" );
+	std::pair<typename M::iterator,typename M::iterator> e( m.equal_range( k ) );
+	require( static_cast<std::size_t>( std::distance( e.first, e.second ) ) == r.count( k ), "transparent equal_range differs" );
+	if( rnd() & 1 ) {
+	    // std's own erase by another type only comes with C++23.
+	    std::size_t n( r.count( k ) );
+	    r.erase( r.lower_bound( k ), r.upper_bound( k ) );
+	    require( m.erase( k ) == n, "transparent erase count differs" );
+	}
+    }
+
+    // Off one end or the other, as a queue would, after checking both ends.
+    template< typename M, typename R > void pop( M & m, R & r, rng & rnd ) {
+	if( r.empty() ) {
+	    require( m.empty() && m.last() == m.end(), "last of an empty map isn't end" );
+	    return;
+	}
+	require( key_of( m.front() ) == key_of( *r.begin() ) && key_of( m.back() ) == key_of( *r.rbegin() ), "front or back differs" );
+	require( m.last() != m.end() && key_of( *m.last() ) == key_of( *r.rbegin() ), "last differs" );
+	if( rnd() & 1 ) {
+	    m.pop_front();
+	    r.erase( r.begin() );
+	} else {
+	    m.pop_back();
+	    r.erase( std::prev( r.end() ) );
+	}
+    }
+
+    template< typename M, typename R > void step( M & m, R & r, rng & rnd, int op ) {
+	typedef std::is_same<typename R::key_type, typename R::value_type> keys_only;
+	int k( rnd() % range );
+	switch( rnd() % 16 ) {
+	case 0: {
+	    // Erase whole runs, and scattered keys between them.
+	    doomed pred( k, k + rnd() % 60, rnd() % 97 );
+	    std::size_t n( 0 );
+	    for( typename R::iterator j( r.begin() ); j!=r.end(); ) {
+		if( pred( *j ) ) {
+		    j = r.erase( j );
+		    ++n;
+		} else {
+		    ++j;
+		}
+	    }
+	    require( m.erase_if( pred ) == n, "erase_if count differs" );
+	    break;
+	}
+	case 1: {
+	    int l( k + rnd() % 40 );
+	    typename R::iterator j( r.erase( r.lower_bound( k ), r.upper_bound( l ) ) );
+	    typename M::iterator i( m.erase( m.lower_bound( k ), m.upper_bound( l ) ) );
+	    require( ( i == m.end() ) == ( j == r.end() ) && ( j == r.end() || key_of( *i ) == key_of( *j ) ), "range erase returned the wrong entry" );
+	    break;
+	}
+	case 2:
+	    // Empty ranges, at either end too.
+	    m.erase( m.lower_bound( k ), m.lower_bound( k ) );
+	    m.erase( m.end(), m.end() );
+	    m.erase( m.begin(), m.begin() );
+	    break;
+	case 3: {
+	    // A few steps back from k.
+	    typename M::reverse_iterator i( m.reverse_lower_bound( k ) );
+	    typename R::reverse_iterator j( std::make_reverse_iterator( r.upper_bound( k ) ) );
+	    for( int n(0); n<4 && j!=r.rend(); ++n, ++i, ++j ) {
+		require( i != m.rend() && key_of( *i ) == key_of( *j ), "reverse_lower_bound differs" );
+	    }
+	    require( ( i == m.rend() ) == ( j == r.rend() ), "reverse_lower_bound disagrees about the end" );
+	    break;
+	}
+	case 4:
+	    pop( m, r, rnd );
+	    break;
+	case 5:
+	    lookups( m, r, rnd, transparent<typename R::key_compare>() );
+	    break;
+	default:
+	    if( rnd() % 2 ) {
+		m.insert( entry( k, op, keys_only() ) );
+		r.insert( entry( k, op, keys_only() ) );
+	    } else {
+		require( m.erase( k ) == r.erase( k ), "erase count differs" );
+	    }
+	    break;
+	}
+    }
+
+    template< typename M, typename R > void run( char const * name, unsigned int trials ) {
+	typedef std::integral_constant<bool, M::parent_type::policy_type::indexed> indexed;
+	for( unsigned int t(0); t<trials; ++t ) {
+	    rng rnd( t + 1 );
+	    M m;
+	    R r;
+	    m.seed( t + 1 );
+	    for( int op(0); op<300; ++op ) {
+		step( m, r, rnd, op );
+		m.check();
+		positions( m, r, rnd, indexed() );
+	    }
+	    same_keys( m, r );
+	    walk_positions( m, r, indexed() );
+	    // Then empty it from both ends.
+	    while( !r.empty() ) {
+		pop( m, r, rnd );
+		m.check();
+	    }
+	    pop( m, r, rnd );
+	}
+	std::cout << name << "\tok" << std::endl;
+    }
+
+    template< typename M, typename R > void same_entries( M const & m, R const & r ) {
+	require( m.size() == r.size(), "size differs" );
+	typename R::const_iterator j( r.begin() );
+	for( typename M::const_iterator i( m.begin() ); i!=m.end(); ++i, ++j ) {
+	    require( i->first == j->first && i->second == j->second, "entries differ" );
+	}
+	typename R::const_reverse_iterator rj( r.rbegin() );
+	for( typename M::const_reverse_iterator i( m.rbegin() ); i!=m.rend(); ++i, ++rj ) {
+	    require( i->first == rj->first, "reverse iteration differs" );
+	}
+    }
+
+    // Each of unrolled_map's ways in and out, against std::map.
+    template< typename M, typename R > void step_unrolled( M & m, R & r, rng & rnd, int op ) {
+	int k( rnd() % range );
+	M const & c( m );
+	switch( rnd() % 10 ) {
+	case 0:
+	    require( m.insert( std::make_pair( k, op ) ).first == r.insert( std::make_pair( k, op ) ).second, "insert disagrees" );
+	    break;
+	case 1: {
+	    // A hint that's right, or anywhere at all.
+	    typename M::iterator hint( rnd() & 1 ? m.lower_bound( k ) : m.lower_bound( rnd() % range ) );
+	    typename M::iterator i( m.insert( hint, std::make_pair( k, op ) ) );
+	    require( i->first == k, "hinted insert returned the wrong entry" );
+	    r.insert( std::make_pair( k, op ) );
+	    break;
+	}
+	case 2:
+	    require( m.emplace( k, op ).first == r.emplace( k, op ).second, "emplace disagrees" );
+	    break;
+	case 3:
+	    require( m.try_emplace( k, op ).first == r.try_emplace( k, op ).second, "try_emplace disagrees" );
+	    break;
+	case 4:
+	    m[k] += op;
+	    r[k] += op;
+	    break;
+	case 5:
+	    require( m.erase( k ) == r.erase( k ), "erase count differs" );
+	    break;
+	case 6: {
+	    typename M::iterator i( m.find( k ) );
+	    if( i != m.end() ) {
+		typename R::iterator j( r.erase( r.find( k ) ) );
+		i = m.erase( i );
+		require( ( i == m.end() ) == ( j == r.end() ) && ( j == r.end() || i->first == j->first ), "erase returned the wrong entry" );
+	    }
+	    break;
+	}
+	case 7: {
+	    int l( k + rnd() % 40 );
+	    if( r.key_comp()( l, k ) ) std::swap( k, l );
+	    typename R::iterator j( r.erase( r.lower_bound( k ), r.lower_bound( l ) ) );
+	    typename M::iterator i( m.erase( m.lower_bound( k ), m.lower_bound( l ) ) );
+	    require( ( i == m.end() ) == ( j == r.end() ) && ( j == r.end() || i->first == j->first ), "range erase returned the wrong entry" );
+	    break;
+	}
+	default:
+	    require( c.count( k ) == r.count( k ), "count differs" );
+	    require( ( c.find( k ) == c.end() ) == ( r.find( k ) == r.end() ), "find differs" );
+	    require( ( c.lower_bound( k ) == c.end() ) == ( r.lower_bound( k ) == r.end() ), "lower_bound differs" );
+	    require( c.upper_bound( k ) == c.end() || c.upper_bound( k )->first == r.upper_bound( k )->first, "upper_bound differs" );
+	    break;
+	}
+    }
+
+    template< typename M, typename R > void run_unrolled( char const * name, unsigned int trials ) {
+	for( unsigned int t(0); t<trials; ++t ) {
+	    rng rnd( t + 1 );
+	    M m;
+	    R r;
+	    for( int op(0); op<600; ++op ) {
+		step_unrolled( m, r, rnd, op );
+	    }
+	    same_entries( m, r );
+	    // Built from the std map, in order, and from a shuffled copy.
+	    std::vector< std::pair<int,int> > v( r.begin(), r.end() );
+	    same_entries( M( v.begin(), v.end() ), r );
+	    for( std::size_t i( v.size() ); i>1; --i ) {
+		std::swap( v[i-1], v[rnd() % i] );
+	    }
+	    same_entries( M( v.begin(), v.end() ), r );
+	    m.clear();
+	    require( m.empty() && m.begin() == m.end(), "clear left entries" );
+	    m.insert( std::make_pair( 1, 1 ) );
+	    require( m.size() == 1, "clear left the map unusable" );
+	}
+	std::cout << name << "\tok" << std::endl;
+    }
+
+    template< typename P, typename L=std::less<int> > void run_maps( char const * map_name, char const * multimap_name, unsigned int trials ) {
+	run< skip::map<int,int,L,std::allocator< std::pair<const int,int> >,P>, std::map<int,int,L> >( map_name, trials );
+	run< skip::multimap<int,int,L,std::allocator< std::pair<const int,int> >,P>, std::multimap<int,int,L> >( multimap_name, trials );
+    }
+
+    template< typename P, typename L=std::less<int> > void run_sets( char const * set_name, char const * multiset_name, unsigned int trials ) {
+	run< skip::set<int,L,std::allocator<int>,P>, std::set<int,L> >( set_name, trials );
+	run< skip::multiset<int,L,std::allocator<int>,P>, std::multiset<int,L> >( multiset_name, trials );
+    }
+}
+
+int main( int argc, char ** argv ) {
+    unsigned int trials( argc > 1 ? std::atoi( argv[1] ) : 100 );
+    try {
+	run_maps<skip::default_policy>( "map", "multimap", trials );
+	run_maps<skip::cached_keys_policy>( "map/cached", "multimap/cached", trials );
+	run_maps<skip::indexed_policy>( "map/indexed", "multimap/indexed", trials );
+	run_maps< skip::fixed_policy<16,2> >( "map/fixed", "multimap/fixed", trials );
+	run_sets<skip::default_policy>( "set", "multiset", trials );
+	run_sets<skip::cached_keys_policy>( "set/cached", "multiset/cached", trials );
+	run_sets<skip::indexed_policy>( "set/indexed", "multiset/indexed", trials );
+	run_sets< skip::fixed_policy<16,2> >( "set/fixed", "multiset/fixed", trials );
+	run_maps< skip::default_policy, std::less<> >( "map/transparent", "multimap/transparent", trials );
+	run_sets< skip::indexed_policy, std::less<> >( "set/transparent", "multiset/transparent", trials );
+	run_unrolled< skip::unrolled_map<int,int,std::less<int>,std::allocator< std::pair<const int,int> >,8>, std::map<int,int> >( "unrolled", trials );
+	run_unrolled< skip::unrolled_map<int,int,std::greater<int>,std::allocator< std::pair<const int,int> >,8>, std::map<int,int,std::greater<int> > >( "unrolled/greater", trials );
+    } catch( std::exception & e ) {
+	std::cout << "FAILED: " << e.what() << std::endl;
+	return 1;
+    }
+    return 0;
+}
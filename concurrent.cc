@@ -0,0 +1,191 @@
+
+// Copyright 2004-2006 Dave Cridland <dave@cridland.net>
+
+// Multi-threaded throughput: skip::concurrent_map and skip::mvcc_map
+// against a skip::map behind a single mutex; then write throughput
+// while another thread keeps scanning the whole map.
+// Usage: skiplist-concurrent [max-threads [keys [ops-per-thread [read-percent]]]]
+
+#include "skiplist_concurrent.h"
+#include "skiplist_mvcc.h"
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include <cstdlib>
+#include <cstdint>
+
+namespace {
+    typedef unsigned long long bench_key;
+
+    class rng {
+	std::uint64_t m_state;
+    public:
+	rng( std::uint64_t seed ) : m_state( seed * 0x9E3779B97F4A7C15ull + 1 ) {}
+	std::uint64_t operator()() {
+	    m_state ^= m_state << 13;
+	    m_state ^= m_state >> 7;
+	    m_state ^= m_state << 17;
+	    return m_state;
+	}
+    };
+
+    class locked_map {
+	std::mutex m_mutex;
+	skip::map<bench_key,bench_key> m_map;
+    public:
+	bool insert( std::pair<const bench_key,bench_key> const & v ) {
+	    std::lock_guard<std::mutex> l( m_mutex );
+	    if( m_map.find( v.first ) != m_map.end() ) return false;
+	    m_map.insert( v );
+	    return true;
+	}
+	bool erase( bench_key k ) {
+	    std::lock_guard<std::mutex> l( m_mutex );
+	    if( m_map.find( k ) == m_map.end() ) return false;
+	    m_map.erase( k );
+	    return true;
+	}
+	bool find( bench_key k, bench_key & out ) {
+	    std::lock_guard<std::mutex> l( m_mutex );
+	    skip::map<bench_key,bench_key>::iterator i( m_map.find( k ) );
+	    if( i == m_map.end() ) return false;
+	    out = (*i).second;
+	    return true;
+	}
+	// A consistent scan has to keep the writers out for its duration.
+	bench_key scan() {
+	    std::lock_guard<std::mutex> l( m_mutex );
+	    bench_key sum( 0 );
+	    for( skip::map<bench_key,bench_key>::iterator i( m_map.begin() ); i != m_map.end(); ++i ) {
+		sum += (*i).second;
+	    }
+	    return sum;
+	}
+    };
+
+    bench_key scan( locked_map & m ) {
+	return m.scan();
+    }
+
+    bench_key scan( skip::mvcc_map<bench_key,bench_key> & m ) {
+	skip::mvcc_map<bench_key,bench_key>::view s( m.snapshot() );
+	bench_key sum( 0 );
+	for( skip::mvcc_map<bench_key,bench_key>::const_iterator i( s.begin() ); i != s.end(); ++i ) {
+	    sum += i->second;
+	}
+	return sum;
+    }
+
+    template< typename M > void worker( M * m, unsigned int id, bench_key keys, unsigned long ops, unsigned int reads, unsigned long * hits ) {
+	rng r( id + 1 );
+	unsigned long h( 0 );
+	for( unsigned long i(0); i<ops; ++i ) {
+	    bench_key k( r() % ( keys * 2 ) );
+	    unsigned int op( r() % 100 );
+	    if( op < reads ) {
+		bench_key v;
+		if( m->find( k, v ) ) ++h;
+	    } else if( op & 1 ) {
+		m->insert( std::make_pair( k, k ) );
+	    } else {
+		m->erase( k );
+	    }
+	}
+	*hits = h;
+    }
+
+    template< typename M > double run( char const * name, unsigned int threads, bench_key keys, unsigned long ops, unsigned int reads ) {
+	M m;
+	rng r( 0 );
+	for( bench_key i(0); i<keys; ++i ) {
+	    bench_key k( r() % ( keys * 2 ) );
+	    m.insert( std::make_pair( k, k ) );
+	}
+	std::vector<std::thread> pool;
+	std::vector<unsigned long> hits( threads );
+	std::chrono::steady_clock::time_point start( std::chrono::steady_clock::now() );
+	for( unsigned int t(0); t<threads; ++t ) {
+	    pool.push_back( std::thread( worker<M>, &m, t, keys, ops, reads, &hits[t] ) );
+	}
+	for( unsigned int t(0); t<threads; ++t ) {
+	    pool[t].join();
+	}
+	double secs( std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count() );
+	double rate( threads * ops / secs );
+	unsigned long found( 0 );
+	for( unsigned int t(0); t<threads; ++t ) {
+	    found += hits[t];
+	}
+	std::cout << name << "\t" << threads << "\t" << static_cast<unsigned long>( rate ) << "\t" << found << std::endl;
+	return rate;
+    }
+
+    // The sums are folded together and printed, so no scan can be dropped.
+    template< typename M > void scanner( M * m, std::atomic<bool> * stop, unsigned long * scans, bench_key * sink ) {
+	unsigned long n( 0 );
+	bench_key sum( 0 );
+	while( !stop->load() ) {
+	    sum += scan( *m );
+	    ++n;
+	}
+	*scans = n;
+	*sink = sum;
+    }
+
+    // Write-only workers, with one thread scanning alongside them.
+    template< typename M > double run_scanning( char const * name, unsigned int threads, bench_key keys, unsigned long ops ) {
+	M m;
+	rng r( 0 );
+	for( bench_key i(0); i<keys; ++i ) {
+	    bench_key k( r() % ( keys * 2 ) );
+	    m.insert( std::make_pair( k, k ) );
+	}
+	std::atomic<bool> stop( false );
+	unsigned long scans( 0 );
+	bench_key sink( 0 );
+	std::thread reader( scanner<M>, &m, &stop, &scans, &sink );
+	std::vector<std::thread> pool;
+	std::vector<unsigned long> hits( threads );
+	std::chrono::steady_clock::time_point start( std::chrono::steady_clock::now() );
+	for( unsigned int t(0); t<threads; ++t ) {
+	    pool.push_back( std::thread( worker<M>, &m, t, keys, ops, 0, &hits[t] ) );
+	}
+	for( unsigned int t(0); t<threads; ++t ) {
+	    pool[t].join();
+	}
+	double secs( std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count() );
+	stop.store( true );
+	reader.join();
+	double rate( threads * ops / secs );
+	std::cout << name << "\t" << threads << "\t" << static_cast<unsigned long>( rate ) << "\t" << scans << "\t" << sink << std::endl;
+	return rate;
+    }
+}
+
+int main( int argc, char ** argv ) {
+    unsigned int max_threads( argc > 1 ? std::atoi( argv[1] ) : std::thread::hardware_concurrency() );
+    bench_key keys( argc > 2 ? std::atoll( argv[2] ) : 1000000 );
+    unsigned long ops( argc > 3 ? std::atol( argv[3] ) : 1000000 );
+    unsigned int reads( argc > 4 ? std::atoi( argv[4] ) : 90 );
+    if( !max_threads ) max_threads = 1;
+    std::cout << "# " << keys << " keys, " << ops << " ops/thread, " << reads << "% reads" << std::endl;
+    std::cout << "# map\tthreads\tops/sec\thits" << std::endl;
+    for( unsigned int t(1);; t*=2 ) {
+	if( t > max_threads ) t = max_threads;
+	run< skip::concurrent_map<bench_key,bench_key> >( "concurrent_map", t, keys, ops, reads );
+	run< skip::mvcc_map<bench_key,bench_key> >( "mvcc_map", t, keys, ops, reads );
+	run< locked_map >( "mutex+map", t, keys, ops, reads );
+	if( t == max_threads ) break;
+    }
+    std::cout << "# writers with a full scan running throughout" << std::endl;
+    std::cout << "# map\tthreads\twrites/sec\tscans\tchecksum" << std::endl;
+    for( unsigned int t(1);; t*=2 ) {
+	if( t > max_threads ) t = max_threads;
+	run_scanning< skip::mvcc_map<bench_key,bench_key> >( "mvcc_map", t, keys, ops );
+	run_scanning< locked_map >( "mutex+map", t, keys, ops );
+	if( t == max_threads ) break;
+    }
+}
@@ -0,0 +1,162 @@
+// Copyright 2004-2006 Dave Cridland <dave@cridland.net>
+
+// Hinted, finger and plain inserts mixed with erases, checked after
+// every step against std::map and std::multimap, with every level of
+// the list verified by check(). Exits non-zero on the first fault.
+// Usage: skiplist-hint [trials]
+
+#define SK_DEBUG_CHECK
+#include "skiplist.h"
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <iostream>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdint>
+
+namespace {
+    class rng {
+	std::uint64_t m_state;
+    public:
+	rng( std::uint64_t seed ) : m_state( seed * 0x9E3779B97F4A7C15ull + 1 ) {}
+	std::uint64_t operator()() {
+	    m_state ^= m_state << 13;
+	    m_state ^= m_state >> 7;
+	    m_state ^= m_state << 17;
+	    return m_state;
+	}
+    };
+
+    void require( bool ok, char const * what ) {
+	if( !ok ) {
+	    throw std::runtime_error( what );
+	}
+    }
+
+    template< typename M, typename R > void same_keys( M const & m, R const & r ) {
+	require( m.size() == r.size(), "size differs" );
+	typename R::const_iterator j( r.begin() );
+	for( typename M::const_iterator i( m.begin() ); i!=m.end(); ++i, ++j ) {
+	    require( (*i).first == j->first, "keys differ" );
+	}
+    }
+
+    // A hint that's right, wrong, or at either end.
+    template< typename M > typename M::iterator pick_hint( M & m, int k, rng & r ) {
+	switch( r() % 4 ) {
+	case 0:
+	    return m.end();
+	case 1:
+	    return m.begin();
+	case 2:
+	    return m.lower_bound( k );
+	default:
+	    return m.lower_bound( static_cast<int>( r() % 4000 ) );
+	}
+    }
+
+    // Whether k belongs just before hint, as std::map has it.
+    template< typename M > bool fits( M & m, typename M::iterator hint, int k, bool multi ) {
+	if( hint != m.end() && ( multi ? (*hint).first < k : (*hint).first <= k ) ) return false;
+	if( hint == m.begin() ) return true;
+	typename M::iterator prev( hint );
+	--prev;
+	return multi ? (*prev).first <= k : (*prev).first < k;
+    }
+
+    template< typename M, typename R > void run( char const * name, bool multi, unsigned int trials ) {
+	for( unsigned int t(0); t<trials; ++t ) {
+	    rng r( t + 1 );
+	    M m;
+	    R ref;
+	    m.seed( t + 1 );
+	    m.finger_search( t & 1 );
+	    for( int op(0); op<400; ++op ) {
+		int k( r() % 2000 );
+		// Runs of ascending keys, as well as scattered ones.
+		if( op % 50 < 20 ) k = 2000 + 50 * ( op / 50 ) + op % 50;
+		switch( r() % 6 ) {
+		case 0:
+		case 1: {
+		    typename M::iterator hint( pick_hint( m, k, r ) );
+		    bool before( fits( m, hint, k, multi ) );
+		    typename M::iterator i( m.insert( hint, std::make_pair( k, op ) ) );
+		    require( (*i).first == k, "hinted insert returned the wrong entry" );
+		    if( before && ( multi || hint == m.end() || (*hint).first != k ) ) {
+			require( std::next( i ) == hint, "hinted insert ignored a good hint" );
+		    }
+		    if( multi || ref.find( k ) == ref.end() ) ref.insert( std::make_pair( k, op ) );
+		    break;
+		}
+		case 2:
+		case 3:
+		    m.insert( std::make_pair( k, op ) );
+		    if( multi || ref.find( k ) == ref.end() ) ref.insert( std::make_pair( k, op ) );
+		    break;
+		case 4:
+		    require( m.erase( k ) == ref.erase( k ), "erase count differs" );
+		    break;
+		default:
+		    if( m.size() ) {
+			m.erase( m.begin() );
+			ref.erase( ref.begin() );
+		    }
+		    break;
+		}
+		m.check();
+	    }
+	    same_keys( m, ref );
+	    // Erasing in scrambled order walks every level.
+	    std::vector<int> keys;
+	    for( typename R::const_iterator i( ref.begin() ); i!=ref.end(); ++i ) {
+		keys.push_back( i->first );
+	    }
+	    for( std::size_t i( keys.size() ); i>1; --i ) {
+		std::swap( keys[i-1], keys[r() % i] );
+	    }
+	    for( std::size_t i(0); i<keys.size(); ++i ) {
+		m.erase( keys[i] );
+		m.check();
+	    }
+	    require( m.size() == 0, "erase left entries behind" );
+	}
+	std::cout << name << "\tok" << std::endl;
+    }
+
+    // Appends, plain inserts, then more appends: the case that used to leave a stale finger.
+    void run_appends( unsigned int trials ) {
+	for( unsigned int t(0); t<trials; ++t ) {
+	    rng r( t + 1 );
+	    skip::map<int,int> m;
+	    m.seed( t + 1 );
+	    for( int i(0); i<16; ++i ) m.insert( std::make_pair( static_cast<int>( r() % 900 ), i ) );
+	    for( int i(0); i<10; ++i ) m.insert( m.end(), std::make_pair( 1000 + i, i ) );
+	    for( int i(0); i<10; ++i ) m.insert( std::make_pair( static_cast<int>( r() % 3000 ), i ) );
+	    for( int i(0); i<15; ++i ) m.insert( m.end(), std::make_pair( 2000 + i, i ) );
+	    m.check();
+	    // A hint at the front goes at the front.
+	    skip::map<int,int>::iterator i( m.insert( m.begin(), std::make_pair( -1, 0 ) ) );
+	    require( i == m.begin(), "hint at the front was ignored" );
+	    m.check();
+	}
+	std::cout << "appends\tok" << std::endl;
+    }
+}
+
+int main( int argc, char ** argv ) {
+    unsigned int trials( argc > 1 ? std::atoi( argv[1] ) : 200 );
+    try {
+	run_appends( trials );
+	run< skip::map<int,int>, std::map<int,int> >( "map", false, trials );
+	run< skip::multimap<int,int>, std::multimap<int,int> >( "multimap", true, trials );
+	run< skip::map<int,int,std::less<int>,std::allocator< std::pair<const int,int> >,skip::cached_keys_policy>, std::map<int,int> >( "map/cached", false, trials );
+	run< skip::map<int,int,std::less<int>,std::allocator< std::pair<const int,int> >,skip::indexed_policy>, std::map<int,int> >( "map/indexed", false, trials );
+	run< skip::multimap<int,int,std::less<int>,std::allocator< std::pair<const int,int> >,skip::fixed_policy<16,2> >, std::multimap<int,int> >( "multimap/fixed", true, trials );
+    } catch( std::exception & e ) {
+	std::cout << "FAILED: " << e.what() << std::endl;
+	return 1;
+    }
+    return 0;
+}
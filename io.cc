@@ -0,0 +1,168 @@
+// Copyright 2004-2006 Dave Cridland <dave@cridland.net>
+
+// skip::save and skip::load: round trips of raw and delta-encoded
+// integral keys and of string keys, empty maps included, through
+// streams and file descriptors; then every byte of a saved file is
+// flipped in turn, and each must be rejected on load, as must a block
+// claiming to be larger than any the saver writes.
+// Exits non-zero on the first fault.
+// Usage: skiplist-io
+
+#include "skiplist_io.h"
+#include <map>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdint>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+    void require( bool ok, char const * what ) {
+	if( !ok ) {
+	    throw std::runtime_error( what );
+	}
+    }
+
+    template< typename M, typename R > void same( M const & m, R const & r ) {
+	require( m.size() == r.size(), "size differs" );
+	typename R::const_iterator j( r.begin() );
+	for( typename M::const_iterator i( m.begin() ); i!=m.end(); ++i, ++j ) {
+	    require( (*i).first == j->first && (*i).second == j->second, "entries differ" );
+	}
+    }
+
+    template< typename M > std::string saved( M const & m, bool delta ) {
+	std::ostringstream os;
+	skip::save( m, os, delta );
+	return os.str();
+    }
+
+    template< typename M > bool rejected( std::string const & bytes ) {
+	std::istringstream is( bytes );
+	try {
+	    skip::load<M>( is );
+	} catch( std::runtime_error const & ) {
+	    return true;
+	}
+	return false;
+    }
+
+    // Saves, loads and compares; returns the size of the file.
+    template< typename K, typename V, typename F > std::size_t round_trip( char const * name, F entry, int n, bool delta ) {
+	typedef skip::map<K,V> map_type;
+	map_type m;
+	std::map<K,V> ref;
+	for( int i(0); i<n; ++i ) {
+	    std::pair<K,V> e( entry( i ) );
+	    m[e.first] = e.second;
+	    ref[e.first] = e.second;
+	}
+	std::string bytes( saved( m, delta ) );
+	std::istringstream is( bytes );
+	map_type loaded( skip::load<map_type>( is ) );
+	same( loaded, ref );
+	// A file cut short is damaged too.
+	require( rejected<map_type>( bytes.substr( 0, bytes.size() - 1 ) ), "truncated file was accepted" );
+	std::cout << name << "\t" << n << "\t" << ( delta && std::is_integral<K>::value ? "delta" : "plain" ) << "\t" << bytes.size() << " bytes" << std::endl;
+	return bytes.size();
+    }
+
+    std::pair<long,double> spaced( int i ) {
+	return std::make_pair( static_cast<long>( i ) * 7 - 1000, i * 0.5 );
+    }
+    std::pair<std::string,std::string> words( int i ) {
+	return std::make_pair( std::to_string( i * 31 ), std::string( i % 17, 'x' ) );
+    }
+
+    void run_round_trips() {
+	int const sizes[] = { 0, 1, 1000, 100000 };
+	for( unsigned int s(0); s<sizeof(sizes)/sizeof(sizes[0]); ++s ) {
+	    std::size_t raw( round_trip<long,double>( "long/raw", spaced, sizes[s], false ) );
+	    std::size_t delta( round_trip<long,double>( "long/delta", spaced, sizes[s], true ) );
+	    require( sizes[s] < 1000 || delta < raw, "delta keys took more room than raw" );
+	    round_trip<std::string,std::string>( "string", words, sizes[s], true );
+	}
+    }
+
+    // Through a file descriptor, as a multimap with repeated keys.
+    void run_fd() {
+	skip::multimap<int,int> m;
+	std::multimap<int,int> ref;
+	for( int i(0); i<50000; ++i ) {
+	    m.insert( std::make_pair( i / 3, i ) );
+	}
+	for( skip::multimap<int,int>::const_iterator i( m.begin() ); i!=m.end(); ++i ) {
+	    ref.insert( ref.end(), *i );
+	}
+	char path[] = "/tmp/skiplist-io-XXXXXX";
+	int fd( ::mkstemp( path ) );
+	require( fd >= 0, "can't make a temporary file" );
+	::unlink( path );
+	skip::save( m, fd );
+	::lseek( fd, 0, SEEK_SET );
+	skip::multimap<int,int> loaded( skip::load< skip::multimap<int,int> >( fd ) );
+	::close( fd );
+	same( loaded, ref );
+	std::cout << "fd\tok" << std::endl;
+    }
+
+    // Every byte matters: header, lengths, entries, checksums and the end block.
+    template< typename M > void flip_every_byte( char const * name, M const & m, bool delta ) {
+	std::string bytes( saved( m, delta ) );
+	for( std::size_t i(0); i<bytes.size(); ++i ) {
+	    std::string bad( bytes );
+	    bad[i] ^= 0x10;
+	    require( rejected<M>( bad ), "a flipped byte was accepted" );
+	}
+	std::cout << name << "\tok\t" << bytes.size() << " bytes flipped" << std::endl;
+    }
+
+    // A block length no saver could write is refused before room is made for it.
+    template< typename M > void oversized( char const * name, M const & m, bool delta, char const * why ) {
+	std::string bytes( saved( m, delta ) );
+	std::uint32_t len( 0xFFFFFFF0u );
+	bytes.replace( sizeof(skip::io_header), sizeof(len), reinterpret_cast<char const *>( &len ), sizeof(len) );
+	std::istringstream is( bytes );
+	try {
+	    skip::load<M>( is );
+	} catch( std::runtime_error const & e ) {
+	    require( std::string( e.what() ).find( why ) != std::string::npos, "oversized block rejected for the wrong reason" );
+	    std::cout << name << "\tok" << std::endl;
+	    return;
+	}
+	require( false, "an oversized block was accepted" );
+    }
+
+    void run_corruption() {
+	skip::map<long,double> numbers;
+	skip::map<std::string,std::string> strings;
+	for( int i(0); i<40; ++i ) {
+	    numbers.insert( spaced( i ) );
+	    strings.insert( words( i ) );
+	}
+	flip_every_byte( "flip/raw", numbers, false );
+	flip_every_byte( "flip/delta", numbers, true );
+	flip_every_byte( "flip/string", strings, true );
+	flip_every_byte( "flip/empty", skip::map<long,double>(), true );
+	require( rejected< skip::map<int,double> >( saved( numbers, false ) ), "loaded a file of another type" );
+	oversized( "huge/raw", numbers, false, "bad block length" );
+	oversized( "huge/delta", numbers, true, "bad block length" );
+	oversized( "huge/string", strings, true, "truncated file" );
+    }
+}
+
+int main() {
+    try {
+	run_round_trips();
+	run_fd();
+	run_corruption();
+    } catch( std::exception & e ) {
+	std::cout << "FAILED: " << e.what() << std::endl;
+	return 1;
+    }
+    return 0;
+}
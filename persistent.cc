@@ -0,0 +1,204 @@
+// Copyright 2004-2006 Dave Cridland <dave@cridland.net>
+
+// skip::persistent_map on a local file: create, insert, erase, close and
+// reopen, checked against std::map, and iterators held while the file
+// grows; then recovery after the writer dies partway through an insert
+// or erase, from a timer that calls _exit.
+// Exits non-zero on the first fault.
+// Usage: skiplist-persistent [crashes]
+
+#include "skiplist_persistent.h"
+#include <map>
+#include <string>
+#include <iostream>
+#include <stdexcept>
+#include <system_error>
+#include <cstdlib>
+#include <cstdint>
+#include <csignal>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+    typedef skip::persistent_map<long,long> pmap;
+    typedef std::map<long,long> rmap;
+
+    class rng {
+	std::uint64_t m_state;
+    public:
+	rng( std::uint64_t seed ) : m_state( seed * 0x9E3779B97F4A7C15ull + 1 ) {}
+	std::uint64_t operator()() {
+	    m_state ^= m_state << 13;
+	    m_state ^= m_state >> 7;
+	    m_state ^= m_state << 17;
+	    return m_state;
+	}
+    };
+
+    void require( bool ok, char const * what ) {
+	if( !ok ) {
+	    throw std::runtime_error( what );
+	}
+    }
+
+    bool same( pmap const & m, rmap const & r ) {
+	if( m.size() != r.size() ) return false;
+	rmap::const_iterator j( r.begin() );
+	for( pmap::iterator i( m.begin() ); i!=m.end(); ++i, ++j ) {
+	    if( j == r.end() || i->first != j->first || i->second != j->second ) return false;
+	}
+	return true;
+    }
+
+    // Every key is found by a descent too, so the upper levels are checked as well as level 0.
+    void check_lookups( pmap const & m, rmap const & r, long range ) {
+	for( long k(0); k<range; ++k ) {
+	    pmap::iterator i( m.find( k ) );
+	    rmap::const_iterator j( r.find( k ) );
+	    require( ( i == m.end() ) == ( j == r.end() ), "find disagrees" );
+	    require( i == m.end() || i->second == j->second, "find found the wrong value" );
+	}
+    }
+
+    // One step of the crash workload; the same seed gives the same steps.
+    template< typename M > void step( M & m, rng & r, long range ) {
+	long k( r() % range );
+	if( r() % 3 ) {
+	    m.insert( std::make_pair( k, k * 3 + 1 ) );
+	} else {
+	    m.erase( k );
+	}
+    }
+
+    void run_basic( std::string const & path ) {
+	::unlink( path.c_str() );
+	rmap ref;
+	rng r( 1 );
+	for( int round(0); round<4; ++round ) {
+	    // One round durable, flushing every step.
+	    pmap m( path.c_str(), round == 2 );
+	    require( same( m, ref ), "reopened map differs" );
+	    int ops( round == 2 ? 500 : 50000 );
+	    for( int i(0); i<ops; ++i ) {
+		long k( r() % 20000 );
+		if( r() % 3 ) {
+		    m[k] = i;
+		    ref[k] = i;
+		} else {
+		    require( m.erase( k ) == ref.erase( k ), "erase count differs" );
+		}
+	    }
+	    require( same( m, ref ), "map differs before close" );
+	    check_lookups( m, ref, 20000 );
+	}
+	{
+	    pmap m( path.c_str() );
+	    require( same( m, ref ), "map differs after last reopen" );
+	    m.clear();
+	    require( m.empty(), "clear left entries" );
+	    m[3] = 4;
+	}
+	{
+	    pmap m( path.c_str() );
+	    require( m.size() == 1 && m.begin()->second == 4, "clear did not persist" );
+	    // An iterator outlives the file growing under it; a reference wouldn't.
+	    pmap::iterator i( m.find( 3 ) );
+	    for( long k(4); k<100000; ++k ) {
+		m[k] = k;
+	    }
+	    require( i->first == 3 && i->second == 4, "iterator lost its entry as the file grew" );
+	}
+	try {
+	    skip::persistent_map<int,int> wrong( path.c_str() );
+	    require( false, "opened a file of the wrong type" );
+	} catch( std::runtime_error const & ) {
+	}
+	try {
+	    pmap missing( "/nonexistent/skiplist-persistent" );
+	    require( false, "opened a file in a missing directory" );
+	} catch( std::system_error const & ) {
+	}
+	::unlink( path.c_str() );
+	std::cout << "basic\tok" << std::endl;
+    }
+
+    void die( int ) {
+	_exit( 0 );
+    }
+
+    /*
+      The child runs the workload until a timer kills it, noting the
+      number of each finished step in memory shared with us; that's a
+      plain store, so nearly all of its time goes on the steps and the
+      timer lands partway through one. The file must then hold the state
+      after either the last step noted or the one after.
+    */
+    void run_crashes( std::string const & path, unsigned int crashes ) {
+	const long range( 5000 );
+	::unlink( path.c_str() );
+	rmap ref;
+	unsigned long done( 0 );
+	unsigned int ahead( 0 );
+	void * shared( ::mmap( 0, sizeof(unsigned long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 ) );
+	if( shared == MAP_FAILED ) throw std::system_error( errno, std::generic_category(), "mmap" );
+	volatile unsigned long * finished( static_cast<volatile unsigned long *>( shared ) );
+	for( unsigned int c(0); c<crashes; ++c ) {
+	    *finished = 0;
+	    pid_t pid( ::fork() );
+	    if( pid < 0 ) throw std::system_error( errno, std::generic_category(), "fork" );
+	    if( pid == 0 ) {
+		// Durable writers spend most of their time between ordered writes.
+		pmap m( path.c_str(), c & 1 );
+		rng r( c + 1 );
+		std::signal( SIGALRM, die );
+		struct itimerval t = { { 0, 0 }, { 0, 1000 + static_cast<long>( ( c * 7919 ) % 20000 ) } };
+		::setitimer( ITIMER_REAL, &t, 0 );
+		for( unsigned long n(1);; ++n ) {
+		    step( m, r, range );
+		    *finished = n;
+		}
+	    }
+	    int status;
+	    ::waitpid( pid, &status, 0 );
+	    require( WIFEXITED( status ) && WEXITSTATUS( status ) == 0, "writer failed" );
+	    // Replay what the child finished, then see whether the next step landed too.
+	    rng r( c + 1 );
+	    for( unsigned long i(0); i<*finished; ++i ) {
+		step( ref, r, range );
+	    }
+	    pmap m( path.c_str() );
+	    if( !same( m, ref ) ) {
+		step( ref, r, range );
+		require( same( m, ref ), "recovered map matches neither side of the crash" );
+		++ahead;
+	    }
+	    check_lookups( m, ref, range );
+	    done += *finished;
+	    // And it must carry on working.
+	    rng more( c + 1000 ), again( c + 1000 );
+	    for( int i(0); i<100; ++i ) {
+		step( m, more, range );
+		step( ref, again, range );
+	    }
+	    require( same( m, ref ), "recovered map differs after more writes" );
+	}
+	::munmap( shared, sizeof(unsigned long) );
+	::unlink( path.c_str() );
+	std::cout << "crashes\tok\t" << crashes << " crashes, " << done << " steps, " << ahead << " a step past the last reported" << std::endl;
+    }
+}
+
+int main( int argc, char ** argv ) {
+    unsigned int crashes( argc > 1 ? std::atoi( argv[1] ) : 200 );
+    std::string path( "/tmp/skiplist-persistent-" + std::to_string( ::getpid() ) + ".skip" );
+    try {
+	run_basic( path );
+	run_crashes( path, crashes );
+    } catch( std::exception & e ) {
+	std::cout << "FAILED: " << e.what() << std::endl;
+	return 1;
+    }
+    return 0;
+}
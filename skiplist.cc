@@ -2,8 +2,77 @@
 // Copyright 2004-2006 Dave Cridland <dave@cridland.net>
 
 #include "skiplist.h"
+#include "skiplist_unrolled.h"
+#include "skiplist_compact.h"
 #include <map>
+#include <vector>
+#include <algorithm>
 #include <iostream>
+#include <new>
+#include <chrono>
+#include <sys/resource.h>
+
+// Count every heap allocation, so node allocation strategies can be compared.
+static unsigned long s_allocs( 0 );
+static unsigned long long s_alloc_bytes( 0 );
+
+static void * counted_alloc( std::size_t sz ) {
+    ++s_allocs;
+    s_alloc_bytes += sz;
+    if( void * p = std::malloc( sz ) ) {
+	return p;
+    }
+    throw std::bad_alloc();
+}
+
+// Every form is replaced, so each delete matches its new.
+void * operator new( std::size_t sz ) {
+    return counted_alloc( sz );
+}
+void * operator new[]( std::size_t sz ) {
+    return counted_alloc( sz );
+}
+void operator delete( void * p ) noexcept {
+    std::free( p );
+}
+void operator delete[]( void * p ) noexcept {
+    std::free( p );
+}
+void operator delete( void * p, std::size_t ) noexcept {
+    std::free( p );
+}
+void operator delete[]( void * p, std::size_t ) noexcept {
+    std::free( p );
+}
+
+static double seconds_since( std::chrono::steady_clock::time_point start ) {
+    return std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+}
+
+static void report_memory( char const * when ) {
+    struct rusage ru;
+    getrusage( RUSAGE_SELF, &ru );
+    std::cout << "\n" << when << ": " << s_allocs << " allocations (" << s_alloc_bytes << " bytes), max RSS " << ru.ru_maxrss << " KiB" << std::endl;
+}
+
+// Batch lookups, where the map has them.
+template< typename M, typename I, typename O > O find_many( M & m, I first, I last, O out ) {
+    for( ; first!=last; ++first ) {
+	*out++ = m.find( *first );
+    }
+    return out;
+}
+template< typename K, typename V, typename L, typename A, typename P, typename I, typename O > O find_many( skip::map<K,V,L,A,P> & m, I first, I last, O out ) {
+    return m.find_many( first, last, out );
+}
+
+// Interleaved lookups of unrelated keys, where the map has them.
+template< typename M, typename I, typename O > O find_interleaved( M & m, I first, I last, O out ) {
+    return find_many( m, first, last, out );
+}
+template< typename K, typename V, typename L, typename A, typename P, typename I, typename O > O find_interleaved( skip::map<K,V,L,A,P> & m, I first, I last, O out ) {
+    return m.find_interleaved( first, last, out );
+}
 
 class attr_name {
 public:
@@ -43,7 +112,11 @@ private:
 
 int main( int argc, char ** argv ) {
     try {
+#ifdef BRANCHING
+	MAP_TYPE< int, int > sl( std::less<int>(), std::allocator< std::pair<const int,int> >(), BRANCHING );
+#else
 	MAP_TYPE< int, int > sl;
+#endif
 	std::cout << "SL init." << std::endl;
 	sl[ 1 ] = 1;
 	sl[ 3 ] = 9;
@@ -68,13 +141,17 @@ int main( int argc, char ** argv ) {
 	}
 	sl.insert( std::make_pair( 2, 4 ) );
 	std::cout << "SL has " << sl[ 2 ] << std::endl;
+	std::chrono::steady_clock::time_point start( std::chrono::steady_clock::now() );
 	for( int i( 20 ); i<NUM_ENTRIES; ++i ) {
 	    sl.insert( std::make_pair( i, i*i ) );
 	    if( i%REPORT_EVERY == 0 ) {
 		std::cout << "\r" << i << " inserts              " << std::flush;
 	    }
 	}
-	std::cout << "\nSearching through " << sl.size() << " entries." << std::endl;
+	std::cout << "\nInserts took " << seconds_since( start ) << "s";
+	report_memory( "After inserts" );
+	std::cout << "Searching through " << sl.size() << " entries." << std::endl;
+	start = std::chrono::steady_clock::now();
 	for( int i( 1 ); i<NUM_ENTRIES; ++i ) {
 	    try {
 		if( (i*i) != sl[ i ] ) {
@@ -88,6 +165,80 @@ int main( int argc, char ** argv ) {
 		std::cout << "\r" << i << " searches              " << std::flush;
 	    }
 	}
+	std::cout << "\nSearches took " << seconds_since( start ) << "s" << std::endl;
+	{
+	    // Sorted batches of random keys, one at a time and all at once.
+	    std::vector<int> batch( 1024 );
+	    std::vector< MAP_TYPE<int,int>::iterator > found( batch.size(), sl.end() );
+	    double single[2] = { 0, 0 }, many[2] = { 0, 0 };
+	    for( int b( 0 ); b<NUM_ENTRIES/1024; ++b ) {
+		// Fresh keys each time, so neither side finds the other's in cache.
+		// Odd pairs of batches are clustered into a window of 64k keys.
+		int window( ( b & 2 ) ? 65536 : NUM_ENTRIES - 1 );
+		int base( 1 + std::rand() % ( NUM_ENTRIES - window ) );
+		for( std::size_t j( 0 ); j<batch.size(); ++j ) {
+		    batch[j] = base + std::rand() % window;
+		}
+		std::sort( batch.begin(), batch.end() );
+		start = std::chrono::steady_clock::now();
+		if( b & 1 ) {
+		    find_many( sl, batch.begin(), batch.end(), found.begin() );
+		    many[( b & 2 ) >> 1] += seconds_since( start );
+		} else {
+		    for( std::size_t j( 0 ); j<batch.size(); ++j ) {
+			found[j] = sl.find( batch[j] );
+		    }
+		    single[( b & 2 ) >> 1] += seconds_since( start );
+		}
+		for( std::size_t j( 0 ); j<batch.size(); ++j ) {
+		    if( (*found[j]).second != batch[j]*batch[j] ) {
+			throw std::runtime_error( "Batch lookup found the wrong entry." );
+		    }
+		}
+	    }
+	    std::cout << "Sorted batch lookups took " << single[0] << "s one by one, " << many[0] << "s batched" << std::endl;
+	    std::cout << "Clustered batch lookups took " << single[1] << "s one by one, " << many[1] << "s batched" << std::endl;
+	}
+	{
+	    // Random keys in no order, one at a time and interleaved.
+	    std::vector<int> batch( 4096 );
+	    std::vector< MAP_TYPE<int,int>::iterator > found( batch.size(), sl.end() );
+	    double single( 0 ), interleaved( 0 );
+	    for( int b( 0 ); b<NUM_ENTRIES/4096; ++b ) {
+		for( std::size_t j( 0 ); j<batch.size(); ++j ) {
+		    batch[j] = 1 + std::rand() % ( NUM_ENTRIES - 1 );
+		}
+		start = std::chrono::steady_clock::now();
+		if( b & 1 ) {
+		    find_interleaved( sl, batch.begin(), batch.end(), found.begin() );
+		    interleaved += seconds_since( start );
+		} else {
+		    for( std::size_t j( 0 ); j<batch.size(); ++j ) {
+			found[j] = sl.find( batch[j] );
+		    }
+		    single += seconds_since( start );
+		}
+		for( std::size_t j( 0 ); j<batch.size(); ++j ) {
+		    if( (*found[j]).second != batch[j]*batch[j] ) {
+			throw std::runtime_error( "Interleaved lookup found the wrong entry." );
+		    }
+		}
+	    }
+	    std::cout << "Random batch lookups took " << single << "s one by one, " << interleaved << "s interleaved" << std::endl;
+	}
+	{
+	    start = std::chrono::steady_clock::now();
+	    MAP_TYPE< int, int > copy( sl.begin(), sl.end() );
+	    std::cout << "Building a copy of " << copy.size() << " entries from sorted input took " << seconds_since( start ) << "s" << std::endl;
+	}
+	{
+	    start = std::chrono::steady_clock::now();
+	    MAP_TYPE< int, int > hinted;
+	    for( int i( 0 ); i<NUM_ENTRIES; ++i ) {
+		hinted.insert( hinted.end(), std::make_pair( i, i*i ) );
+	    }
+	    std::cout << "Hinted ascending inserts took " << seconds_since( start ) << "s" << std::endl;
+	}
 #ifdef SK_HEIGHT_DATA
 	sl.height_data();
 #endif
@@ -2,15 +2,44 @@
 
 // Copyright 2004-2006 Dave Cridland <dave@cridland.net>
 
+#ifndef SKIPLIST_H
+#define SKIPLIST_H
+
 #include <exception>
 #include <stdexcept>
 #include <memory>
 #include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <type_traits>
+#include <tuple>
+#include <atomic>
+#include <iterator>
+#include <mutex>
+#include <thread>
 
 // This spews. Don't define it unless everything breaks.
 //#define SK_VERBOSE_DEBUG
 // This checks skiplist integrity after every operation - VERY SLOW!
 //#define SK_DEBUG_CHECK
+// This sends every node straight to the allocator, bypassing the NodePool.
+//#define SK_NO_NODE_POOL
+// This counts comparisons, links followed, inserts and so on, for stats().
+//#define SK_STATS
+// This adds height_data(), which prints the height histogram to std::cout.
+//#define SK_HEIGHT_DATA
+
+#ifdef SK_STATS
+#define SK_STAT( x ) x
+#else
+#define SK_STAT( x )
+#endif
+
+#ifdef SK_HEIGHT_DATA
+#include <iostream>
+#endif
+#include <vector>
 
 namespace skip {
     /*
@@ -59,10 +88,10 @@ namespace skip {
 	    return *value_ptr();
 	}
 	inline const value_type * value_ptr() const {
-	    return reinterpret_cast<const value_type*>( this ) - 1;
+	    return reinterpret_cast<const value_type*>( reinterpret_cast<const char*>( this ) - value_offset );
 	}
 	inline value_type * value_ptr() {
-	    return reinterpret_cast< value_type*>( this ) - 1;
+	    return reinterpret_cast<value_type*>( reinterpret_cast<char*>( this ) - value_offset );
 	}
 	
 	inline unsigned int height() const {
@@ -70,50 +99,378 @@ namespace skip {
 	}
 	
 	static inline unsigned int alloc_size( unsigned int h ) {
-	    return sizeof(value_type)+sizeof(my_type)+(h*sizeof(my_type*));
+	    return value_offset+sizeof(my_type)+(h*sizeof(my_type*));
 	}
+
+	// The value sits this far before the node, padded so the node stays aligned.
+	static const std::size_t value_offset = ( ( sizeof(value_type) + alignof(my_type*) - 1 ) / alignof(my_type*) ) * alignof(my_type*);
     };
     
+    /*
+      Node pool.
+      Blocks are carved off chunks in allocation order, so nodes created
+      one after another - ascending inserts, say - sit next to each other
+      in memory, just as they do in level 0. Freed blocks go onto a free
+      list per height, and are handed to the next node of that height.
+      Nothing is returned to the allocator until the pool is destroyed.
+      Align is the granularity of blocks within a chunk.
+      Pools live on the heap and are reference counted, since lists that
+      have traded nodes by split or join have to share one; see absorb().
+      Lists sharing a pool may be used from different threads, so a pool
+      with more than one reference takes a lock around each call; one
+      held by a single list never does.
+    */
+    template< typename A, std::size_t Align > class NodePool {
+    public:
+	typedef typename A::template rebind< unsigned char >::other raw_allocator;
+	typedef typename A::template rebind< NodePool >::other self_allocator;
+	typedef typename raw_allocator::pointer pointer;
+	// Taller nodes are rare enough to go straight to the allocator.
+	static const unsigned int classes = 32;
+    private:
+	struct chunk {
+	    chunk * m_next;
+	    std::size_t m_size;
+	};
+	static const std::size_t header = ( ( sizeof(chunk) + Align - 1 ) / Align ) * Align;
+	static const std::size_t min_chunk = 1024;
+	static const std::size_t max_chunk = 256 * 1024;
+	raw_allocator m_alloc;
+	chunk * m_chunks;
+	unsigned char * m_cursor;
+	unsigned char * m_limit;
+	std::size_t m_next_chunk;
+	void * m_free[classes];
+	std::atomic<NodePool *> m_parent;
+	std::atomic<std::size_t> m_refs;
+	mutable std::mutex m_lock;
+
+	// Unimplemented:
+	NodePool( NodePool const & );
+	NodePool & operator=( NodePool const & );
+
+	// Only the one list can reach an unshared pool, so it can't become shared mid-call.
+	bool shared() const {
+	    return m_refs.load( std::memory_order_acquire ) > 1;
+	}
+
+	static std::size_t round( std::size_t octets ) {
+	    return ( ( octets + Align - 1 ) / Align ) * Align;
+	}
+
+	void grow( std::size_t octets ) {
+	    std::size_t sz( m_next_chunk );
+	    while( sz < header + octets ) sz *= 2;
+	    if( m_next_chunk < max_chunk ) m_next_chunk *= 2;
+	    chunk * c( reinterpret_cast<chunk *>( &*m_alloc.allocate( sz ) ) );
+	    c->m_next = m_chunks;
+	    c->m_size = sz;
+	    m_chunks = c;
+	    m_cursor = reinterpret_cast<unsigned char *>( c ) + header;
+	    m_limit = reinterpret_cast<unsigned char *>( c ) + sz;
+	}
+
+	NodePool( A const & a ) : m_alloc( a ), m_chunks( 0 ), m_cursor( 0 ), m_limit( 0 ), m_next_chunk( min_chunk ), m_parent( 0 ), m_refs( 1 ) {
+	    for( unsigned int i(0); i<classes; ++i ) {
+		m_free[i] = 0;
+	    }
+	}
+	~NodePool() {
+	    while( m_chunks ) {
+		chunk * next( m_chunks->m_next );
+		m_alloc.deallocate( reinterpret_cast<unsigned char *>( m_chunks ), m_chunks->m_size );
+		m_chunks = next;
+	    }
+	}
+
+    public:
+	static NodePool * create( A const & a ) {
+	    self_allocator sa( a );
+	    NodePool * p( &*sa.allocate( 1 ) );
+	    new( p ) NodePool( a );
+	    return p;
+	}
+	NodePool * acquire() {
+	    m_refs.fetch_add( 1, std::memory_order_relaxed );
+	    return this;
+	}
+	static void release( NodePool * p ) {
+	    while( p && p->m_refs.fetch_sub( 1, std::memory_order_acq_rel ) == 1 ) {
+		NodePool * parent( p->m_parent.load( std::memory_order_acquire ) );
+		self_allocator sa( p->m_alloc );
+		p->~NodePool();
+		sa.deallocate( p, 1 );
+		p = parent;
+	    }
+	}
+	// Follows any forwarding left by absorb(), taking the reference along.
+	static NodePool * resolve( NodePool *& p ) {
+	    while( NodePool * up = p->m_parent.load( std::memory_order_acquire ) ) {
+		up->acquire();
+		release( p );
+		p = up;
+	    }
+	    return p;
+	}
+
+	/*
+	  Takes over all of other's memory - chunks, free blocks and all -
+	  and leaves other forwarding here, union-find style, so that
+	  everyone still holding it ends up here too. Both must be roots.
+	*/
+	void absorb( NodePool & other ) {
+	    std::unique_lock<std::mutex> mine( m_lock, std::defer_lock ), theirs( other.m_lock, std::defer_lock );
+	    std::lock( mine, theirs );
+	    if( chunk * c = other.m_chunks ) {
+		while( c->m_next ) c = c->m_next;
+		c->m_next = m_chunks;
+		m_chunks = other.m_chunks;
+		other.m_chunks = 0;
+	    }
+	    for( unsigned int i(0); i<classes; ++i ) {
+		if( void * p = other.m_free[i] ) {
+		    while( void * next = *reinterpret_cast<void **>( p ) ) p = next;
+		    *reinterpret_cast<void **>( p ) = m_free[i];
+		    m_free[i] = other.m_free[i];
+		    other.m_free[i] = 0;
+		}
+	    }
+	    // Carry on from whichever chunk has more left in it.
+	    if( m_limit - m_cursor < other.m_limit - other.m_cursor ) {
+		m_cursor = other.m_cursor;
+		m_limit = other.m_limit;
+	    }
+	    other.m_cursor = other.m_limit = 0;
+	    if( m_next_chunk < other.m_next_chunk ) m_next_chunk = other.m_next_chunk;
+	    other.m_parent.store( acquire(), std::memory_order_release );
+	}
+
+	/*
+	  The caller may have resolved this pool just before another
+	  thread's absorb() took it over, and then waited for the lock;
+	  everything it held is the parent's by then, so the call goes on
+	  up to the parent.
+	*/
+	unsigned char * allocate( unsigned int height, std::size_t octets ) {
+	    NodePool * up;
+	    if( shared() ) {
+		std::lock_guard<std::mutex> l( m_lock );
+		if( !( up = m_parent.load( std::memory_order_relaxed ) ) ) {
+		    return allocate_unlocked( height, octets );
+		}
+	    } else if( !( up = m_parent.load( std::memory_order_acquire ) ) ) {
+		return allocate_unlocked( height, octets );
+	    }
+	    return up->allocate( height, octets );
+	}
+	void deallocate( unsigned char * p, unsigned int height, std::size_t octets ) {
+	    NodePool * up;
+	    if( shared() ) {
+		std::lock_guard<std::mutex> l( m_lock );
+		if( !( up = m_parent.load( std::memory_order_relaxed ) ) ) {
+		    deallocate_unlocked( p, height, octets );
+		    return;
+		}
+	    } else if( !( up = m_parent.load( std::memory_order_acquire ) ) ) {
+		deallocate_unlocked( p, height, octets );
+		return;
+	    }
+	    up->deallocate( p, height, octets );
+	}
+
+	raw_allocator const & allocator() const {
+	    return m_alloc;
+	}
+
+	// Bytes held in chunks, used or not; tall nodes aren't counted.
+	std::size_t reserved() const {
+	    std::unique_lock<std::mutex> l( m_lock, std::defer_lock );
+	    if( shared() ) l.lock();
+	    if( NodePool const * up = m_parent.load( std::memory_order_acquire ) ) {
+		if( l.owns_lock() ) l.unlock();
+		return up->reserved();
+	    }
+	    std::size_t n( 0 );
+	    for( chunk * c( m_chunks ); c; c = c->m_next ) {
+		n += c->m_size;
+	    }
+	    return n;
+	}
+
+    private:
+	unsigned char * allocate_unlocked( unsigned int height, std::size_t octets ) {
+#ifndef SK_NO_NODE_POOL
+	    if( height < classes ) {
+		if( void * p = m_free[height] ) {
+		    m_free[height] = *reinterpret_cast<void **>( p );
+		    return reinterpret_cast<unsigned char *>( p );
+		}
+		octets = round( octets );
+		if( std::size_t( m_limit - m_cursor ) < octets ) {
+		    grow( octets );
+		}
+		unsigned char * p( m_cursor );
+		m_cursor += octets;
+		return p;
+	    }
+#endif
+	    return &*m_alloc.allocate( octets );
+	}
+
+	void deallocate_unlocked( unsigned char * p, unsigned int height, std::size_t octets ) {
+#ifndef SK_NO_NODE_POOL
+	    if( height < classes ) {
+		*reinterpret_cast<void **>( p ) = m_free[height];
+		m_free[height] = p;
+		return;
+	    }
+#endif
+	    m_alloc.deallocate( p, octets );
+	}
+    };
+
+    // A counted reference to a NodePool, which always leads to the live one.
+    template< typename Pool > class PoolRef {
+	Pool * m_pool;
+
+	// Unimplemented:
+	PoolRef & operator=( PoolRef const & );
+
+    public:
+	explicit PoolRef( Pool * p ) : m_pool( p ) {
+	}
+	PoolRef( PoolRef & other ) : m_pool( other.get()->acquire() ) {
+	}
+	~PoolRef() {
+	    Pool::release( m_pool );
+	}
+	Pool * get() {
+	    return Pool::resolve( m_pool );
+	}
+	Pool * operator->() {
+	    return get();
+	}
+    };
+
+    /*
+      Compile-time options for a Skiplist.
+      Derive from this and override what you need; anything left alone
+      costs nothing.
+    */
+    struct default_policy {
+	// Keep a width - the number of level 0 steps it spans - beside
+	// every forward pointer, for rank, nth and distance in O(log n).
+	static const bool indexed = false;
+	// Keep a copy of the successor's key beside every forward pointer,
+	// so a descent only visits the nodes it actually moves to. For
+	// small trivially copyable keys only.
+	static const bool cache_keys = false;
+	// The tallest a tower can be. Every per-level array on the stack
+	// is this long, so a smaller bound is worth setting when the size
+	// is known.
+	static const unsigned int max_height = 64;
+	// The inverse of the promotion probability, if fixed here; 0
+	// leaves it to the constructor.
+	static const unsigned int branching = 0;
+	// Allocate the head at max_height once, and never regrow it.
+	static const bool fixed_height = false;
+    };
+
+    struct indexed_policy : default_policy {
+	static const bool indexed = true;
+    };
+
+    struct cached_keys_policy : default_policy {
+	static const bool cache_keys = true;
+    };
+
+    /*
+      Shape fixed at compile time: towers of at most H, one in B promoted.
+      Choose H so that B^(H-1) comfortably exceeds the largest size
+      expected; the list still works beyond it, just with longer runs.
+    */
+    template< unsigned int H, unsigned int B=4 > struct fixed_policy : default_policy {
+	static const unsigned int max_height = H;
+	static const unsigned int branching = B;
+	static const bool fixed_height = true;
+    };
+
+    /*
+      A list's shape, from stats(). The shape is worked out on the spot;
+      the counters are only kept when built with SK_STATS, and are zero
+      otherwise.
+    */
+    struct skiplist_stats {
+	std::size_t m_size;
+	unsigned int m_height;
+	// Nodes of each height, the head excluded.
+	std::vector<std::size_t> m_heights;
+	// Links a search follows to reach an entry, averaged over them all.
+	double m_average_path;
+	// Bytes in nodes, the head included, and in the node pool's chunks,
+	// which may be shared with other lists.
+	std::size_t m_node_bytes;
+	std::size_t m_pool_bytes;
+	// Counters since construction or reset_stats().
+	std::uint64_t m_searches;
+	std::uint64_t m_comparisons;
+	std::uint64_t m_inserts;
+	std::uint64_t m_erases;
+	std::uint64_t m_header_grows;
+	// Links followed at each level.
+	std::vector<std::uint64_t> m_visits;
+    };
+
+    /*
+      Iterator over a Skiplist. It carries where its list keeps the tail,
+      so end() can be stepped back from like any other position.
+    */
     template<typename IP, typename IV> class sk_iterator {
     private:
 	IP m_node;
+	IP const * m_tail;
     public:
 	typedef IV value_type;
+	typedef IV & reference;
+	typedef IV * pointer;
+	typedef std::ptrdiff_t difference_type;
 	typedef std::bidirectional_iterator_tag iterator_category;
 	
-	sk_iterator( sk_iterator<IP,IV> const & m ) : m_node( m.m_node ) {
+	// Copies are implicit; this only makes a const_iterator from an iterator.
+	template<typename IVX> sk_iterator( sk_iterator<IP,IVX> const & m ) : m_node( m.priv_node() ), m_tail( m.priv_tail() ) {
 	}
-	template<typename IVX> sk_iterator( sk_iterator<IP,IVX> const & m ) : m_node( m.priv_node() ) {
-	}
-	sk_iterator( IP  n ) : m_node( n ) {
+	sk_iterator( IP n, IP const * tail ) : m_node( n ), m_tail( tail ) {
 	}
 	sk_iterator & operator++() {
 	    m_node = (*m_node)[0];
 	    return *this;
 	}
 	sk_iterator & operator--() {
-	    m_node = (*m_node)[-1];
+	    m_node = m_node ? (*m_node)[-1] : *m_tail;
 	    return *this;
 	}
-	IV & operator*() {
+	IV & operator*() const {
 	    return m_node->value();
 	}
-	IV * operator->() {
+	IV * operator->() const {
 	    return m_node->value_ptr();
 	}
-	bool operator==( sk_iterator const & i ) {
+	bool operator==( sk_iterator const & i ) const {
 	    return m_node==i.m_node;
 	}
-	bool operator!=( sk_iterator const & i ) {
+	bool operator!=( sk_iterator const & i ) const {
 	    return m_node!=i.m_node;
 	}
 	
 	IP const & priv_node() const {
 	    return m_node;
 	}
+	IP const * priv_tail() const {
+	    return m_tail;
+	}
     };
     
-    template< typename K, typename V, typename X, typename L, typename A > class Skiplist {
+    template< typename K, typename V, typename X, typename L, typename A, typename P=default_policy > class Skiplist {
     public:
 	// std::map typedefs
 	typedef K key_type;
@@ -121,14 +478,18 @@ namespace skip {
 	typedef X extract_key;
 	typedef L key_compare;
 	typedef A allocator_type;
+	typedef P policy_type;
 	// Local typedefs
-	typedef Skiplist<K,V,X,L,A> my_type;
+	typedef Skiplist<K,V,X,L,A,P> my_type;
 	typedef SkiplistNode<value_type> node_type;
 	typedef typename allocator_type::template rebind< unsigned char >::other raw_allocator;
 	typedef typename allocator_type::template rebind< node_type >::other node_allocator;
+	typedef NodePool<allocator_type, ( alignof(value_type) > alignof(node_type) ? alignof(value_type) : alignof(node_type) )> pool_type;
+	typedef PoolRef<pool_type> pool_ref;
 	typedef node_type * live_node_ptr;
 	typedef typename node_allocator::pointer node_ptr;
 	typedef typename node_allocator::const_pointer const_node_ptr;
+	typedef typename allocator_type::template rebind< node_ptr >::other path_allocator;
 	// std::map typedefs
 	typedef typename allocator_type::reference reference;
 	typedef typename allocator_type::const_reference const_reference;
@@ -145,18 +506,81 @@ namespace skip {
 	Skiplist(my_type const &);
 	my_type & operator=(my_type const &);
     private:
+	// The pool must exist before the head can be allocated.
+	pool_ref m_pool;
 	node_ptr m_head;
+	// The last node, or null when empty.
+	node_ptr m_tail;
 	key_compare m_comp;
 	std::size_t m_size;
 	unsigned int m_height;
-	raw_allocator m_alloc;
-	static const unsigned int maxheight = 64;
+	unsigned int m_branch_bits;
+	std::uint64_t m_rng;
+	// Predecessors of the last near insert; allocated on first use.
+	node_ptr * m_finger;
+	bool m_finger_valid;
+	bool m_finger_mode;
+	static const unsigned int maxheight = P::max_height;
+	static const unsigned int initial_height = P::fixed_height || maxheight < 4 ? maxheight : 4;
+	static const unsigned int fixed_bits = P::branching ? __builtin_ctz( P::branching ) : 0;
+#ifdef SK_STATS
+	struct counters {
+	    std::uint64_t m_searches;
+	    std::uint64_t m_comparisons;
+	    std::uint64_t m_inserts;
+	    std::uint64_t m_erases;
+	    std::uint64_t m_header_grows;
+	    std::uint64_t m_visits[maxheight];
+	};
+	mutable counters m_counters = counters();
+#endif
+	static_assert( P::max_height >= 1 && P::max_height <= 64, "max_height must be between 1 and 64" );
+	static_assert( P::branching == 0 || ( P::branching >= 2 && !( P::branching & ( P::branching - 1 ) ) ), "branching must be a power of two" );
+	static_assert( !P::cache_keys || ( std::is_trivially_copyable<K>::value && alignof(K) <= alignof(node_ptr) ), "cache_keys needs small trivially copyable keys" );
     public:
-	Skiplist() : m_head( new_node(4) ), m_comp(), m_size( 0 ), m_height( m_head->height() ) {
+	static const unsigned int default_branching = P::branching ? P::branching : 4;
+	/*
+	  branching is the inverse of the promotion probability - 2, 4, 8...
+	  Larger values save tower memory at the cost of longer runs
+	  along each level. If the policy fixes it, it must agree.
+	*/
+	Skiplist( unsigned int branching=default_branching ) : m_pool( pool_type::create( A() ) ), m_head( new_node( initial_height ) ), m_tail( 0 ), m_comp(), m_size( 0 ), m_height( m_head->height() ), m_branch_bits( branch_bits( branching ) ), m_rng( 0x9E3779B97F4A7C15ull ), m_finger( 0 ), m_finger_valid( false ), m_finger_mode( false ) {
+	}
+	Skiplist( L const & l, A const & a, unsigned int branching=default_branching ) : m_pool( pool_type::create( a ) ), m_head( new_node( initial_height ) ), m_tail( 0 ), m_comp(l), m_size(0), m_height( m_head->height() ), m_branch_bits( branch_bits( branching ) ), m_rng( 0x9E3779B97F4A7C15ull ), m_finger( 0 ), m_finger_valid( false ), m_finger_mode( false ) {
+	}
+	/*
+	  Builds from [first,last) in a single pass. Sorted input is linked
+	  straight onto the tail of each level, with heights taken from the
+	  position in the run, so nothing is ever searched for. Should the
+	  input turn out not to be sorted, the remainder is inserted the
+	  normal way. unique drops elements whose key equals the previous one.
+	*/
+	template< typename I > Skiplist( I first, I last, bool unique, L const & l, A const & a, unsigned int branching=default_branching ) : m_pool( pool_type::create( a ) ), m_head( new_node( initial_height ) ), m_tail( 0 ), m_comp(l), m_size(0), m_height( m_head->height() ), m_branch_bits( branch_bits( branching ) ), m_rng( 0x9E3779B97F4A7C15ull ), m_finger( 0 ), m_finger_valid( false ), m_finger_mode( false ) {
+	    try {
+		bulk_load( first, last, unique );
+	    } catch( ... ) {
+		destroy_all();
+		throw;
+	    }
 	}
-	Skiplist( L const & l, A const & a ) : m_head( new_node(4) ), m_comp(l), m_size(0), m_height( m_head->height() ), m_alloc( a ) {
+	// Everything in from not less than k, which from gives up; see split_into.
+	Skiplist( my_type & from, K const & k ) : m_pool( from.m_pool ), m_head( new_node( initial_height ) ), m_tail( 0 ), m_comp( from.m_comp ), m_size( 0 ), m_height( m_head->height() ), m_branch_bits( from.m_branch_bits ), m_rng( 0x9E3779B97F4A7C15ull ), m_finger( 0 ), m_finger_valid( false ), m_finger_mode( from.m_finger_mode ) {
+	    try {
+		from.split_into( k, *this );
+	    } catch( ... ) {
+		destroy_all();
+		throw;
+	    }
 	}
 	virtual ~Skiplist() {
+	    destroy_all();
+	}
+	
+    private:
+	void destroy_all() {
+	    if( m_finger ) {
+		path_allocator( m_pool->allocator() ).deallocate( m_finger, maxheight );
+	    }
 	    node_ptr current = m_head;
 	    while( node_ptr next = (*current)[0] ) {
 		if(current == m_head) {
@@ -172,82 +596,235 @@ namespace skip {
 		delete_node(current);
 	    }
 	}
-	
-    private:
-	unsigned int suitable_height() const {
-	    long unsigned int s(m_size);
-	    unsigned int h( 4 );
-	    while( s>>=2 ) {
-		h+=1;
-		if( h == ( 8*sizeof(unsigned int) ) ) {
-		    break;
+
+	// Links n in after the last node of each of its levels.
+	void append_node( node_ptr n, node_ptr tails[], std::size_t ranks[] ) {
+	    ++m_size;
+	    SK_STAT( ++m_counters.m_inserts );
+	    (*n)[-1] = tails[0];
+	    for( unsigned int i(0); i<n->height(); ++i ) {
+		set_link( tails[i], i, n );
+		if( P::indexed ) {
+		    width( tails[i], i ) = m_size - ranks[i];
+		    ranks[i] = m_size;
+		}
+		tails[i] = n;
+	    }
+	    m_tail = n;
+	}
+
+	// Widths of the links off the end, once appending is over.
+	void close_tails( node_ptr tails[], std::size_t ranks[] ) {
+	    if( P::indexed ) {
+		for( unsigned int i(0); i<m_height; ++i ) {
+		    width( tails[i], i ) = m_size + 1 - ranks[i];
+		}
+	    }
+	}
+
+	template< typename I > void bulk_load( I first, I last, bool unique ) {
+	    node_ptr tails[maxheight];
+	    std::size_t ranks[maxheight];
+	    for( unsigned int i(0); i<m_height; ++i ) {
+		tails[i] = m_head;
+		ranks[i] = 0;
+	    }
+	    std::size_t grow_at( std::size_t( 1 ) << bits() );
+	    bool unsorted( false );
+	    for( ; first!=last; ++first ) {
+		if( m_size + 1 >= grow_at ) {
+		    node_ptr old( m_head );
+		    unsigned int old_height( m_height );
+		    check_header();
+		    for( unsigned int i(0); i<m_height; ++i ) {
+			if( i >= old_height || tails[i] == old ) {
+			    tails[i] = m_head;
+			}
+			if( i >= old_height ) {
+			    ranks[i] = 0;
+			}
+		    }
+		    grow_at <<= bits();
+		}
+		// Every branching'th node is promoted once, every branching^2'th twice...
+		std::size_t pos( m_size + 1 );
+		unsigned int height( 1 + __builtin_ctzll( pos ) / bits() );
+		if( height > m_height ) height = m_height;
+		// *first may be a temporary, so compare the copy in the node.
+		node_ptr node( new_node( *first, height ) );
+		if( m_size ) {
+		    K const & k( extract_key()( node->value() ) );
+		    K const & tk( extract_key()( tails[0]->value() ) );
+		    if( m_comp( k, tk ) ) {
+			close_tails( tails, ranks );
+			unsorted = true;
+			try {
+			    insert_node( node->value(), !unique );
+			} catch( ... ) {
+			    delete_node( node );
+			    throw;
+			}
+			delete_node( node );
+			++first;
+			break;
+		    }
+		    if( unique && !m_comp( tk, k ) ) {
+			delete_node( node );
+			continue;
+		    }
 		}
+		append_node( node, tails, ranks );
+	    }
+	    if( !unsorted ) {
+		close_tails( tails, ranks );
 	    }
-	    return h;
+	    for( ; first!=last; ++first ) {
+		insert_node( *first, !unique );
+	    }
+	}
+
+	// Promotion bits, constant when the policy fixes them.
+	unsigned int bits() const {
+	    return P::branching ? fixed_bits : m_branch_bits;
+	}
+
+	// Levels in use, constant when the policy fixes them.
+	unsigned int levels() const {
+	    return P::fixed_height ? maxheight : m_height;
+	}
+
+	// Four levels, plus one for each power of the branching factor.
+	unsigned int suitable_height() const {
+	    if( !m_size ) return 4;
+	    unsigned int h( 4 + ( 63 - __builtin_clzll( m_size ) ) / bits() );
+	    return h < 32 ? h : 32;
 	}
 	
-	unsigned int pickheight() const {
-	    unsigned int i(1);
-	    unsigned int r = std::rand();
-	    unsigned int mask = ( 0x01 << 31 ); // Top one bit set.
-	    while( !(r & mask) ) {
-		if( i == m_height ) {
+	/*
+	  xorshift64*, private to this list. Each run of bits()
+	  leading zero bits in the output is one promotion, so a whole
+	  height is drawn with a single count-leading-zeros.
+	*/
+	unsigned int pickheight() {
+	    m_rng ^= m_rng >> 12;
+	    m_rng ^= m_rng << 25;
+	    m_rng ^= m_rng >> 27;
+	    std::uint64_t r( m_rng * 0x2545F4914F6CDD1Dull );
+	    unsigned int i( 1 + __builtin_clzll( r | 1 ) / bits() );
+	    if( i >= levels() ) {
 #ifdef SK_VERBOSE_DEBUG
-		    std::cout << "Picked max height!\n";
+		std::cout << "Picked max height!\n";
 #endif
-		    break;
-		}
-		++i;
-		if( mask & 0x1 ) { // Must be all ones.
-		    break;
-		}
-		mask >>= 2; // Shift right by two.
-		mask |= ( 0x03 << 30 ); // Set two top bits.
+		i = levels();
 	    }
 	    return i;
 	}
+
+	static unsigned int branch_bits( unsigned int branching ) {
+	    if( branching < 2 || ( branching & ( branching - 1 ) ) ) {
+		throw std::invalid_argument( "Skiplist branching factor must be a power of two" );
+	    }
+	    if( P::branching && branching != P::branching ) {
+		throw std::invalid_argument( "Skiplist branching factor is fixed by its policy" );
+	    }
+	    return __builtin_ctz( branching );
+	}
 	
 	void check_header() {
+	    if( P::fixed_height ) return;
 	    unsigned int h( suitable_height() );
 	    if( h > maxheight ) {
 		h = maxheight;
 	    }
 	    //std::cout << "Suitable height is " << h << " actual height is " << m_height.m_skiplist_height << std::endl;
+	    grow_header( h );
+	}
+
+	// Swaps the head for one of height h, if that's taller.
+	void grow_header( unsigned int h ) {
 	    if( h > m_height ) {
 #ifdef SK_VERBOSE_DEBUG
 		std::cout << "Using new header size of " << h << std::endl;
 #endif
+		SK_STAT( ++m_counters.m_header_grows );
 		node_ptr t( m_head );
 		m_height = h;
 		m_head = new_node( m_height );
+		m_finger_valid = false;
 		for( unsigned int i(0); i<h; ++i ) {
 		    if( i < t->height() ) {
-			(*m_head)[i] = (*t)[i];
+			take_link( m_head, i, t );
+			if( P::indexed ) width( m_head, i ) = width( t, i );
 		    } else {
-			(*m_head)[i] = 0;
+			set_link( m_head, i, node_ptr() );
+			if( P::indexed ) width( m_head, i ) = m_size + 1;
 		    }
 		}
+		if( (*m_head)[0] ) {
+		    (*(*m_head)[0])[-1] = m_head;
+		}
 		destroy_node( t );
 	    }
 	}
 	
+	// The node, plus a width and a cached key per level as the policy asks.
+	static std::size_t node_size( unsigned int h ) {
+	    return node_type::alloc_size( h ) + ( P::indexed ? h * sizeof(std::size_t) : 0 ) + ( P::cache_keys ? h * sizeof(K) : 0 );
+	}
+
+	// Widths live after the last forward pointer.
+	static std::size_t & width( node_ptr n, unsigned int i ) {
+	    return reinterpret_cast<std::size_t *>( &(*n)[n->height()] )[i];
+	}
+
+	// Cached keys live after the widths, if any.
+	static K & cached_key( node_ptr n, unsigned int i ) {
+	    char * p( reinterpret_cast<char *>( &(*n)[n->height()] ) );
+	    if( P::indexed ) p += n->height() * sizeof(std::size_t);
+	    return reinterpret_cast<K *>( p )[i];
+	}
+
+	// The key of next, being n's successor at level i.
+	static K const & next_key( node_ptr n, node_ptr next, unsigned int i ) {
+	    if( P::cache_keys ) return cached_key( n, i );
+	    return extract_key()( next->value() );
+	}
+
+	// Every forward link is set through these two, which keep the
+	// cached keys in step.
+	void set_link( node_ptr n, unsigned int i, node_ptr to ) {
+	    (*n)[i] = to;
+	    if( P::cache_keys && to ) cached_key( n, i ) = extract_key()( to->value() );
+	}
+	// n's link at level i takes over src's.
+	void take_link( node_ptr n, unsigned int i, node_ptr src ) {
+	    (*n)[i] = (*src)[i];
+	    if( P::cache_keys && (*src)[i] ) cached_key( n, i ) = cached_key( src, i );
+	}
+
 	node_ptr new_node(int height) {
 #ifdef SK_VERBOSE_DEBUG
 	    std::cout << "\nAllocating node for height " << height << std::endl;
 #endif
-	    std::size_t octets(node_type::alloc_size(height));
+	    std::size_t octets(node_size(height));
 #ifdef SK_VERBOSE_DEBUG
 	    std::cout << "==> " << octets << std::endl;
 #endif
-	    typename raw_allocator::pointer p(m_alloc.allocate(octets));
+	    typename raw_allocator::pointer p(m_pool->allocate(height, octets));
 #ifdef SK_VERBOSE_DEBUG
 	    std::cout << "==> Allocated at " << reinterpret_cast<void *>(p) << std::endl;
 #endif
-	    p += sizeof(value_type);
+	    p += node_type::value_offset;
 #ifdef SK_VERBOSE_DEBUG
 	    std::cout << "==> Pointer moved to " << reinterpret_cast<void *>(p) << std::endl;
 #endif
 	    new( p ) node_type(height);
+	    if( P::indexed ) {
+		// A lone link off the end, as in an empty list's head.
+		for( int i(0); i<height; ++i ) {
+		    width( (node_ptr)p, i ) = 1;
+		}
+	    }
 	    return (node_ptr)p;
 	}
 	node_ptr new_node(value_type const & v, int height) {
@@ -266,18 +843,27 @@ namespace skip {
 	    typename raw_allocator::pointer pp( (typename raw_allocator::pointer)p->value_ptr() );
 	    unsigned int h( p->height() );
 	    p->~node_type();
-	    m_alloc.deallocate( pp, node_type::alloc_size( h ) );
+	    m_pool->deallocate( pp, h, node_size( h ) );
 	}
 	
-	node_ptr find_next( K const & k, node_ptr update[] = 0, node_ptr thisone=node_ptr() ) const {
+	/*
+	  Finds the first node not less than k (or thisone, if it comes
+	  first), filling update[] with the predecessor at each level and,
+	  when indexed, rank[] with the position of each predecessor.
+	  k may be of any type the comparator takes alongside K.
+	*/
+	template< typename KK > node_ptr find_next( KK const & k, node_ptr update[] = 0, node_ptr thisone=node_ptr(), std::size_t rank[] = 0 ) const {
 	    node_ptr current( m_head );
 	    node_ptr next( 0 );
+	    std::size_t pos( 0 );
 	    
 #ifdef SK_VERBOSE_DEBUG    
 	    std::cout << "\nfind_next is looking for " << k << std::endl;
 #endif
+	    SK_STAT( ++m_counters.m_searches );
 	    
-	    for( unsigned int i(m_height-1);; --i ) {
+	    // With a fixed height the trip count is known, and the loop unrolls.
+	    for( unsigned int i(levels()-1);; --i ) {
 		if( i >= current->height() ) continue;
 		next = (*current)[i];
 #ifdef SK_VERBOSE_DEBUG_BROKEN
@@ -293,11 +879,14 @@ namespace skip {
 		}
 		std::cout << std::endl;
 #endif
-		while( next && m_comp( extract_key()(next->value()), k )
+		while( next && m_comp( next_key( current, next, i ), k )
 		       && ( thisone ? next != thisone : true )
 		       // If we have a start, continue if it does not match.
 		       // If we do not, then continue always.
 		) {
+		    SK_STAT( ++m_counters.m_comparisons );
+		    SK_STAT( ++m_counters.m_visits[i] );
+		    if( P::indexed && rank ) pos += width( current, i );
 		    current = next;
 		    next = (*current)[i];
 #ifdef SK_VERBOSE_DEBUG
@@ -310,9 +899,14 @@ namespace skip {
 		    std::cout << std::endl;
 #endif
 		}
+		// The comparison that stopped us, if any.
+		SK_STAT( if( next && next != thisone ) ++m_counters.m_comparisons );
 		if( update ) {
 		    update[i] = current;
 		}
+		if( P::indexed && rank ) {
+		    rank[i] = pos;
+		}
 		if( 0==i ) break;
 	    }
 #ifdef SK_VERBOSE_DEBUG
@@ -322,201 +916,1118 @@ namespace skip {
 	    return next;
 	}
 	
-#ifdef SK_DEBUG_CHECK
-	void check() {
-	    for( unsigned int i(0); i<m_height; ++i ) {
-		node_ptr current( m_head );
-		bool found = false;
-		// Look down until we find a NULL pointer. Should be none below here.
-		for( unsigned int hh(current->height()); hh>0; --hh ) {
-		    if( found ) {
-			if( !(*current)[hh-1] ) {
-			    char ** p(0);
-			    throw std::runtime_error( *p );
-			}
-		    } else {
-			if( (*current)[hh-1] ) {
-			    found = true;
-			}
-		    }
+	/*
+	  Resumes a search from path[], which must hold the predecessors of
+	  some earlier key at every level, rather than starting at the head.
+	  It climbs only until a level can reach k without overshooting,
+	  so nearby keys cost O(log distance). Levels above that are
+	  already correct for k. path[] is left holding k's predecessors.
+	*/
+	node_ptr find_from( K const & k, node_ptr path[] ) const {
+	    SK_STAT( ++m_counters.m_searches );
+	    unsigned int i( 0 );
+	    for( ; i<levels()-1; ++i ) {
+		node_ptr p( path[i] );
+		SK_STAT( m_counters.m_comparisons += ( p != m_head ) );
+		if( p != m_head && !m_comp( extract_key()(p->value()), k ) ) {
+		    continue; // Behind us at this level.
 		}
-		node_ptr next( (*current)[i] );
-		while( next ) {
-		    if( current == next ) {
-			char **p(0);
-			throw std::runtime_error( *p );
-		    }
+		node_ptr n( (*p)[i] );
+		SK_STAT( m_counters.m_comparisons += ( n != node_ptr() ) );
+		if( n && m_comp( next_key( p, n, i ), k ) ) {
+		    continue; // Too far ahead for this level.
+		}
+		break;
+	    }
+	    node_ptr current( path[i] );
+	    if( current != m_head && !m_comp( extract_key()(current->value()), k ) ) {
+		current = m_head;
+	    }
+	    node_ptr next( 0 );
+	    for( ;; --i ) {
+		next = (*current)[i];
+		while( next && m_comp( next_key( current, next, i ), k ) ) {
+		    SK_STAT( ++m_counters.m_comparisons );
+		    SK_STAT( ++m_counters.m_visits[i] );
 		    current = next;
 		    next = (*current)[i];
 		}
+		SK_STAT( m_counters.m_comparisons += ( next != node_ptr() ) );
+		path[i] = current;
+		if( 0==i ) break;
 	    }
+	    return next;
 	}
-#endif
-	
-    public:
-	std::pair<bool,node_ptr> insert_node(V const & v, bool allow_dups=true) {
-	    check_header();
-	    node_ptr update[m_height];
-	    for( unsigned int i(0); i<m_height-1; ++i ) {
-		update[i] = 0;
+
+	// The last node whose key isn't greater than k, or the head.
+	template< typename KK > node_ptr find_last_not_greater( KK const & k ) const {
+	    SK_STAT( ++m_counters.m_searches );
+	    node_ptr current( m_head );
+	    for( unsigned int i(levels()-1);; --i ) {
+		node_ptr next;
+		while( ( next = (*current)[i] ) && !m_comp( k, next_key( current, next, i ) ) ) {
+		    SK_STAT( ++m_counters.m_comparisons );
+		    SK_STAT( ++m_counters.m_visits[i] );
+		    current = next;
+		}
+		SK_STAT( m_counters.m_comparisons += ( next != node_ptr() ) );
+		if( 0==i ) break;
 	    }
+	    return current;
+	}
 
-	    K const & k(extract_key()(v));
-	    node_ptr next( find_next( k, update ) );
-	    
-	    if( allow_dups ) {
-#ifdef SK_VERBOSE_DEBUG
-		std::cout << "Allow dups is TRUE\n";
-#endif
-		if( next ) {
-#ifdef SK_VERBOSE_DEBUG
-		    std::cout << "Have next.\n";
-#endif
-		    if( !( m_comp( extract_key()(next->value()), k ) || m_comp( k, extract_key()(next->value()) ) ) ) {
-			return std::make_pair(false,next);
+	static unsigned int thread_count( unsigned int threads ) {
+	    if( !threads ) threads = std::thread::hardware_concurrency();
+	    return threads ? threads : 1;
+	}
+
+	/*
+	  Calls f(0) to f(pieces-1) over up to threads threads, this one
+	  included, each taking the next piece as it finishes the last.
+	  The first exception thrown stops the handing out of pieces, and
+	  is rethrown here once every thread is done.
+	*/
+	template< typename F > static void run_parallel( std::size_t pieces, unsigned int threads, F f ) {
+	    std::atomic<std::size_t> next( 0 );
+	    std::exception_ptr error;
+	    std::mutex error_lock;
+	    auto work = [&]() {
+		for( std::size_t i; ( i = next++ ) < pieces; ) {
+		    try {
+			f( i );
+		    } catch( ... ) {
+			std::lock_guard<std::mutex> l( error_lock );
+			if( !error ) error = std::current_exception();
+			next = pieces;
 		    }
 		}
-	    }
-	    
-	    
-	    unsigned int height( pickheight() );
-	    node_ptr node = new_node( v, height );
-#ifdef SK_VERBOSE_DEBUG
-	    std::cout << "Using height of " << height << std::endl;
-	    std::cout << "Node extends from " << node->value_ptr() << " to " << (void*)(((char*)(node->value_ptr()))+node_type::alloc_size(height)) << std::endl;
-#endif
-	    ++m_size;
-	    (*node)[-1] = update[0];
-	    for( unsigned int i(0); i<height; ++i ) {
-		(*node)[i] = (*(update[i]))[i];
-#ifdef SK_VERBOSE_DEBUG
-		std::cout << "node[" << i << "] = " << (*(update[i]))[i] << std::endl;
-#endif
-		(*(update[i]))[i] = node;
-#ifdef SK_VERBOSE_DEBUG
-		std::cout << "(*(update[" << i << "]))[" << i << "] = " << node << std::endl;
-		std::cout << "At height " << i << ", adding before ";
-		if( (*node)[i] ) {
-		    std::cout << (*node)[i]->value().first;
-		} else {
-		    std::cout << "NIL";
+	    };
+	    std::vector<std::thread> workers;
+	    try {
+		for( unsigned int t(1); t<threads && t<pieces; ++t ) {
+		    workers.emplace_back( work );
 		}
-		std::cout << std::endl;
-#endif
+	    } catch( ... ) {
+		next = pieces;
+		for( std::size_t t(0); t<workers.size(); ++t ) workers[t].join();
+		throw;
 	    }
-#ifdef SK_DEBUG_CHECK
-	    check();
-#endif
-	    return std::make_pair(true,node);
+	    work();
+	    for( std::size_t t(0); t<workers.size(); ++t ) workers[t].join();
+	    if( error ) std::rethrow_exception( error );
 	}
-	
-	node_ptr search_node( K const & k ) const {
-	    node_ptr next( find_next( k ) );
-	    
-	    if( !next ) {
-		return node_ptr();
-	    }
-	    if( m_comp( extract_key()(next->value()), k ) || m_comp( k, extract_key()(next->value()) ) ) {
-		//std::cout << "k is " << k << ", next->key() is " << next->key() << std::endl;
-		//std::cout << "next is " << next << ", head is " << m_head << std::endl;
-		return node_ptr();
+
+	/*
+	  Cuts [first,last) into pieces for threads threads, at the nodes
+	  tall enough to reach a level with about eight pieces per thread
+	  across the whole list. Only the first piece is found along level
+	  0; the rest of the cuts come from walking that one higher level.
+	  cuts is left holding the start of each piece, then last.
+	*/
+	void partition( node_ptr first, node_ptr last, unsigned int threads, std::vector<node_ptr> & cuts ) const {
+	    cuts.clear();
+	    cuts.push_back( first );
+	    std::size_t span( m_size / ( 8 * threads ) );
+	    unsigned int level( span ? ( 63 - __builtin_clzll( span ) ) / bits() : 0 );
+	    if( level >= m_height ) level = m_height - 1;
+	    if( level && threads > 1 ) {
+		node_ptr p( first );
+		while( p != last && p->height() <= level ) {
+		    p = (*p)[0];
+		}
+		// Stop short of last by key; with equal keys the final piece
+		// just runs a little longer.
+		while( p && p != last && ( !last || m_comp( extract_key()(p->value()), extract_key()(last->value()) ) ) ) {
+		    if( p != first ) cuts.push_back( p );
+		    p = (*p)[level];
+		}
 	    }
-	    
-	    return next;
+	    cuts.push_back( last );
 	}
-	
-	size_t erase_node( K const & k, node_ptr start=node_ptr(), node_ptr end=node_ptr() ) {
-	    node_ptr update[m_height];
-	    for( unsigned int i(0); i<m_height-1; ++i ) {
-		update[i] = 0;
+
+	static const unsigned int interleave_width = 16;
+
+	// One descent of an interleaved batch.
+	struct descent {
+	    K const * m_key;
+	    node_ptr m_current;
+	    node_ptr m_next;
+	    std::size_t m_index;
+	    unsigned int m_level;
+	};
+
+	static void prefetch( node_ptr n ) {
+	    __builtin_prefetch( n->value_ptr() );
+	    __builtin_prefetch( &(*n)[0] );
+	}
+
+	template< typename I > void start_descent( descent & d, I & first, std::size_t & index ) const {
+	    SK_STAT( ++m_counters.m_searches );
+	    d.m_key = &*first;
+	    ++first;
+	    d.m_index = index++;
+	    d.m_current = m_head;
+	    d.m_level = levels() - 1;
+	    d.m_next = (*m_head)[d.m_level];
+	    if( d.m_next ) prefetch( d.m_next );
+	}
+
+	/*
+	  Carries d on until it needs a node it hasn't prefetched, and
+	  returns true, or until it's found the first node not less than
+	  its key, which is left in m_next, and returns false.
+	*/
+	bool step_descent( descent & d ) const {
+	    for( ;; ) {
+		if( d.m_next ) {
+		    SK_STAT( ++m_counters.m_comparisons );
+		    if( m_comp( next_key( d.m_current, d.m_next, d.m_level ), *d.m_key ) ) {
+			SK_STAT( ++m_counters.m_visits[d.m_level] );
+			d.m_current = d.m_next;
+			d.m_next = (*d.m_current)[d.m_level];
+			if( d.m_next ) {
+			    prefetch( d.m_next );
+			    return true;
+			}
+			continue;
+		    }
+		}
+		if( 0==d.m_level ) return false;
+		node_ptr n( (*d.m_current)[--d.m_level] );
+		// Often the same node as above, and already to hand.
+		if( n != d.m_next ) {
+		    d.m_next = n;
+		    if( n ) {
+			prefetch( n );
+			return true;
+		    }
+		}
 	    }
-	    node_ptr next( find_next( k, update, start ) );
-	    
-	    if( !next ) {
-		return 0;
+	}
+
+	template< typename I, typename O > O interleave( I first, I last, O out, bool exact ) {
+	    descent slots[interleave_width];
+	    std::size_t index( 0 );
+	    unsigned int live( 0 );
+	    for( ; live<interleave_width && first!=last; ++live ) {
+		start_descent( slots[live], first, index );
 	    }
-	    if( m_comp( extract_key()(next->value()), k ) || m_comp( k, extract_key()(next->value()) ) ) {
-		return 0;
+	    while( live ) {
+		for( unsigned int s(0); s<live; ) {
+		    descent & d( slots[s] );
+		    if( step_descent( d ) ) {
+			++s;
+			continue;
+		    }
+		    node_ptr r( d.m_next );
+		    if( exact && r && m_comp( *d.m_key, extract_key()(r->value()) ) ) {
+			r = node_ptr();
+		    }
+		    out[d.m_index] = make_iterator( r );
+		    if( first != last ) {
+			start_descent( d, first, index );
+			++s;
+		    } else {
+			d = slots[--live];
+		    }
+		}
 	    }
-	    
-	    if( !end ) {
-		end = (*next)[0];
+	    return out + index;
+	}
+
+	// Makes nodes safe to move between the two lists.
+	void share_pool( my_type & other ) {
+	    pool_type * mine( m_pool.get() );
+	    pool_type * theirs( other.m_pool.get() );
+	    if( mine != theirs ) {
+		mine->absorb( *theirs );
 	    }
-	    
-	    size_t counter( 0 );
-	    while( next!=end ) {
+	}
+
+	node_ptr * finger() {
+	    if( !m_finger ) {
+		m_finger = path_allocator( m_pool->allocator() ).allocate( maxheight );
+	    }
+	    return m_finger;
+	}
+	
+#ifdef SK_DEBUG_CHECK
+    public:
+	/*
+	  Walks every level, checking that it runs in key order and
+	  skips nothing the level below holds, and that the back links
+	  and tail agree with level 0. Throws on the first fault.
+	*/
+	void check() const {
+	    for( unsigned int i(0); i<m_height; ++i ) {
+		node_ptr below( m_head );
+		for( node_ptr current( (*m_head)[i] ), prev( m_head ); current; prev = current, current = (*current)[i] ) {
+		    if( current->height() <= i ) {
+			throw std::runtime_error( "Skiplist node linked above its height" );
+		    }
+		    if( prev != m_head && m_comp( extract_key()(current->value()), extract_key()(prev->value()) ) ) {
+			throw std::runtime_error( "Skiplist level out of order" );
+		    }
+		    if( P::cache_keys && ( m_comp( cached_key( prev, i ), extract_key()(current->value()) ) || m_comp( extract_key()(current->value()), cached_key( prev, i ) ) ) ) {
+			throw std::runtime_error( "Skiplist cached key is stale" );
+		    }
+		    if( i > 0 ) {
+			// Everything on this level must be on the one below, in the same order.
+			while( below && below != current ) below = (*below)[i-1];
+			if( !below ) {
+			    throw std::runtime_error( "Skiplist level skips ahead of the one below" );
+			}
+		    }
+		}
+	    }
+	    node_ptr prev( m_head );
+	    std::size_t count( 0 );
+	    for( node_ptr current( (*m_head)[0] ); current; prev = current, current = (*current)[0] ) {
+		if( (*current)[-1] != prev ) {
+		    throw std::runtime_error( "Skiplist back link is wrong" );
+		}
+		++count;
+	    }
+	    if( count != m_size || m_tail != ( prev == m_head ? node_ptr() : prev ) ) {
+		throw std::runtime_error( "Skiplist size or tail is wrong" );
+	    }
+	}
+    private:
+#endif
+	
+	/*
+	  Finds where k goes, leaving its predecessors in update[] and,
+	  when indexed, their ranks in rank[]. A near search points update
+	  at the finger instead; near is cleared where that can't be done.
+	*/
+	node_ptr find_slot( K const & k, node_ptr *& update, std::size_t rank[], bool & near ) {
+	    // The finger doesn't carry ranks.
+	    if( P::indexed ) near = false;
+	    if( near ) {
+		update = finger();
+		if( m_finger_valid ) {
+		    return find_from( k, update );
+		}
+		m_finger_valid = true;
+		return find_next( k, update );
+	    }
+	    return find_next( k, update, node_ptr(), P::indexed ? rank : 0 );
+	}
+
+	// Links node in at the slot find_slot left in update[].
+	void link_node( node_ptr node, node_ptr update[], std::size_t rank[], bool near ) {
+	    unsigned int height( node->height() );
 #ifdef SK_VERBOSE_DEBUG
-		std::cout << "Next is " << next << ", end is " << end << std::endl;
+	    std::cout << "Using height of " << height << std::endl;
+	    std::cout << "Node extends from " << node->value_ptr() << " to " << (void*)(((char*)(node->value_ptr()))+node_type::alloc_size(height)) << std::endl;
 #endif
-		--m_size;
-		(*next)[-1] = update[0];
+	    ++m_size;
+	    SK_STAT( ++m_counters.m_inserts );
+	    (*node)[-1] = update[0];
+	    for( unsigned int i(0); i<height; ++i ) {
+		take_link( node, i, update[i] );
+		set_link( update[i], i, node );
+	    }
+	    if( node_ptr next = (*node)[0] ) {
+		(*next)[-1] = node;
+	    } else {
+		m_tail = node;
+	    }
+	    if( P::indexed ) {
+		std::size_t r( rank[0] + 1 );
 		for( unsigned int i(0); i<m_height; ++i ) {
-		    if( next->height() <= i ) break;
-		    (*(update[i]))[i] = (*next)[i];
-#ifdef SK_VERBOSE_DEBUG
-		    std::cout << "Updated node " << update[i]->value().first << std::endl;
-		    std::cout << "Now points to ";
-		    if( (*next)[i] ) {
-			std::cout << (*next)[i]->value().first << " [" << (*(update[i]))[i]->value().first << "]";
+		    if( i < height ) {
+			width( node, i ) = rank[i] + width( update[i], i ) + 1 - r;
+			width( update[i], i ) = r - rank[i];
 		    } else {
-			std::cout << "NIL";
+			++width( update[i], i );
 		    }
-		    std::cout << " at height " << i;
-		    std::cout << std::endl;	
-#endif
 		}
-		node_ptr tmp( (*next)[0] );
-		delete_node( next );
-		next = tmp;
-#ifdef SK_VERBOSE_DEBUG
-		std::cout << "Now deleted " << counter << " nodes.\n";
+	    }
+	    if( near ) {
+		for( unsigned int i(0); i<height; ++i ) {
+		    update[i] = node;
+		}
+	    } else {
+		// The node may sit between the finger and the keys after it.
+		m_finger_valid = false;
+	    }
+#ifdef SK_DEBUG_CHECK
+	    check();
 #endif
-		counter++;
+	}
+
+	/*
+	  Unlinks the run [first,last), given its predecessors in update[].
+	  One pass along level 0 notes the last node of the run on each
+	  level, then each level is spliced once, and the nodes are freed
+	  without any further link surgery. update[] is left holding the
+	  predecessors of last.
+	*/
+	size_t erase_run( node_ptr update[], node_ptr first, node_ptr last ) {
+	    node_ptr last_in_run[maxheight];
+	    std::size_t spans[P::indexed ? maxheight : 1];
+	    for( unsigned int i(0); i<m_height; ++i ) {
+		last_in_run[i] = 0;
+		if( P::indexed ) spans[i] = 0;
+	    }
+	    size_t counter( 0 );
+	    for( node_ptr x( first ); x!=last; x=(*x)[0] ) {
+		++counter;
+		for( unsigned int i(0); i<x->height(); ++i ) {
+		    last_in_run[i] = x;
+		    if( P::indexed ) spans[i] += width( x, i );
+		}
+	    }
+	    for( unsigned int i(0); i<m_height; ++i ) {
+		if( last_in_run[i] ) {
+		    take_link( update[i], i, last_in_run[i] );
+		    if( P::indexed ) width( update[i], i ) += spans[i] - counter;
+		} else if( P::indexed ) {
+		    width( update[i], i ) -= counter;
+		}
+	    }
+	    if( last ) {
+		(*last)[-1] = update[0];
+	    } else {
+		m_tail = update[0] == m_head ? node_ptr() : update[0];
+	    }
+	    m_size -= counter;
+	    SK_STAT( m_counters.m_erases += counter );
+	    m_finger_valid = false;
+	    while( first!=last ) {
+		node_ptr tmp( (*first)[0] );
+		delete_node( first );
+		first = tmp;
+	    }
 #ifdef SK_DEBUG_CHECK
-		check();
+	    check();
 #endif
+	    return counter;
+	}
+
+	/*
+	  Fills update[] with the predecessors of stop, which must be the
+	  tail, or null for the end, by following each level to its end.
+	*/
+	void find_end_path( node_ptr update[], node_ptr stop ) const {
+	    node_ptr current( m_head );
+	    for( unsigned int i(m_height-1);; --i ) {
+		node_ptr next;
+		while( ( next = (*current)[i] ) && next != stop ) {
+		    current = next;
+		}
+		update[i] = current;
+		if( 0==i ) break;
+	    }
+	}
+
+	// Fills update[] with n's own predecessors, past any equal keys ahead of it.
+	void find_path( node_ptr n, node_ptr update[] ) const {
+	    for( node_ptr p( find_next( extract_key()(n->value()), update ) ); p!=n; p=(*p)[0] ) {
+		for( unsigned int i(0); i<p->height(); ++i ) {
+		    update[i] = p;
+		}
+	    }
+	}
+
+	// A node holding value_type( args... ), not yet linked in.
+	template< typename... Args > node_ptr build_node( Args&&... args ) {
+	    node_ptr node( new_node( pickheight() ) );
+	    try {
+		new( node->value_ptr() ) value_type( std::forward<Args>( args )... );
+	    } catch( ... ) {
+		destroy_node( node );
+		throw;
+	    }
+	    return node;
+	}
+
+    public:
+	std::pair<bool,node_ptr> insert_node(V const & v, bool allow_dups=true) {
+	    return emplace_key( extract_key()(v), allow_dups, m_finger_mode, v );
+	}
+	std::pair<bool,node_ptr> insert_node(V && v, bool allow_dups=true) {
+	    return emplace_key( extract_key()(v), allow_dups, m_finger_mode, std::move( v ) );
+	}
+
+	/*
+	  Inserts value_type( args... ) under k, built straight into the
+	  node once the one search has found its slot. If k is present and
+	  dups aren't allowed, nothing is built and args are left untouched.
+	  k needs to outlive the search only, so it may refer into args.
+	*/
+	template< typename... Args > std::pair<bool,node_ptr> emplace_key( K const & k, bool allow_dups, bool near, Args&&... args ) {
+	    check_header();
+	    node_ptr local[maxheight];
+	    node_ptr * update( local );
+	    std::size_t rank[P::indexed ? maxheight : 1];
+	    node_ptr next( find_slot( k, update, rank, near ) );
+	    if( !allow_dups && next && !m_comp( k, extract_key()(next->value()) ) ) {
+		return std::make_pair( false, next );
+	    }
+	    node_ptr node( build_node( std::forward<Args>( args )... ) );
+	    link_node( node, update, rank, near );
+	    return std::make_pair( true, node );
+	}
+
+	// As emplace_key, for when the key is only known once the value is built.
+	template< typename... Args > std::pair<bool,node_ptr> emplace_node( bool allow_dups, bool near, Args&&... args ) {
+	    check_header();
+	    node_ptr node( build_node( std::forward<Args>( args )... ) );
+	    K const & k( extract_key()(node->value()) );
+	    node_ptr local[maxheight];
+	    node_ptr * update( local );
+	    std::size_t rank[P::indexed ? maxheight : 1];
+	    node_ptr next;
+	    try {
+		next = find_slot( k, update, rank, near );
+	    } catch( ... ) {
+		delete_node( node );
+		throw;
+	    }
+	    if( !allow_dups && next && !m_comp( k, extract_key()(next->value()) ) ) {
+		delete_node( node );
+		return std::make_pair( false, next );
+	    }
+	    link_node( node, update, rank, near );
+	    return std::make_pair( true, node );
+	}
+
+	/*
+	  As emplace_node, with std::map's hint: if the key belongs just
+	  before hint (a null hint being the end), the node goes there,
+	  and its predecessors are found by walking back along level 0
+	  from hint, with no key comparisons. If it belongs elsewhere, or
+	  the walk runs as long as a search would, it's searched for as
+	  usual. Indexed lists always search, as the widths need every
+	  level, so their equal keys go in ahead of each other rather than
+	  before hint. The finger plays no part.
+	*/
+	template< typename... Args > std::pair<bool,node_ptr> emplace_hint_node( node_ptr hint, bool allow_dups, Args&&... args ) {
+	    // The walk back doesn't find ranks.
+	    if( P::indexed ) return emplace_node( allow_dups, false, std::forward<Args>( args )... );
+	    check_header();
+	    node_ptr node( build_node( std::forward<Args>( args )... ) );
+	    K const & k( extract_key()(node->value()) );
+	    node_ptr update[maxheight];
+	    node_ptr prev( hint ? (*hint)[-1] : ( m_tail ? m_tail : m_head ) );
+	    try {
+		// Multis insert as close before hint as order allows.
+		bool fits( true );
+		if( hint && ( allow_dups ? m_comp( extract_key()(hint->value()), k ) : !m_comp( k, extract_key()(hint->value()) ) ) ) {
+		    if( !allow_dups && !m_comp( extract_key()(hint->value()), k ) ) {
+			delete_node( node );
+			return std::make_pair( false, hint );
+		    }
+		    fits = false;
+		}
+		if( fits && prev != m_head && ( allow_dups ? m_comp( k, extract_key()(prev->value()) ) : !m_comp( extract_key()(prev->value()), k ) ) ) {
+		    if( !allow_dups && !m_comp( k, extract_key()(prev->value()) ) ) {
+			delete_node( node );
+			return std::make_pair( false, prev );
+		    }
+		    fits = false;
+		}
+		if( fits ) {
+		    // About the number of steps a search takes; the head is tall enough to end any walk.
+		    unsigned int budget( m_height << bits() );
+		    node_ptr p( prev );
+		    update[0] = prev;
+		    for( unsigned int i(1); i<node->height(); ++i ) {
+			while( p->height() <= i && budget ) {
+			    p = (*p)[-1];
+			    --budget;
+			}
+			if( p->height() <= i ) {
+			    // Too far back; find hint's predecessors from the top.
+			    if( hint ) {
+				find_path( hint, update );
+			    } else {
+				find_end_path( update, node_ptr() );
+			    }
+			    break;
+			}
+			update[i] = p;
+		    }
+		} else {
+		    node_ptr next( find_next( k, update ) );
+		    if( !allow_dups && next && !m_comp( k, extract_key()(next->value()) ) ) {
+			delete_node( node );
+			return std::make_pair( false, next );
+		    }
+		}
+	    } catch( ... ) {
+		delete_node( node );
+		throw;
+	    }
+	    link_node( node, update, 0, false );
+	    return std::make_pair( true, node );
+	}
+	
+	template< typename KK > node_ptr search_node( KK const & k ) const {
+	    node_ptr next( find_next( k ) );
+	    
+	    if( !next ) {
+		return node_ptr();
+	    }
+	    if( m_comp( extract_key()(next->value()), k ) || m_comp( k, extract_key()(next->value()) ) ) {
+		//std::cout << "k is " << k << ", next->key() is " << next->key() << std::endl;
+		//std::cout << "next is " << next << ", head is " << m_head << std::endl;
+		return node_ptr();
+	    }
+	    
+	    return next;
+	}
+	// The number of nodes with key k.
+	template< typename KK > size_t count_node( KK const & k ) const {
+	    size_t counter( 0 );
+	    for( node_ptr p( find_next( k ) ); p && !m_comp( k, extract_key()(p->value()) ); p=(*p)[0] ) {
+		++counter;
 	    }
 	    return counter;
 	}
 	
+	// Erases the first node with key k, or every one if all is set.
+	template< typename KK > size_t erase_node( KK const & k, bool all=false ) {
+	    node_ptr update[maxheight];
+	    node_ptr next( find_next( k, update ) );
+	    if( !next || m_comp( k, extract_key()(next->value()) ) ) {
+		return 0;
+	    }
+	    node_ptr end( (*next)[0] );
+	    if( all ) {
+		while( end && !m_comp( k, extract_key()(end->value()) ) ) {
+		    end = (*end)[0];
+		}
+	    }
+	    return erase_run( update, next, end );
+	}
+
+	// Erases [first,last); a null last is the end.
+	size_t erase_range( node_ptr first, node_ptr last ) {
+	    if( first==last ) {
+		return 0;
+	    }
+	    node_ptr update[maxheight];
+	    find_path( first, update );
+	    return erase_run( update, first, last );
+	}
+
+	// Erases everything pred holds true for, in one pass over level 0.
+	template< typename F > size_t erase_if( F pred ) {
+	    node_ptr update[maxheight];
+	    for( unsigned int i(0); i<m_height; ++i ) {
+		update[i] = m_head;
+	    }
+	    size_t counter( 0 );
+	    node_ptr x( (*m_head)[0] );
+	    while( x ) {
+		if( pred( x->value() ) ) {
+		    node_ptr last( (*x)[0] );
+		    while( last && pred( last->value() ) ) {
+			last = (*last)[0];
+		    }
+		    counter += erase_run( update, x, last );
+		    if( !last ) break;
+		    x = last;
+		}
+		for( unsigned int i(0); i<x->height(); ++i ) {
+		    update[i] = x;
+		}
+		x = (*x)[0];
+	    }
+	    return counter;
+	}
+	
+	/*
+	  Queue operations, for lists used as schedulers and the like.
+	  The list must not be empty. pop_front needs no search at all:
+	  every link to the first node comes from the head, so it's
+	  O(height of that node). pop_back finds the last node's
+	  predecessors by following each level to its end, which is
+	  O(log n) steps but no key comparisons.
+	*/
+	value_type & front() {
+	    return (*m_head)[0]->value();
+	}
+	value_type const & front() const {
+	    return (*m_head)[0]->value();
+	}
+	value_type & back() {
+	    return m_tail->value();
+	}
+	value_type const & back() const {
+	    return m_tail->value();
+	}
+	void pop_front() {
+	    node_ptr n( (*m_head)[0] );
+	    unsigned int h( n->height() );
+	    for( unsigned int i(0); i<h; ++i ) {
+		take_link( m_head, i, n );
+		if( P::indexed ) width( m_head, i ) = width( n, i );
+	    }
+	    if( P::indexed ) {
+		for( unsigned int i(h); i<m_height; ++i ) {
+		    --width( m_head, i );
+		}
+	    }
+	    if( node_ptr next = (*n)[0] ) {
+		(*next)[-1] = m_head;
+	    } else {
+		m_tail = node_ptr();
+	    }
+	    --m_size;
+	    SK_STAT( ++m_counters.m_erases );
+	    m_finger_valid = false;
+	    delete_node( n );
+	}
+	void pop_back() {
+	    node_ptr update[maxheight];
+	    find_end_path( update, m_tail );
+	    erase_run( update, m_tail, node_ptr() );
+	}
+	
 	size_t size() const {
 	    return m_size;
 	}
+	bool empty() const {
+	    return m_size == 0;
+	}
+
+	/*
+	  Moves every node not less than k into other, which must be
+	  empty. Only the one link per level that crosses the cut changes;
+	  nodes aren't copied or reallocated, so from then on the two lists
+	  share a pool - which locks, so each may go to its own thread.
+	  Working out how many moved is free when indexed, and otherwise
+	  a walk over whichever side is shorter.
+	*/
+	void split_into( K const & k, my_type & other ) {
+	    other.grow_header( m_height );
+	    share_pool( other );
+	    node_ptr update[maxheight];
+	    std::size_t rank[P::indexed ? maxheight : 1];
+	    node_ptr first( find_next( k, update, node_ptr(), P::indexed ? rank : 0 ) );
+	    std::size_t moved( 0 );
+	    if( P::indexed ) {
+		moved = m_size - rank[0];
+	    } else {
+		for( node_ptr l( (*m_head)[0] ), r( first );; l=(*l)[0], r=(*r)[0], ++moved ) {
+		    if( l == first ) {
+			moved = m_size - moved;
+			break;
+		    }
+		    if( !r ) break;
+		}
+	    }
+	    for( unsigned int i(0); i<other.m_height; ++i ) {
+		if( i >= m_height ) {
+		    if( P::indexed ) width( other.m_head, i ) = moved + 1;
+		    continue;
+		}
+		other.take_link( other.m_head, i, update[i] );
+		set_link( update[i], i, node_ptr() );
+		if( P::indexed ) {
+		    width( other.m_head, i ) = rank[i] + width( update[i], i ) - rank[0];
+		    width( update[i], i ) = rank[0] + 1 - rank[i];
+		}
+	    }
+	    if( first ) {
+		(*first)[-1] = other.m_head;
+		other.m_tail = m_tail;
+		m_tail = update[0] == m_head ? node_ptr() : update[0];
+	    }
+	    m_size -= moved;
+	    other.m_size = moved;
+	    m_finger_valid = false;
+	    other.m_finger_valid = false;
+	}
+
+	/*
+	  Moves every node of other onto our end, leaving it empty. Its
+	  keys must all follow ours - or, if !unique, may equal our last.
+	  One link per level changes, and the two lists share a pool, as
+	  after split_into.
+	*/
+	void join( my_type & other, bool unique ) {
+	    if( &other == this || !other.m_size ) {
+		return;
+	    }
+	    grow_header( other.m_height );
+	    node_ptr tails[maxheight];
+	    node_ptr current( m_head );
+	    for( unsigned int i(m_height-1);; --i ) {
+		while( node_ptr next = (*current)[i] ) {
+		    current = next;
+		}
+		tails[i] = current;
+		if( 0==i ) break;
+	    }
+	    node_ptr front( (*other.m_head)[0] );
+	    if( m_size ) {
+		K const & fk( extract_key()(front->value()) );
+		K const & tk( extract_key()(tails[0]->value()) );
+		if( m_comp( fk, tk ) || ( unique && !m_comp( tk, fk ) ) ) {
+		    throw std::invalid_argument( "Skiplist join needs all keys after ours" );
+		}
+	    }
+	    share_pool( other );
+	    for( unsigned int i(0); i<m_height; ++i ) {
+		if( i < other.m_height ) {
+		    if( P::indexed ) width( tails[i], i ) += width( other.m_head, i ) - 1;
+		    take_link( tails[i], i, other.m_head );
+		    other.set_link( other.m_head, i, node_ptr() );
+		    if( P::indexed ) width( other.m_head, i ) = 1;
+		} else if( P::indexed ) {
+		    width( tails[i], i ) += other.m_size;
+		}
+	    }
+	    (*front)[-1] = tails[0];
+	    m_tail = other.m_tail;
+	    other.m_tail = node_ptr();
+	    m_size += other.m_size;
+	    other.m_size = 0;
+	    m_finger_valid = false;
+	    other.m_finger_valid = false;
+	}
+
+	// With finger search on, unhinted inserts start from where the last one finished.
+	void finger_search( bool on ) {
+	    m_finger_mode = on;
+	}
+	bool finger_search() const {
+	    return m_finger_mode;
+	}
+
+	// Reseeds the height generator, for reproducible layouts.
+	void seed( std::uint64_t s ) {
+	    m_rng = s ? s : 0x9E3779B97F4A7C15ull;
+	}
 	
 	node_ptr head() {
 	    return m_head;
 	}
 	
+	// An iterator onto n, which may be null for end().
+	iterator make_iterator( node_ptr n ) {
+	    return iterator( n, &m_tail );
+	}
+	const_iterator make_iterator( node_ptr n ) const {
+	    return const_iterator( n, &m_tail );
+	}
+	std::pair<bool,iterator> make_iterator( std::pair<bool,node_ptr> const & r ) {
+	    return std::make_pair( r.first, make_iterator( r.second ) );
+	}
+	
 	iterator begin() {
-	    return iterator( (*m_head)[0] );
+	    return make_iterator( (*m_head)[0] );
 	}
 	const_iterator begin() const {
-	    return const_iterator( (*m_head)[0] );
+	    return make_iterator( (*m_head)[0] );
 	}
 	iterator end() {
-	    return iterator( node_ptr() );
+	    return make_iterator( node_ptr() );
 	}
 	const_iterator end() const {
-	    return const_iterator( node_ptr() );
+	    return make_iterator( node_ptr() );
+	}
+	reverse_iterator rbegin() {
+	    return reverse_iterator( end() );
+	}
+	const_reverse_iterator rbegin() const {
+	    return const_reverse_iterator( end() );
+	}
+	reverse_iterator rend() {
+	    return reverse_iterator( begin() );
+	}
+	const_reverse_iterator rend() const {
+	    return const_reverse_iterator( begin() );
+	}
+	// The last element, or end() if there are none; O(1).
+	iterator last() {
+	    return make_iterator( m_tail );
+	}
+	const_iterator last() const {
+	    return make_iterator( m_tail );
+	}
+	/*
+	  Backwards from the last element not greater than k, in O(log n);
+	  rend() if every key is greater.
+	*/
+	reverse_iterator reverse_lower_bound( key_type const & k ) {
+	    return reverse_iterator( make_iterator( (*find_last_not_greater( k ))[0] ) );
+	}
+	const_reverse_iterator reverse_lower_bound( key_type const & k ) const {
+	    return const_reverse_iterator( make_iterator( (*find_last_not_greater( k ))[0] ) );
 	}
 	
 	iterator lower_bound( key_type const & k ) {
-	    return find_next( k );
+	    return make_iterator( find_next( k ) );
 	}
+	// One descent, however many keys equal k.
 	iterator upper_bound( key_type const & k ) {
-	    node_ptr p( find_next( k ) );
-	    while( p && !m_comp( extract_key()(p->value()), k ) ) p=(*p)[0];
-	    return p;
+	    return make_iterator( (*find_last_not_greater( k ))[0] );
 	}
 	std::pair<iterator,iterator> equal_range( key_type const & k ) {
 	    node_ptr f( find_next( k ) );
 	    node_ptr e(f);
-	    while( e && !m_comp( extract_key()(e->value()), k ) ) e=(*e)[0];
-	    return std::make_pair( f, e );
+	    while( e && !m_comp( k, extract_key()(e->value()) ) ) e=(*e)[0];
+	    return std::make_pair( make_iterator( f ), make_iterator( e ) );
+	}
+	/*
+	  With a transparent comparator, such as std::less<>, lookups
+	  take anything it can compare with K, so there's no temporary
+	  key to build.
+	*/
+	template< typename KK, typename C=L, typename=typename C::is_transparent > iterator lower_bound( KK const & k ) {
+	    return make_iterator( find_next( k ) );
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > iterator upper_bound( KK const & k ) {
+	    return make_iterator( (*find_last_not_greater( k ))[0] );
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > std::pair<iterator,iterator> equal_range( KK const & k ) {
+	    node_ptr f( find_next( k ) );
+	    node_ptr e(f);
+	    while( e && !m_comp( k, extract_key()(e->value()) ) ) e=(*e)[0];
+	    return std::make_pair( make_iterator( f ), make_iterator( e ) );
+	}
+
+	/*
+	  Positional access, for indexed policies only.
+	  Positions count from 0; end() is at size().
+	*/
+	iterator nth( size_type n ) {
+	    static_assert( P::indexed, "nth() needs an indexed policy" );
+	    if( n >= m_size ) return end();
+	    std::size_t pos( 0 );
+	    node_ptr current( m_head );
+	    for( unsigned int i(m_height-1);; --i ) {
+		node_ptr next;
+		while( ( next = (*current)[i] ) && pos + width( current, i ) <= n + 1 ) {
+		    pos += width( current, i );
+		    current = next;
+		}
+		if( pos == n + 1 || 0==i ) break;
+	    }
+	    return make_iterator( current );
+	}
+	// The number of elements less than k.
+	size_type rank( key_type const & k ) const {
+	    static_assert( P::indexed, "rank() needs an indexed policy" );
+	    std::size_t ranks[maxheight];
+	    find_next( k, 0, node_ptr(), ranks );
+	    return ranks[0];
+	}
+	size_type index_of( const_iterator i ) const {
+	    static_assert( P::indexed, "index_of() needs an indexed policy" );
+	    node_ptr n( i.priv_node() );
+	    if( !n ) return m_size;
+	    std::size_t ranks[maxheight];
+	    node_ptr p( find_next( extract_key()(n->value()), 0, node_ptr(), ranks ) );
+	    std::size_t pos( ranks[0] );
+	    // Step over any equal keys ahead of it.
+	    for( ; p != n; p = (*p)[0] ) ++pos;
+	    return pos;
+	}
+	difference_type distance( const_iterator first, const_iterator last ) const {
+	    return difference_type( index_of( last ) ) - difference_type( index_of( first ) );
+	}
+
+	/*
+	  Batch lookups. Each key in [first,last) is searched for from the
+	  path the previous one left, so a sorted batch costs one descent
+	  plus the distance covered rather than a descent per key. Any
+	  order gives the right answers; sorted is simply fastest.
+	  Results are written to out in input order.
+	*/
+	template< typename I, typename O > O lower_bound_many( I first, I last, O out ) {
+	    node_ptr path[maxheight];
+	    bool started( false );
+	    for( ; first!=last; ++first ) {
+		K const & k( *first );
+		*out++ = make_iterator( started ? find_from( k, path ) : find_next( k, path ) );
+		started = true;
+	    }
+	    return out;
+	}
+	template< typename I, typename O > O find_many( I first, I last, O out ) {
+	    node_ptr path[maxheight];
+	    bool started( false );
+	    for( ; first!=last; ++first ) {
+		K const & k( *first );
+		node_ptr next( started ? find_from( k, path ) : find_next( k, path ) );
+		started = true;
+		if( next && m_comp( k, extract_key()(next->value()) ) ) {
+		    next = node_ptr();
+		}
+		*out++ = make_iterator( next );
+	    }
+	    return out;
 	}
 	
+	/*
+	  Lookups for a batch of unrelated keys, interleaved. Up to
+	  interleave_width descents are kept going at once; each stops as
+	  soon as it needs a node that isn't in cache yet, prefetches it,
+	  and lets the next descent have a turn, so the misses of a whole
+	  group overlap rather than being taken one after another. This
+	  pays on lists far bigger than the cache, with keys in no useful
+	  order - sorted batches do better with find_many. The result for
+	  the n'th key goes to out[n], so out must be random access; the
+	  return is out advanced past the last.
+	*/
+	template< typename I, typename O > O find_interleaved( I first, I last, O out ) {
+	    return interleave( first, last, out, true );
+	}
+	template< typename I, typename O > O lower_bound_interleaved( I first, I last, O out ) {
+	    return interleave( first, last, out, false );
+	}
+
+	/*
+	  Whole-range passes spread over threads threads - by default, one
+	  per core. The range is cut at nodes of a high level, so finding
+	  the pieces costs little more than a search. f and fold are called
+	  from several threads at once, on distinct elements; the list must
+	  not change meanwhile.
+	*/
+	template< typename I, typename F > void parallel_for_each( I first, I last, F f, unsigned int threads=0 ) {
+	    threads = thread_count( threads );
+	    std::vector<node_ptr> cuts;
+	    partition( first.priv_node(), last.priv_node(), threads, cuts );
+	    run_parallel( cuts.size() - 1, threads, [&]( std::size_t i ) {
+		for( node_ptr n( cuts[i] ); n != cuts[i+1]; n = (*n)[0] ) {
+		    f( n->value() );
+		}
+	    } );
+	}
+	/*
+	  Each piece is folded from identity, in order, and the pieces'
+	  results are then combined, in order, from identity.
+	*/
+	template< typename I, typename T, typename F, typename C > T parallel_reduce( I first, I last, T identity, F fold, C combine, unsigned int threads=0 ) const {
+	    threads = thread_count( threads );
+	    std::vector<node_ptr> cuts;
+	    partition( first.priv_node(), last.priv_node(), threads, cuts );
+	    std::vector<T> results( cuts.size() - 1, identity );
+	    run_parallel( results.size(), threads, [&]( std::size_t i ) {
+		T r( identity );
+		for( node_ptr n( cuts[i] ); n != cuts[i+1]; n = (*n)[0] ) {
+		    r = fold( std::move( r ), static_cast<value_type const &>( n->value() ) );
+		}
+		results[i] = std::move( r );
+	    } );
+	    T r( identity );
+	    for( std::size_t i(0); i<results.size(); ++i ) {
+		r = combine( std::move( r ), results[i] );
+	    }
+	    return r;
+	}
+
+	/*
+	  Builds an empty list from sorted [first,last) on threads threads.
+	  The input is cut into one run per thread, each run is bulk built
+	  into a list of its own, and the lists are joined end to end, which
+	  costs one link per level. A run that turns out not to follow its
+	  predecessor is inserted instead, so unsorted input still works,
+	  just not quickly.
+	*/
+	template< typename I > void parallel_build( I first, I last, bool unique, unsigned int threads=0 ) {
+	    if( m_size ) {
+		throw std::invalid_argument( "Skiplist parallel_build needs an empty list" );
+	    }
+	    threads = thread_count( threads );
+	    std::size_t n( std::distance( first, last ) );
+	    // Below this, threads cost more than they save.
+	    std::size_t runs( n / 16384 < threads ? n / 16384 : threads );
+	    if( runs < 2 ) {
+		bulk_load( first, last, unique );
+		return;
+	    }
+	    std::vector<I> starts;
+	    for( std::size_t i(0); i<runs; ++i ) {
+		starts.push_back( first );
+		std::advance( first, n / runs + ( i < n % runs ? 1 : 0 ) );
+	    }
+	    starts.push_back( last );
+	    allocator_type a( m_pool->allocator() );
+	    unsigned int branching( 1u << bits() );
+	    std::vector< std::unique_ptr<my_type> > lists( runs );
+	    run_parallel( runs, threads, [&]( std::size_t i ) {
+		lists[i].reset( new my_type( starts[i], starts[i+1], unique, m_comp, a, branching ) );
+	    } );
+	    for( std::size_t i(0); i<runs; ++i ) {
+		my_type & l( *lists[i] );
+		if( !l.m_size ) continue;
+		if( m_size ) {
+		    K const & fk( extract_key()( (*l.m_head)[0]->value() ) );
+		    K const & tk( extract_key()( m_tail->value() ) );
+		    if( m_comp( fk, tk ) ) {
+			for( node_ptr p( (*l.m_head)[0] ); p; p = (*p)[0] ) {
+			    insert_node( p->value(), !unique );
+			}
+			continue;
+		    }
+		    if( unique && !m_comp( tk, fk ) ) {
+			l.erase_node( fk );
+		    }
+		}
+		join( l, unique );
+	    }
+	}
+
+	/*
+	  The list's shape and, with SK_STATS, its counters. Walks every
+	  node, so it's O(n log n); nothing is kept on the side for it.
+	*/
+	skiplist_stats stats() const {
+	    skiplist_stats st;
+	    st.m_size = m_size;
+	    st.m_height = m_height;
+	    st.m_heights.assign( m_height + 1, 0 );
+	    st.m_node_bytes = node_size( m_head->height() );
+	    // Since the last node reaching level i+1, the number of nodes
+	    // a search crosses at level i; a node's path is the sum above it.
+	    std::size_t run[maxheight];
+	    for( unsigned int i(0); i<m_height; ++i ) run[i] = 0;
+	    double path( 0 );
+	    for( node_ptr n( (*m_head)[0] ); n; n = (*n)[0] ) {
+		unsigned int h( n->height() );
+		++st.m_heights[h];
+		st.m_node_bytes += node_size( h );
+		for( unsigned int i(h); i<m_height; ++i ) path += run[i];
+		path += run[h-1] + 1;
+		++run[h-1];
+		for( unsigned int i(0); i+1<h; ++i ) run[i] = 0;
+	    }
+	    st.m_average_path = m_size ? path / m_size : 0;
+	    st.m_pool_bytes = const_cast<my_type *>( this )->m_pool->reserved();
+#ifdef SK_STATS
+	    st.m_searches = m_counters.m_searches;
+	    st.m_comparisons = m_counters.m_comparisons;
+	    st.m_inserts = m_counters.m_inserts;
+	    st.m_erases = m_counters.m_erases;
+	    st.m_header_grows = m_counters.m_header_grows;
+	    st.m_visits.assign( m_counters.m_visits, m_counters.m_visits + m_height );
+#else
+	    st.m_searches = st.m_comparisons = st.m_inserts = st.m_erases = st.m_header_grows = 0;
+	    st.m_visits.assign( m_height, 0 );
+#endif
+	    return st;
+	}
+	void reset_stats() {
+	    SK_STAT( m_counters = counters() );
+	}
+
 #ifdef SK_HEIGHT_DATA
-	void height_data();
+	void height_data() const {
+	    skiplist_stats st( stats() );
+	    std::cout << "Height map for " << st.m_size << " entries.\n";
+	    for( unsigned int h(1); h<st.m_heights.size(); ++h ) {
+		std::cout << h << " has " << st.m_heights[h] << std::endl;
+	    }
+	    std::cout << "Average search path " << st.m_average_path << ", " << st.m_node_bytes << " bytes in nodes.\n";
+	}
 #endif
     };
 
@@ -526,145 +2037,618 @@ namespace skip {
 	    return p.first;
 	}
     };
+
+    template< typename K > class ExtractSelf {
+    public:
+	K const & operator()(K const & k) {
+	    return k;
+	}
+    };
     
-    template< typename K, typename V, typename L=std::less<K>, typename A=std::allocator< std::pair<K const,V> > > class map : private Skiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L,A> {
+    template< typename K, typename V, typename L=std::less<K>, typename A=std::allocator< std::pair<K const,V> >, typename P=default_policy > class map : private Skiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L,A,P> {
     public:
-	typedef Skiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L,A> parent_type;
+	typedef Skiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L,A,P> parent_type;
 	typedef typename parent_type::iterator iterator;
 	typedef typename parent_type::const_iterator const_iterator;
+	typedef typename parent_type::reverse_iterator reverse_iterator;
+	typedef typename parent_type::const_reverse_iterator const_reverse_iterator;
 	typedef typename parent_type::value_type value_type;
 	typedef typename parent_type::key_type key_type;
 	typedef V mapped_type;
-	explicit map( const L& comp=L(), const A& alloc=A() ) : parent_type( comp, alloc ) {}
-	template< typename I > map( I first, I last, const L& comp=L(), const A& alloc=A() )
-	    : parent_type( first, last, comp, alloc ) {
-		for( I i( first ); i!=last; ++i ) {
-		    insert_node( (*i).first, (*i).second, false );
-		}
-	    }
+	explicit map( const L& comp=L(), const A& alloc=A(), unsigned int branching=parent_type::default_branching ) : parent_type( comp, alloc, branching ) {}
+	template< typename I > map( I first, I last, const L& comp=L(), const A& alloc=A(), unsigned int branching=parent_type::default_branching )
+	    : parent_type( first, last, true, comp, alloc, branching ) {}
 
 	// Both const and non-const forms:
 	using parent_type::begin;
 	using parent_type::end;
+	using parent_type::rbegin;
+	using parent_type::rend;
+	using parent_type::last;
+	using parent_type::reverse_lower_bound;
+	using parent_type::front;
+	using parent_type::back;
 	// And these:
 	using parent_type::lower_bound;
 	using parent_type::upper_bound;
+	using parent_type::equal_range;
+	using parent_type::pop_front;
+	using parent_type::pop_back;
 	using parent_type::size;
+	using parent_type::empty;
+	using parent_type::seed;
+	using parent_type::finger_search;
+	using parent_type::find_many;
+	using parent_type::lower_bound_many;
+	using parent_type::find_interleaved;
+	using parent_type::lower_bound_interleaved;
+	using parent_type::parallel_for_each;
+	using parent_type::parallel_reduce;
+	using parent_type::erase_if;
+	using parent_type::stats;
+	using parent_type::reset_stats;
+#ifdef SK_HEIGHT_DATA
+	using parent_type::height_data;
+#endif
+#ifdef SK_DEBUG_CHECK
+	using parent_type::check;
+#endif
+	// Indexed policies only:
+	using parent_type::nth;
+	using parent_type::rank;
+	using parent_type::index_of;
+	using parent_type::distance;
 	
     protected:
 	typedef typename parent_type::node_ptr node_ptr;
+	map( parent_type & from, const K & k ) : parent_type( from, k ) {}
 	
     public:
+	// Takes everything from k upwards out into a new map, in O(log n).
+	map split( const K & k ) {
+	    return map( *this, k );
+	}
+	// Moves all of other onto the end; its keys must all come after these.
+	void join( map & other ) {
+	    parent_type::join( other, true );
+	}
+	// Builds from sorted [first,last) on several threads; the map must be empty.
+	template< typename I > void parallel_build( I first, I last, unsigned int threads=0 ) {
+	    parent_type::parallel_build( first, last, true, threads );
+	}
 	
+	// One search; on a miss, the mapped value is built in the slot it found.
 	V & operator[]( const K & k ) {
-	    node_ptr n( this->search_node( k ) );
-	    if( !n ) {
-		n = this->insert_node(value_type(k, V()), false ).second;
-	    }
-	    return n->value().second;
+	    return this->emplace_key( k, false, this->finger_search(), std::piecewise_construct, std::forward_as_tuple( k ), std::tuple<>() ).second->value().second;
+	}
+	V & operator[]( K && k ) {
+	    return this->emplace_key( k, false, this->finger_search(), std::piecewise_construct, std::forward_as_tuple( std::move( k ) ), std::tuple<>() ).second->value().second;
 	}
 	
 	iterator find( const K & k ) {
-	    return iterator( this->search_node( k ) );
+	    return this->make_iterator( this->search_node( k ) );
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > iterator find( KK const & k ) {
+	    return this->make_iterator( this->search_node( k ) );
+	}
+	std::size_t count( const K & k ) const {
+	    return this->search_node( k ) != node_ptr();
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > std::size_t count( KK const & k ) const {
+	    return this->search_node( k ) != node_ptr();
 	}
 	
 	std::pair<bool,iterator> insert( value_type const & v ) {
-	    return this->insert_node( v, false );
+	    return this->make_iterator( this->insert_node( v, false ) );
+	}
+	std::pair<bool,iterator> insert( value_type && v ) {
+	    return this->make_iterator( this->insert_node( std::move( v ), false ) );
+	}
+	// Hinted inserts go straight in before the hint, if the key belongs there.
+	iterator insert( const_iterator hint, value_type const & v ) {
+	    return this->make_iterator( this->emplace_hint_node( hint.priv_node(), false, v ).second );
+	}
+	iterator insert( const_iterator hint, value_type && v ) {
+	    return this->make_iterator( this->emplace_hint_node( hint.priv_node(), false, std::move( v ) ).second );
+	}
+	template< typename... Args > std::pair<bool,iterator> emplace( Args&&... args ) {
+	    return this->make_iterator( this->emplace_node( false, this->finger_search(), std::forward<Args>( args )... ) );
+	}
+	template< typename... Args > iterator emplace_hint( const_iterator hint, Args&&... args ) {
+	    return this->make_iterator( this->emplace_hint_node( hint.priv_node(), false, std::forward<Args>( args )... ).second );
+	}
+	// Leave args alone if k is already there.
+	template< typename... Args > std::pair<bool,iterator> try_emplace( const K & k, Args&&... args ) {
+	    return this->make_iterator( this->emplace_key( k, false, this->finger_search(), std::piecewise_construct, std::forward_as_tuple( k ), std::forward_as_tuple( std::forward<Args>( args )... ) ) );
+	}
+	template< typename... Args > std::pair<bool,iterator> try_emplace( K && k, Args&&... args ) {
+	    return this->make_iterator( this->emplace_key( k, false, this->finger_search(), std::piecewise_construct, std::forward_as_tuple( std::move( k ) ), std::forward_as_tuple( std::forward<Args>( args )... ) ) );
+	}
+	template< typename M > std::pair<bool,iterator> insert_or_assign( const K & k, M && m ) {
+	    std::pair<bool,node_ptr> r( this->emplace_key( k, false, this->finger_search(), std::piecewise_construct, std::forward_as_tuple( k ), std::forward_as_tuple( std::forward<M>( m ) ) ) );
+	    if( !r.first ) {
+		r.second->value().second = std::forward<M>( m );
+	    }
+	    return this->make_iterator( r );
+	}
+	template< typename M > std::pair<bool,iterator> insert_or_assign( K && k, M && m ) {
+	    std::pair<bool,node_ptr> r( this->emplace_key( k, false, this->finger_search(), std::piecewise_construct, std::forward_as_tuple( std::move( k ) ), std::forward_as_tuple( std::forward<M>( m ) ) ) );
+	    if( !r.first ) {
+		r.second->value().second = std::forward<M>( m );
+	    }
+	    return this->make_iterator( r );
 	}
 	
-	void erase( key_type const & k ) {
-	    parent_type::erase_node( k );
+	std::size_t erase( key_type const & k ) {
+	    return this->erase_node( k );
 	}
-	void erase( iterator const & i ) {
-	    parent_type::erase_node( (*i).first, i.node_ptr );
+	// Iterators still go to the overloads below.
+	template< typename KK, typename C=L, typename=typename C::is_transparent, typename=typename std::enable_if< !std::is_convertible<KK,const_iterator>::value >::type > std::size_t erase( KK const & k ) {
+	    return this->erase_node( k );
+	}
+	iterator erase( const_iterator i ) {
+	    node_ptr n( i.priv_node() );
+	    node_ptr next( (*n)[0] );
+	    this->erase_range( n, next );
+	    return this->make_iterator( next );
+	}
+	iterator erase( const_iterator first, const_iterator last ) {
+	    this->erase_range( first.priv_node(), last.priv_node() );
+	    return this->make_iterator( last.priv_node() );
 	}
     };
     
-    template< typename K, typename V, typename L=std::less<K>, typename A=std::allocator< std::pair<K const,V> > > class multimap : private Skiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L,A> {
+    template< typename K, typename V, typename L=std::less<K>, typename A=std::allocator< std::pair<K const,V> >, typename P=default_policy > class multimap : private Skiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L,A,P> {
     public:
-	typedef Skiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L,A> parent_type;
+	typedef Skiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L,A,P> parent_type;
 	typedef typename parent_type::iterator iterator;
 	typedef typename parent_type::const_iterator const_iterator;
+	typedef typename parent_type::reverse_iterator reverse_iterator;
+	typedef typename parent_type::const_reverse_iterator const_reverse_iterator;
 	typedef typename parent_type::value_type value_type;
 	typedef typename parent_type::key_type key_type;
 	typedef V mapped_type;
-	explicit multimap( const L& comp=L(), const A& alloc=A() ) : parent_type( comp, alloc ) {}
-	template< typename I > multimap( I first, I last, const L& comp=L(), const A& alloc=A() )
-	    : parent_type( first, last, comp, alloc ) {
-		for( I i( first ); i!=last; ++i ) {
-		    insert_node( (*i).first, (*i).second, false );
-		}
-	    }
+	explicit multimap( const L& comp=L(), const A& alloc=A(), unsigned int branching=parent_type::default_branching ) : parent_type( comp, alloc, branching ) {}
+	template< typename I > multimap( I first, I last, const L& comp=L(), const A& alloc=A(), unsigned int branching=parent_type::default_branching )
+	    : parent_type( first, last, false, comp, alloc, branching ) {}
 
 	// Both const and non-const forms:
 	using parent_type::begin;
 	using parent_type::end;
+	using parent_type::rbegin;
+	using parent_type::rend;
+	using parent_type::last;
+	using parent_type::reverse_lower_bound;
+	using parent_type::front;
+	using parent_type::back;
 	// And these:
 	using parent_type::lower_bound;
 	using parent_type::upper_bound;
+	using parent_type::equal_range;
+	using parent_type::pop_front;
+	using parent_type::pop_back;
 	using parent_type::size;
+	using parent_type::empty;
+	using parent_type::seed;
+	using parent_type::finger_search;
+	using parent_type::find_many;
+	using parent_type::lower_bound_many;
+	using parent_type::find_interleaved;
+	using parent_type::lower_bound_interleaved;
+	using parent_type::parallel_for_each;
+	using parent_type::parallel_reduce;
+	using parent_type::erase_if;
+	using parent_type::stats;
+	using parent_type::reset_stats;
+#ifdef SK_HEIGHT_DATA
+	using parent_type::height_data;
+#endif
+#ifdef SK_DEBUG_CHECK
+	using parent_type::check;
+#endif
+	// Indexed policies only:
+	using parent_type::nth;
+	using parent_type::rank;
+	using parent_type::index_of;
+	using parent_type::distance;
 	
     protected:
 	typedef typename parent_type::node_ptr node_ptr;
+	multimap( parent_type & from, const K & k ) : parent_type( from, k ) {}
 	
     public:
+	// Takes everything from k upwards out into a new multimap, in O(log n).
+	multimap split( const K & k ) {
+	    return multimap( *this, k );
+	}
+	// Moves all of other onto the end; its keys must all come after these.
+	void join( multimap & other ) {
+	    parent_type::join( other, false );
+	}
+	// Builds from sorted [first,last) on several threads; the multimap must be empty.
+	template< typename I > void parallel_build( I first, I last, unsigned int threads=0 ) {
+	    parent_type::parallel_build( first, last, false, threads );
+	}
 	
 	iterator find( const K & k ) {
-	    return iterator( search_node( k ) );
+	    return this->make_iterator( this->search_node( k ) );
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > iterator find( KK const & k ) {
+	    return this->make_iterator( this->search_node( k ) );
+	}
+	std::size_t count( const K & k ) const {
+	    return this->count_node( k );
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > std::size_t count( KK const & k ) const {
+	    return this->count_node( k );
 	}
 	
 	std::pair<bool,iterator> insert( value_type const & v ) {
-	    return insert_node( v );
+	    return this->make_iterator( this->insert_node( v ) );
+	}
+	std::pair<bool,iterator> insert( value_type && v ) {
+	    return this->make_iterator( this->insert_node( std::move( v ) ) );
+	}
+	// Hinted inserts go straight in before the hint, if the key belongs there.
+	iterator insert( const_iterator hint, value_type const & v ) {
+	    return this->make_iterator( this->emplace_hint_node( hint.priv_node(), true, v ).second );
+	}
+	iterator insert( const_iterator hint, value_type && v ) {
+	    return this->make_iterator( this->emplace_hint_node( hint.priv_node(), true, std::move( v ) ).second );
+	}
+	template< typename... Args > iterator emplace( Args&&... args ) {
+	    return this->make_iterator( this->emplace_node( true, this->finger_search(), std::forward<Args>( args )... ).second );
+	}
+	template< typename... Args > iterator emplace_hint( const_iterator hint, Args&&... args ) {
+	    return this->make_iterator( this->emplace_hint_node( hint.priv_node(), true, std::forward<Args>( args )... ).second );
 	}
 	
-	void erase( key_type const & k ) {
-	    parent_type::erase_node( k );
+	std::size_t erase( key_type const & k ) {
+	    return this->erase_node( k, true );
+	}
+	// Iterators still go to the overloads below.
+	template< typename KK, typename C=L, typename=typename C::is_transparent, typename=typename std::enable_if< !std::is_convertible<KK,const_iterator>::value >::type > std::size_t erase( KK const & k ) {
+	    return this->erase_node( k, true );
 	}
-	void erase( iterator const & i ) {
-	    parent_type::erase_node( (*i).first, i.node_ptr );
+	iterator erase( const_iterator i ) {
+	    node_ptr n( i.priv_node() );
+	    node_ptr next( (*n)[0] );
+	    this->erase_range( n, next );
+	    return this->make_iterator( next );
+	}
+	iterator erase( const_iterator first, const_iterator last ) {
+	    this->erase_range( first.priv_node(), last.priv_node() );
+	    return this->make_iterator( last.priv_node() );
 	}
     };
-    
+
+    /*
+      Keys alone, with no mapped value: each node holds just the key and
+      its tower. Keys can't be changed in place, so every iterator is a
+      const_iterator.
+    */
+    template< typename K, typename L=std::less<K>, typename A=std::allocator<K>, typename P=default_policy > class set : private Skiplist<K,K,ExtractSelf<K>,L,A,P> {
+    public:
+	typedef Skiplist<K,K,ExtractSelf<K>,L,A,P> parent_type;
+	typedef typename parent_type::const_iterator iterator;
+	typedef typename parent_type::const_iterator const_iterator;
+	typedef typename parent_type::const_reverse_iterator reverse_iterator;
+	typedef typename parent_type::const_reverse_iterator const_reverse_iterator;
+	typedef typename parent_type::value_type value_type;
+	typedef typename parent_type::key_type key_type;
+	explicit set( const L& comp=L(), const A& alloc=A(), unsigned int branching=parent_type::default_branching ) : parent_type( comp, alloc, branching ) {}
+	template< typename I > set( I first, I last, const L& comp=L(), const A& alloc=A(), unsigned int branching=parent_type::default_branching )
+	    : parent_type( first, last, true, comp, alloc, branching ) {}
+
+	using parent_type::size;
+	using parent_type::empty;
+	using parent_type::pop_front;
+	using parent_type::pop_back;
+	using parent_type::seed;
+	using parent_type::finger_search;
+	using parent_type::find_many;
+	using parent_type::lower_bound_many;
+	using parent_type::find_interleaved;
+	using parent_type::lower_bound_interleaved;
+	using parent_type::parallel_for_each;
+	using parent_type::parallel_reduce;
+	using parent_type::erase_if;
+	using parent_type::stats;
+	using parent_type::reset_stats;
 #ifdef SK_HEIGHT_DATA
-    template< typename K, typename V, typename L, typename A>
-    void Skiplist<K,V,L,A>::height_data() {
-	try {
-	    typedef map< unsigned int, std::pair<int,int> > t_heightmap;
-	    t_heightmap heightmap;
-	    for( node_ptr c( m_head ); c; c = (*c)[0] ) {
-		unsigned int h = c->height();
-#ifdef SK_VERBOSE_DEBUG
-		std::cout << ">> Reported height: " << h << std::endl;
+	using parent_type::height_data;
 #endif
-		while( h && (*c)[h]==0 ) --h;
-#ifdef SK_VERBOSE_DEBUG
-		std::cout << ">> Resolved height: " << h << std::endl;
-#endif
-		try {
-		    ++heightmap[h].second;
-		    ++heightmap[h].first;
-		    for( ; h>0; --h ) {
-#ifdef SK_VERBOSE_DEBUG
-			std::cout << ">> Hitting height: " << h << std::endl;
+#ifdef SK_DEBUG_CHECK
+	using parent_type::check;
 #endif
-			++heightmap[h-1].first;
-		    }
-		} catch( std::exception & e ) {
-		    std::cout << "Caught " << e.what() << " while trying to do stuff with " << h << std::endl;
-		    throw;
-		}
-	    }
-	    std::cout << "Height map for " << m_size << " entries.\n";
-	    for( t_heightmap::iterator i( heightmap.begin() ); i!=heightmap.end(); ++i ) {
-		std::cout << (*i).first << " has " << (*i).second.first << "/" << (*i).second.second << std::endl;
-	    }
-	    std::cout << "Done.\n";
-	} catch( std::exception & e ) {
-	    std::cout << "Exception during heightmapping!" << std::endl;
-	    throw;
+	// Indexed policies only:
+	using parent_type::rank;
+	using parent_type::index_of;
+	using parent_type::distance;
+
+	const_iterator begin() const {
+	    return parent_type::begin();
 	}
-    }
-#endif
+	const_iterator end() const {
+	    return parent_type::end();
+	}
+	const_reverse_iterator rbegin() const {
+	    return parent_type::rbegin();
+	}
+	const_reverse_iterator rend() const {
+	    return parent_type::rend();
+	}
+	const_iterator last() const {
+	    return parent_type::last();
+	}
+	value_type const & front() const {
+	    return parent_type::front();
+	}
+	value_type const & back() const {
+	    return parent_type::back();
+	}
+	const_reverse_iterator reverse_lower_bound( const K & k ) const {
+	    return parent_type::reverse_lower_bound( k );
+	}
+	const_iterator lower_bound( const K & k ) {
+	    return parent_type::lower_bound( k );
+	}
+	const_iterator upper_bound( const K & k ) {
+	    return parent_type::upper_bound( k );
+	}
+	std::pair<const_iterator,const_iterator> equal_range( const K & k ) {
+	    return parent_type::equal_range( k );
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > const_iterator lower_bound( KK const & k ) {
+	    return parent_type::lower_bound( k );
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > const_iterator upper_bound( KK const & k ) {
+	    return parent_type::upper_bound( k );
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > std::pair<const_iterator,const_iterator> equal_range( KK const & k ) {
+	    return parent_type::equal_range( k );
+	}
+	const_iterator nth( std::size_t n ) {
+	    return parent_type::nth( n );
+	}
+	
+    protected:
+	typedef typename parent_type::node_ptr node_ptr;
+	set( parent_type & from, const K & k ) : parent_type( from, k ) {}
+	
+    public:
+	// Takes everything from k upwards out into a new set, in O(log n).
+	set split( const K & k ) {
+	    return set( *this, k );
+	}
+	// Moves all of other onto the end; its keys must all come after these.
+	void join( set & other ) {
+	    parent_type::join( other, true );
+	}
+	// Builds from sorted [first,last) on several threads; the set must be empty.
+	template< typename I > void parallel_build( I first, I last, unsigned int threads=0 ) {
+	    parent_type::parallel_build( first, last, true, threads );
+	}
+	
+	const_iterator find( const K & k ) {
+	    return this->make_iterator( this->search_node( k ) );
+	}
+	bool contains( const K & k ) const {
+	    return this->search_node( k ) != node_ptr();
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > const_iterator find( KK const & k ) {
+	    return this->make_iterator( this->search_node( k ) );
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > bool contains( KK const & k ) const {
+	    return this->search_node( k ) != node_ptr();
+	}
+	std::size_t count( const K & k ) const {
+	    return this->search_node( k ) != node_ptr();
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > std::size_t count( KK const & k ) const {
+	    return this->search_node( k ) != node_ptr();
+	}
+	
+	std::pair<bool,iterator> insert( value_type const & v ) {
+	    return this->make_iterator( this->insert_node( v, false ) );
+	}
+	std::pair<bool,iterator> insert( value_type && v ) {
+	    return this->make_iterator( this->insert_node( std::move( v ), false ) );
+	}
+	// Hinted inserts go straight in before the hint, if the key belongs there.
+	iterator insert( const_iterator hint, value_type const & v ) {
+	    return this->make_iterator( this->emplace_hint_node( hint.priv_node(), false, v ).second );
+	}
+	iterator insert( const_iterator hint, value_type && v ) {
+	    return this->make_iterator( this->emplace_hint_node( hint.priv_node(), false, std::move( v ) ).second );
+	}
+	template< typename... Args > std::pair<bool,iterator> emplace( Args&&... args ) {
+	    return this->make_iterator( this->emplace_node( false, this->finger_search(), std::forward<Args>( args )... ) );
+	}
+	template< typename... Args > iterator emplace_hint( const_iterator hint, Args&&... args ) {
+	    return this->make_iterator( this->emplace_hint_node( hint.priv_node(), false, std::forward<Args>( args )... ).second );
+	}
+	
+	std::size_t erase( key_type const & k ) {
+	    return this->erase_node( k );
+	}
+	// Iterators still go to the overloads below.
+	template< typename KK, typename C=L, typename=typename C::is_transparent, typename=typename std::enable_if< !std::is_convertible<KK,const_iterator>::value >::type > std::size_t erase( KK const & k ) {
+	    return this->erase_node( k );
+	}
+	iterator erase( const_iterator i ) {
+	    node_ptr n( i.priv_node() );
+	    node_ptr next( (*n)[0] );
+	    this->erase_range( n, next );
+	    return this->make_iterator( next );
+	}
+	iterator erase( const_iterator first, const_iterator last ) {
+	    this->erase_range( first.priv_node(), last.priv_node() );
+	    return this->make_iterator( last.priv_node() );
+	}
+    };
+
+    // As set, keeping every copy of equal keys.
+    template< typename K, typename L=std::less<K>, typename A=std::allocator<K>, typename P=default_policy > class multiset : private Skiplist<K,K,ExtractSelf<K>,L,A,P> {
+    public:
+	typedef Skiplist<K,K,ExtractSelf<K>,L,A,P> parent_type;
+	typedef typename parent_type::const_iterator iterator;
+	typedef typename parent_type::const_iterator const_iterator;
+	typedef typename parent_type::const_reverse_iterator reverse_iterator;
+	typedef typename parent_type::const_reverse_iterator const_reverse_iterator;
+	typedef typename parent_type::value_type value_type;
+	typedef typename parent_type::key_type key_type;
+	explicit multiset( const L& comp=L(), const A& alloc=A(), unsigned int branching=parent_type::default_branching ) : parent_type( comp, alloc, branching ) {}
+	template< typename I > multiset( I first, I last, const L& comp=L(), const A& alloc=A(), unsigned int branching=parent_type::default_branching )
+	    : parent_type( first, last, false, comp, alloc, branching ) {}
 
+	using parent_type::size;
+	using parent_type::empty;
+	using parent_type::pop_front;
+	using parent_type::pop_back;
+	using parent_type::seed;
+	using parent_type::finger_search;
+	using parent_type::find_many;
+	using parent_type::lower_bound_many;
+	using parent_type::find_interleaved;
+	using parent_type::lower_bound_interleaved;
+	using parent_type::parallel_for_each;
+	using parent_type::parallel_reduce;
+	using parent_type::erase_if;
+	using parent_type::stats;
+	using parent_type::reset_stats;
+#ifdef SK_HEIGHT_DATA
+	using parent_type::height_data;
+#endif
+#ifdef SK_DEBUG_CHECK
+	using parent_type::check;
+#endif
+	// Indexed policies only:
+	using parent_type::rank;
+	using parent_type::index_of;
+	using parent_type::distance;
 
+	const_iterator begin() const {
+	    return parent_type::begin();
+	}
+	const_iterator end() const {
+	    return parent_type::end();
+	}
+	const_reverse_iterator rbegin() const {
+	    return parent_type::rbegin();
+	}
+	const_reverse_iterator rend() const {
+	    return parent_type::rend();
+	}
+	const_iterator last() const {
+	    return parent_type::last();
+	}
+	value_type const & front() const {
+	    return parent_type::front();
+	}
+	value_type const & back() const {
+	    return parent_type::back();
+	}
+	const_reverse_iterator reverse_lower_bound( const K & k ) const {
+	    return parent_type::reverse_lower_bound( k );
+	}
+	const_iterator lower_bound( const K & k ) {
+	    return parent_type::lower_bound( k );
+	}
+	const_iterator upper_bound( const K & k ) {
+	    return parent_type::upper_bound( k );
+	}
+	std::pair<const_iterator,const_iterator> equal_range( const K & k ) {
+	    return parent_type::equal_range( k );
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > const_iterator lower_bound( KK const & k ) {
+	    return parent_type::lower_bound( k );
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > const_iterator upper_bound( KK const & k ) {
+	    return parent_type::upper_bound( k );
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > std::pair<const_iterator,const_iterator> equal_range( KK const & k ) {
+	    return parent_type::equal_range( k );
+	}
+	const_iterator nth( std::size_t n ) {
+	    return parent_type::nth( n );
+	}
+	
+    protected:
+	typedef typename parent_type::node_ptr node_ptr;
+	multiset( parent_type & from, const K & k ) : parent_type( from, k ) {}
+	
+    public:
+	// Takes everything from k upwards out into a new multiset, in O(log n).
+	multiset split( const K & k ) {
+	    return multiset( *this, k );
+	}
+	// Moves all of other onto the end; its keys must all come after these.
+	void join( multiset & other ) {
+	    parent_type::join( other, false );
+	}
+	// Builds from sorted [first,last) on several threads; the multiset must be empty.
+	template< typename I > void parallel_build( I first, I last, unsigned int threads=0 ) {
+	    parent_type::parallel_build( first, last, false, threads );
+	}
+	
+	const_iterator find( const K & k ) {
+	    return this->make_iterator( this->search_node( k ) );
+	}
+	bool contains( const K & k ) const {
+	    return this->search_node( k ) != node_ptr();
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > const_iterator find( KK const & k ) {
+	    return this->make_iterator( this->search_node( k ) );
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > bool contains( KK const & k ) const {
+	    return this->search_node( k ) != node_ptr();
+	}
+	std::size_t count( const K & k ) const {
+	    return this->count_node( k );
+	}
+	template< typename KK, typename C=L, typename=typename C::is_transparent > std::size_t count( KK const & k ) const {
+	    return this->count_node( k );
+	}
+	
+	std::pair<bool,iterator> insert( value_type const & v ) {
+	    return this->make_iterator( this->insert_node( v, true ) );
+	}
+	std::pair<bool,iterator> insert( value_type && v ) {
+	    return this->make_iterator( this->insert_node( std::move( v ), true ) );
+	}
+	// Hinted inserts go straight in before the hint, if the key belongs there.
+	iterator insert( const_iterator hint, value_type const & v ) {
+	    return this->make_iterator( this->emplace_hint_node( hint.priv_node(), true, v ).second );
+	}
+	iterator insert( const_iterator hint, value_type && v ) {
+	    return this->make_iterator( this->emplace_hint_node( hint.priv_node(), true, std::move( v ) ).second );
+	}
+	template< typename... Args > iterator emplace( Args&&... args ) {
+	    return this->make_iterator( this->emplace_node( true, this->finger_search(), std::forward<Args>( args )... ).second );
+	}
+	template< typename... Args > iterator emplace_hint( const_iterator hint, Args&&... args ) {
+	    return this->make_iterator( this->emplace_hint_node( hint.priv_node(), true, std::forward<Args>( args )... ).second );
+	}
+	
+	std::size_t erase( key_type const & k ) {
+	    return this->erase_node( k, true );
+	}
+	// Iterators still go to the overloads below.
+	template< typename KK, typename C=L, typename=typename C::is_transparent, typename=typename std::enable_if< !std::is_convertible<KK,const_iterator>::value >::type > std::size_t erase( KK const & k ) {
+	    return this->erase_node( k, true );
+	}
+	iterator erase( const_iterator i ) {
+	    node_ptr n( i.priv_node() );
+	    node_ptr next( (*n)[0] );
+	    this->erase_range( n, next );
+	    return this->make_iterator( next );
+	}
+	iterator erase( const_iterator first, const_iterator last ) {
+	    this->erase_range( first.priv_node(), last.priv_node() );
+	    return this->make_iterator( last.priv_node() );
+	}
+    };
 }
+
+#endif
@@ -0,0 +1,435 @@
+// -*- C++ -*-
+
+// Copyright 2004-2006 Dave Cridland <dave@cridland.net>
+
+#ifndef SKIPLIST_COMPACT_H
+#define SKIPLIST_COMPACT_H
+
+#include "skiplist.h"
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace skip {
+    /*
+      Iterator over a compact skiplist: the list, to turn indices into
+      nodes, and the node's index; 0 is end().
+    */
+    template<typename S, typename IV> class compact_iterator {
+    private:
+	S const * m_list;
+	typename S::node_ptr m_node;
+    public:
+	typedef IV value_type;
+	typedef IV & reference;
+	typedef IV * pointer;
+	typedef std::ptrdiff_t difference_type;
+	typedef std::bidirectional_iterator_tag iterator_category;
+
+	compact_iterator( S const * l, typename S::node_ptr n ) : m_list( l ), m_node( n ) {
+	}
+	template<typename IVX> compact_iterator( compact_iterator<S,IVX> const & m ) : m_list( m.priv_list() ), m_node( m.priv_node() ) {
+	}
+	compact_iterator & operator++() {
+	    m_node = m_list->next( m_node );
+	    return *this;
+	}
+	compact_iterator & operator--() {
+	    m_node = m_node ? m_list->prev( m_node ) : m_list->tail();
+	    return *this;
+	}
+	IV & operator*() const {
+	    return m_list->value( m_node );
+	}
+	IV * operator->() const {
+	    return &m_list->value( m_node );
+	}
+	bool operator==( compact_iterator const & i ) const {
+	    return m_node==i.m_node;
+	}
+	bool operator!=( compact_iterator const & i ) const {
+	    return m_node!=i.m_node;
+	}
+
+	S const * priv_list() const {
+	    return m_list;
+	}
+	typename S::node_ptr priv_node() const {
+	    return m_node;
+	}
+    };
+
+    /*
+      Skiplist whose links are 32-bit indices rather than pointers.
+      Nodes are carved from chunks of an arena in 8-byte units, and an
+      index is a unit number within it; unit 0 is never used, so it
+      serves as null. A node is the value, then its height, its back
+      link and its tower, all 32 bits, so a tower costs half what it
+      does in a Skiplist. Reaching a node costs a lookup in the chunk
+      table, which is small enough to stay in cache. Freed nodes go on
+      a free list per height, as in NodePool. Keys are unique.
+    */
+    template< typename K, typename V, typename X, typename L, typename A > class CompactSkiplist {
+    public:
+	typedef K key_type;
+	typedef V value_type;
+	typedef X extract_key;
+	typedef L key_compare;
+	typedef A allocator_type;
+	typedef CompactSkiplist<K,V,X,L,A> my_type;
+	typedef std::uint32_t node_ptr;
+	typedef typename allocator_type::template rebind< std::uint64_t >::other unit_allocator;
+	typedef typename allocator_type::size_type size_type;
+	typedef compact_iterator<my_type,value_type> iterator;
+	typedef compact_iterator<my_type,value_type const> const_iterator;
+	static const unsigned int maxheight = 32;
+    private:
+	static_assert( alignof(value_type) <= alignof(std::uint64_t), "compact skiplist entries must be at most 8-byte aligned" );
+
+	static const unsigned int chunk_bits = 16;
+	static const std::size_t chunk_units = std::size_t( 1 ) << chunk_bits;
+	static const std::size_t max_chunks = std::size_t( 1 ) << ( 32 - chunk_bits );
+	static const std::size_t links_offset = ( sizeof(value_type) + 7 ) & ~std::size_t( 7 );
+
+	unit_allocator m_alloc;
+	std::vector<std::uint64_t *> m_chunks;
+	std::size_t m_top;	// Next unused unit.
+	node_ptr m_free[maxheight + 1];	// Free nodes by height, chained through link 0.
+	node_ptr m_head;
+	node_ptr m_tail;
+	key_compare m_comp;
+	std::size_t m_size;
+	unsigned int m_level;
+	std::uint64_t m_rng;
+
+	// Unimplemented:
+	CompactSkiplist( my_type const & );
+	my_type & operator=( my_type const & );
+
+    public:
+	CompactSkiplist( L const & l, A const & a ) : m_alloc( a ), m_top( 1 ), m_head( 0 ), m_tail( 0 ), m_comp( l ), m_size( 0 ), m_level( 1 ), m_rng( 0x9E3779B97F4A7C15ull ) {
+	    for( unsigned int i(0); i<=maxheight; ++i ) {
+		m_free[i] = 0;
+	    }
+	    try {
+		m_head = new_node( maxheight );
+	    } catch( ... ) {
+		release();
+		throw;
+	    }
+	}
+	virtual ~CompactSkiplist() {
+	    destroy_values();
+	    release();
+	}
+
+	value_type & value( node_ptr n ) const {
+	    return *reinterpret_cast<value_type *>( unit( n ) );
+	}
+	node_ptr next( node_ptr n ) const {
+	    return link( n, 0 );
+	}
+	node_ptr prev( node_ptr n ) const {
+	    node_ptr p( links( n )[1] );
+	    return p == m_head ? node_ptr() : p;
+	}
+	node_ptr tail() const {
+	    return m_tail;
+	}
+
+    private:
+	std::uint64_t * unit( node_ptr n ) const {
+	    return m_chunks[n >> chunk_bits] + ( n & ( chunk_units - 1 ) );
+	}
+	// Height, back link, then the tower.
+	std::uint32_t * links( node_ptr n ) const {
+	    return reinterpret_cast<std::uint32_t *>( reinterpret_cast<unsigned char *>( unit( n ) ) + links_offset );
+	}
+	node_ptr & link( node_ptr n, unsigned int i ) const {
+	    return links( n )[2 + i];
+	}
+	unsigned int height( node_ptr n ) const {
+	    return links( n )[0];
+	}
+	K const & key( node_ptr n ) const {
+	    return extract_key()( value( n ) );
+	}
+
+	static std::size_t node_units( unsigned int h ) {
+	    return ( links_offset + ( 2 + h ) * sizeof(std::uint32_t) + 7 ) / 8;
+	}
+
+	unsigned int pickheight() {
+	    m_rng ^= m_rng >> 12;
+	    m_rng ^= m_rng << 25;
+	    m_rng ^= m_rng >> 27;
+	    unsigned int h( 1 + __builtin_clzll( ( m_rng * 0x2545F4914F6CDD1Dull ) | 1 ) / 2 );
+	    return h > maxheight ? maxheight : h;
+	}
+
+	// A node of height h with empty links, and no value yet.
+	node_ptr new_node( unsigned int h ) {
+	    node_ptr n( m_free[h] );
+	    if( n ) {
+		m_free[h] = link( n, 0 );
+	    } else {
+		std::size_t units( node_units( h ) );
+		if( ( m_top & ( chunk_units - 1 ) ) + units > chunk_units ) {
+		    // Nodes don't straddle chunks; the tail of this one is lost.
+		    m_top = ( m_top | ( chunk_units - 1 ) ) + 1;
+		}
+		if( ( m_top >> chunk_bits ) == m_chunks.size() ) {
+		    if( m_chunks.size() == max_chunks ) {
+			throw std::length_error( "Compact skiplist arena is full" );
+		    }
+		    m_chunks.reserve( m_chunks.size() * 2 + 1 );
+		    m_chunks.push_back( &*m_alloc.allocate( chunk_units ) );
+		}
+		n = node_ptr( m_top );
+		m_top += units;
+	    }
+	    std::uint32_t * l( links( n ) );
+	    l[0] = h;
+	    for( unsigned int i(1); i<2+h; ++i ) {
+		l[i] = 0;
+	    }
+	    return n;
+	}
+	void free_node( node_ptr n ) {
+	    unsigned int h( height( n ) );
+	    link( n, 0 ) = m_free[h];
+	    m_free[h] = n;
+	}
+
+	void destroy_values() {
+	    for( node_ptr n( link( m_head, 0 ) ); n; n = link( n, 0 ) ) {
+		value( n ).~value_type();
+	    }
+	}
+	void release() {
+	    for( std::size_t i(0); i<m_chunks.size(); ++i ) {
+		m_alloc.deallocate( m_chunks[i], chunk_units );
+	    }
+	    m_chunks.clear();
+	}
+
+	// The first node not less than k, with its predecessors in update[].
+	node_ptr find_node( K const & k, node_ptr update[] = 0 ) const {
+	    node_ptr current( m_head );
+	    node_ptr next( 0 );
+	    for( unsigned int i(m_level-1);; --i ) {
+		next = link( current, i );
+		while( next && m_comp( key( next ), k ) ) {
+		    current = next;
+		    next = link( current, i );
+		}
+		if( update ) {
+		    update[i] = current;
+		}
+		if( 0==i ) break;
+	    }
+	    return next;
+	}
+
+    protected:
+	/*
+	  Searches for k once, and on a miss builds the value from args in
+	  a new node at the slot it found. k needs to outlive the search
+	  only, so it may refer into args.
+	*/
+	template< typename... Args > std::pair<bool,node_ptr> emplace_key( K const & k, Args&&... args ) {
+	    node_ptr update[maxheight];
+	    node_ptr found( find_node( k, update ) );
+	    if( found && !m_comp( k, key( found ) ) ) {
+		return std::make_pair( false, found );
+	    }
+	    unsigned int h( pickheight() );
+	    node_ptr n( new_node( h ) );
+	    try {
+		new( unit( n ) ) value_type( std::forward<Args>( args )... );
+	    } catch( ... ) {
+		free_node( n );
+		throw;
+	    }
+	    for( unsigned int i(m_level); i<h; ++i ) {
+		update[i] = m_head;
+	    }
+	    if( h > m_level ) {
+		m_level = h;
+	    }
+	    for( unsigned int i(0); i<h; ++i ) {
+		link( n, i ) = link( update[i], i );
+		link( update[i], i ) = n;
+	    }
+	    links( n )[1] = update[0];
+	    if( node_ptr after = link( n, 0 ) ) {
+		links( after )[1] = n;
+	    } else {
+		m_tail = n;
+	    }
+	    ++m_size;
+	    return std::make_pair( true, n );
+	}
+
+	size_type erase_node( K const & k ) {
+	    node_ptr update[maxheight];
+	    node_ptr n( find_node( k, update ) );
+	    if( !n || m_comp( k, key( n ) ) ) {
+		return 0;
+	    }
+	    for( unsigned int i(0); i<height( n ); ++i ) {
+		link( update[i], i ) = link( n, i );
+	    }
+	    if( node_ptr after = link( n, 0 ) ) {
+		links( after )[1] = update[0];
+	    } else {
+		m_tail = update[0] == m_head ? node_ptr() : update[0];
+	    }
+	    while( m_level > 1 && !link( m_head, m_level-1 ) ) {
+		--m_level;
+	    }
+	    value( n ).~value_type();
+	    free_node( n );
+	    --m_size;
+	    return 1;
+	}
+
+	node_ptr lower_bound_node( K const & k ) const {
+	    return find_node( k );
+	}
+	node_ptr upper_bound_node( K const & k ) const {
+	    node_ptr n( find_node( k ) );
+	    if( n && !m_comp( k, key( n ) ) ) n = link( n, 0 );
+	    return n;
+	}
+	node_ptr search_node( K const & k ) const {
+	    node_ptr n( find_node( k ) );
+	    if( n && m_comp( k, key( n ) ) ) return 0;
+	    return n;
+	}
+	node_ptr first() const {
+	    return link( m_head, 0 );
+	}
+
+	// Empties the list, keeping the arena for reuse.
+	void clear_nodes() {
+	    destroy_values();
+	    m_top = 1;
+	    for( unsigned int i(0); i<=maxheight; ++i ) {
+		m_free[i] = 0;
+	    }
+	    m_head = new_node( maxheight );
+	    m_tail = 0;
+	    m_size = 0;
+	    m_level = 1;
+	}
+
+    public:
+	size_type size() const {
+	    return m_size;
+	}
+	// Bytes held by the arena, for comparison with other maps.
+	std::size_t arena_bytes() const {
+	    return m_chunks.size() * chunk_units * sizeof(std::uint64_t);
+	}
+    };
+
+    /*
+      Map over a compact skiplist. Same interface as skip::map, for
+      maps of up to about 32GiB of nodes; iterators hold the map as
+      well as the index, so they're as big as a Skiplist's.
+    */
+    template< typename K, typename V, typename L=std::less<K>, typename A=std::allocator< std::pair<K const,V> > > class compact_map : private CompactSkiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L,A> {
+    public:
+	typedef CompactSkiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L,A> parent_type;
+	typedef typename parent_type::iterator iterator;
+	typedef typename parent_type::const_iterator const_iterator;
+	typedef std::reverse_iterator<iterator> reverse_iterator;
+	typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+	typedef typename parent_type::value_type value_type;
+	typedef typename parent_type::key_type key_type;
+	typedef typename parent_type::node_ptr node_ptr;
+	typedef V mapped_type;
+	explicit compact_map( const L& comp=L(), const A& alloc=A() ) : parent_type( comp, alloc ) {}
+	template< typename I > compact_map( I first, I last, const L& comp=L(), const A& alloc=A() )
+	    : parent_type( comp, alloc ) {
+		for( ; first!=last; ++first ) {
+		    this->emplace_key( (*first).first, *first );
+		}
+	    }
+
+	using parent_type::size;
+	using parent_type::arena_bytes;
+
+	bool empty() const {
+	    return size() == 0;
+	}
+	void clear() {
+	    this->clear_nodes();
+	}
+
+	iterator begin() {
+	    return iterator( this, this->first() );
+	}
+	const_iterator begin() const {
+	    return const_iterator( this, this->first() );
+	}
+	iterator end() {
+	    return iterator( this, 0 );
+	}
+	const_iterator end() const {
+	    return const_iterator( this, 0 );
+	}
+	reverse_iterator rbegin() {
+	    return reverse_iterator( end() );
+	}
+	reverse_iterator rend() {
+	    return reverse_iterator( begin() );
+	}
+
+	V & operator[]( const K & k ) {
+	    return this->value( this->emplace_key( k, std::piecewise_construct, std::forward_as_tuple( k ), std::tuple<>() ).second ).second;
+	}
+
+	iterator find( const K & k ) {
+	    return iterator( this, this->search_node( k ) );
+	}
+	iterator lower_bound( const K & k ) {
+	    return iterator( this, this->lower_bound_node( k ) );
+	}
+	iterator upper_bound( const K & k ) {
+	    return iterator( this, this->upper_bound_node( k ) );
+	}
+	std::size_t count( const K & k ) const {
+	    return this->search_node( k ) ? 1 : 0;
+	}
+
+	std::pair<bool,iterator> insert( value_type const & v ) {
+	    std::pair<bool,node_ptr> r( this->emplace_key( v.first, v ) );
+	    return std::make_pair( r.first, iterator( this, r.second ) );
+	}
+	iterator insert( const_iterator, value_type const & v ) {
+	    return iterator( this, this->emplace_key( v.first, v ).second );
+	}
+	template< typename... Args > std::pair<bool,iterator> try_emplace( const K & k, Args&&... args ) {
+	    std::pair<bool,node_ptr> r( this->emplace_key( k, std::piecewise_construct, std::forward_as_tuple( k ), std::forward_as_tuple( std::forward<Args>( args )... ) ) );
+	    return std::make_pair( r.first, iterator( this, r.second ) );
+	}
+
+	std::size_t erase( key_type const & k ) {
+	    return this->erase_node( k );
+	}
+	iterator erase( const_iterator i ) {
+	    node_ptr next( this->next( i.priv_node() ) );
+	    this->erase_node( (*i).first );
+	    return iterator( this, next );
+	}
+    };
+}
+
+#endif
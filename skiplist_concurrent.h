@@ -0,0 +1,597 @@
+// -*- C++ -*-
+
+// Copyright 2004-2006 Dave Cridland <dave@cridland.net>
+
+#ifndef SKIPLIST_CONCURRENT_H
+#define SKIPLIST_CONCURRENT_H
+
+#include "skiplist.h"
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+namespace skip {
+    /*
+      Epoch based reclamation.
+      Readers pin the current epoch for the duration of an operation;
+      memory retired in epoch e is only handed back once the global
+      epoch has reached e+2, by which time nobody can still see it.
+      N must provide retired_next() for chaining.
+    */
+    template< typename N >
+    class epoch_domain {
+    public:
+	typedef void (*reclaim_fn)( void *, N * );
+    private:
+	struct record {
+	    std::atomic<std::uint64_t> m_state; // ( epoch << 1 ) | active
+	    std::atomic<std::thread::id> m_owner;
+	    record * m_next;
+	    unsigned int m_nesting;
+	    std::uint64_t m_epoch;
+	    std::size_t m_retired;
+	    N * m_limbo[3];
+	    std::uint64_t m_limbo_epoch[3];
+
+	    record() : m_state( 0 ), m_owner( std::this_thread::get_id() ), m_next( 0 ), m_nesting( 0 ), m_epoch( 0 ), m_retired( 0 ) {
+		for( int i(0); i<3; ++i ) {
+		    m_limbo[i] = 0;
+		    m_limbo_epoch[i] = 0;
+		}
+	    }
+	};
+
+	std::atomic<std::uint64_t> m_epoch;
+	std::atomic<record *> m_records;
+	std::uint64_t m_id;
+	reclaim_fn m_reclaim;
+	void * m_ctx;
+
+	// Unimplemented:
+	epoch_domain( epoch_domain const & );
+	epoch_domain & operator=( epoch_domain const & );
+
+	static std::uint64_t next_id() {
+	    static std::atomic<std::uint64_t> s_id( 0 );
+	    return ++s_id;
+	}
+
+	record * my_record() {
+	    // One-entry cache; a thread normally works on one map at a time.
+	    static thread_local std::uint64_t t_id( 0 );
+	    static thread_local record * t_rec( 0 );
+	    if( t_id == m_id ) {
+		return t_rec;
+	    }
+	    std::thread::id self( std::this_thread::get_id() );
+	    record * r( 0 );
+	    for( record * i( m_records.load() ); i; i = i->m_next ) {
+		if( i->m_owner.load() == self ) {
+		    r = i;
+		    break;
+		}
+	    }
+	    if( !r ) {
+		for( record * i( m_records.load() ); i; i = i->m_next ) {
+		    std::thread::id none;
+		    if( i->m_owner.compare_exchange_strong( none, self ) ) {
+			r = i;
+			break;
+		    }
+		}
+	    }
+	    if( !r ) {
+		r = new record;
+		record * head( m_records.load() );
+		do {
+		    r->m_next = head;
+		} while( !m_records.compare_exchange_weak( head, r ) );
+	    }
+	    t_id = m_id;
+	    t_rec = r;
+	    return r;
+	}
+
+	// Slot i of r holds an epoch at least two behind the global one.
+	void flush( record * r, int i ) {
+	    N * n( r->m_limbo[i] );
+	    r->m_limbo[i] = 0;
+	    free_list( n );
+	}
+
+	void free_list( N * n ) {
+	    while( n ) {
+		N * next( n->retired_next() );
+		m_reclaim( m_ctx, n );
+		n = next;
+	    }
+	}
+
+	bool try_advance( std::uint64_t e ) {
+	    for( record * i( m_records.load() ); i; i = i->m_next ) {
+		std::uint64_t s( i->m_state.load() );
+		if( ( s & 1 ) && ( s >> 1 ) != e ) {
+		    return false;
+		}
+	    }
+	    return m_epoch.compare_exchange_strong( e, e + 1 );
+	}
+
+    public:
+	epoch_domain( reclaim_fn f, void * ctx ) : m_epoch( 2 ), m_records( 0 ), m_id( next_id() ), m_reclaim( f ), m_ctx( ctx ) {
+	}
+	// Only safe once every thread has finished with the domain.
+	~epoch_domain() {
+	    record * r( m_records.load() );
+	    while( r ) {
+		record * next( r->m_next );
+		for( int i(0); i<3; ++i ) {
+		    free_list( r->m_limbo[i] );
+		}
+		delete r;
+		r = next;
+	    }
+	}
+
+	void pin() {
+	    record * r( my_record() );
+	    if( r->m_nesting++ ) return;
+	    std::uint64_t e( m_epoch.load() );
+	    r->m_state.store( ( e << 1 ) | 1 );
+	    if( e != r->m_epoch ) {
+		r->m_epoch = e;
+		for( int i(0); i<3; ++i ) {
+		    if( r->m_limbo[i] && r->m_limbo_epoch[i] + 2 <= e ) {
+			flush( r, i );
+		    }
+		}
+	    }
+	}
+
+	void unpin() {
+	    record * r( my_record() );
+	    if( --r->m_nesting ) return;
+	    r->m_state.store( r->m_epoch << 1 );
+	}
+
+	// Must be called while pinned, after n has been unlinked.
+	void retire( N * n ) {
+	    record * r( my_record() );
+	    // Tag with the global epoch, not our own - a thread pinned at the
+	    // current global epoch may still have seen n.
+	    std::uint64_t e( m_epoch.load() );
+	    int i( e % 3 );
+	    if( r->m_limbo_epoch[i] != e ) {
+		if( r->m_limbo[i] ) flush( r, i );
+		r->m_limbo_epoch[i] = e;
+	    }
+	    n->retired_next() = r->m_limbo[i];
+	    r->m_limbo[i] = n;
+	    if( ( ++r->m_retired % 64 ) == 0 ) {
+		try_advance( e );
+	    }
+	}
+
+	class guard {
+	    epoch_domain & m_domain;
+	    guard( guard const & );
+	    guard & operator=( guard const & );
+	public:
+	    explicit guard( epoch_domain & d ) : m_domain( d ) {
+		m_domain.pin();
+	    }
+	    ~guard() {
+		m_domain.unpin();
+	    }
+	};
+    };
+
+    /*
+      Node of a concurrent skiplist.
+      Same layout as SkiplistNode - the value lives in front of the node,
+      the tower follows it - but the forward pointers are atomic, and
+      carry a deletion mark in their low bit.
+    */
+    template< typename V >
+    class ConcurrentSkiplistNode {
+    public:
+	typedef V value_type;
+	typedef ConcurrentSkiplistNode<V> my_type;
+	typedef std::atomic<std::uintptr_t> link_type;
+    private:
+	unsigned int m_height;
+	// One reference held by the inserter until it stops linking,
+	// one by the list until the node is logically deleted.
+	std::atomic<unsigned int> m_refs;
+	my_type * m_retired_next;
+	link_type m_ptrs[1];
+
+	// Unimplemented:
+	ConcurrentSkiplistNode( ConcurrentSkiplistNode const & );
+	ConcurrentSkiplistNode & operator = ( ConcurrentSkiplistNode const & );
+
+    public:
+	ConcurrentSkiplistNode( unsigned int h ) : m_height( h ), m_refs( 2 ), m_retired_next( 0 ) {
+	    for( unsigned int i(0); i<m_height; ++i ) {
+		new( &m_ptrs[i] ) link_type( 0 );
+	    }
+	}
+
+	inline link_type & operator[]( int i ) {
+	    return m_ptrs[i];
+	}
+
+	static inline bool marked( std::uintptr_t p ) {
+	    return p & 1;
+	}
+	static inline my_type * ptr( std::uintptr_t p ) {
+	    return reinterpret_cast<my_type *>( p & ~std::uintptr_t( 1 ) );
+	}
+	static inline std::uintptr_t bits( my_type * p, bool mark=false ) {
+	    return reinterpret_cast<std::uintptr_t>( p ) | ( mark ? 1 : 0 );
+	}
+
+	// Offset of the node from the start of the block; keeps the atomics aligned.
+	static const std::size_t value_offset = ( ( sizeof(value_type) + alignof(link_type) - 1 ) / alignof(link_type) ) * alignof(link_type);
+
+	inline value_type const & value() const {
+	    return *value_ptr();
+	}
+	inline const value_type * value_ptr() const {
+	    return reinterpret_cast<const value_type *>( reinterpret_cast<const unsigned char *>( this ) - value_offset );
+	}
+	inline value_type * value_ptr() {
+	    return reinterpret_cast<value_type *>( reinterpret_cast<unsigned char *>( this ) - value_offset );
+	}
+
+	inline unsigned int height() const {
+	    return m_height;
+	}
+	inline my_type *& retired_next() {
+	    return m_retired_next;
+	}
+	inline bool release() {
+	    return m_refs.fetch_sub( 1 ) == 1;
+	}
+
+	static inline std::size_t alloc_size( unsigned int h ) {
+	    return value_offset + sizeof(my_type) + ( h - 1 ) * sizeof(link_type);
+	}
+    };
+
+    /*
+      Lock-free skiplist, after Herlihy & Shavit / Fraser.
+      Insertion links level 0 first, which is the linearization point;
+      deletion marks the tower top-down and finishes by marking level 0.
+      Marked nodes are snipped out by whichever find() passes them, and
+      handed to the epoch domain once both the inserter and the deleter
+      are done with them.
+      Lookups never write and never retry.
+    */
+    template< typename K, typename V, typename X, typename L, typename A > class ConcurrentSkiplist {
+    public:
+	typedef K key_type;
+	typedef V value_type;
+	typedef X extract_key;
+	typedef L key_compare;
+	typedef A allocator_type;
+	typedef ConcurrentSkiplist<K,V,X,L,A> my_type;
+	typedef ConcurrentSkiplistNode<value_type> node_type;
+	typedef typename allocator_type::template rebind< unsigned char >::other raw_allocator;
+	typedef node_type * node_ptr;
+	typedef typename node_type::link_type link_type;
+	typedef epoch_domain<node_type> domain_type;
+	static const unsigned int maxheight = 32;
+    private:
+	node_ptr m_head;
+	key_compare m_comp;
+	std::atomic<std::size_t> m_size;
+	raw_allocator m_alloc;
+	mutable domain_type m_domain;
+
+	// Unimplemented:
+	ConcurrentSkiplist( my_type const & );
+	my_type & operator=( my_type const & );
+
+    public:
+	ConcurrentSkiplist() : m_head( 0 ), m_comp(), m_size( 0 ), m_domain( &reclaim, this ) {
+	    m_head = new_node( maxheight );
+	}
+	ConcurrentSkiplist( L const & l, A const & a ) : m_head( 0 ), m_comp( l ), m_size( 0 ), m_alloc( a ), m_domain( &reclaim, this ) {
+	    m_head = new_node( maxheight );
+	}
+	// Not thread-safe; all other users must have finished.
+	virtual ~ConcurrentSkiplist() {
+	    node_ptr current( node_type::ptr( (*m_head)[0].load() ) );
+	    while( current ) {
+		node_ptr next( node_type::ptr( (*current)[0].load() ) );
+		delete_node( current );
+		current = next;
+	    }
+	    destroy_node( m_head );
+	}
+
+    private:
+	static unsigned int pickheight() {
+	    // Per-thread xorshift; a shared generator would serialize inserts.
+	    static thread_local std::uint64_t t_state( 0 );
+	    if( !t_state ) {
+		t_state = reinterpret_cast<std::uintptr_t>( &t_state ) ^ 0x9E3779B97F4A7C15ull;
+	    }
+	    t_state ^= t_state << 13;
+	    t_state ^= t_state >> 7;
+	    t_state ^= t_state << 17;
+	    // Each pair of leading zero bits is a promotion at p=1/4.
+	    unsigned int h( 1 + __builtin_clzll( t_state | 1 ) / 2 );
+	    return h > maxheight ? maxheight : h;
+	}
+
+	node_ptr new_node( unsigned int height ) {
+	    unsigned char * p( m_alloc.allocate( node_type::alloc_size( height ) ) );
+	    p += node_type::value_offset;
+	    new( p ) node_type( height );
+	    return reinterpret_cast<node_ptr>( p );
+	}
+	node_ptr new_node( value_type const & v, unsigned int height ) {
+	    node_ptr p( new_node( height ) );
+	    try {
+		new( p->value_ptr() ) value_type( v );
+	    } catch( ... ) {
+		destroy_node( p );
+		throw;
+	    }
+	    return p;
+	}
+	void delete_node( node_ptr p ) {
+	    p->value_ptr()->~value_type();
+	    destroy_node( p );
+	}
+	void destroy_node( node_ptr p ) {
+	    unsigned char * pp( reinterpret_cast<unsigned char *>( p ) - node_type::value_offset );
+	    unsigned int h( p->height() );
+	    p->~node_type();
+	    m_alloc.deallocate( pp, node_type::alloc_size( h ) );
+	}
+	static void reclaim( void * ctx, node_type * p ) {
+	    static_cast<my_type *>( ctx )->delete_node( p );
+	}
+	void release( node_ptr p ) {
+	    if( p->release() ) {
+		m_domain.retire( p );
+	    }
+	}
+
+	bool less( node_ptr n, K const & k ) const {
+	    return m_comp( extract_key()( n->value() ), k );
+	}
+	bool equal( node_ptr n, K const & k ) const {
+	    return !m_comp( k, extract_key()( n->value() ) ) && !less( n, k );
+	}
+
+	/*
+	  Writer's search. Fills preds/succs at every level, snipping out
+	  any marked nodes it passes. Restarts from the head if a snip
+	  loses a race.
+	*/
+	bool find( K const & k, node_ptr preds[], node_ptr succs[] ) {
+	retry:
+	    node_ptr pred( m_head );
+	    node_ptr curr( 0 );
+	    for( unsigned int i(maxheight-1);; --i ) {
+		curr = node_type::ptr( (*pred)[i].load() );
+		while( curr ) {
+		    std::uintptr_t succ( (*curr)[i].load() );
+		    while( node_type::marked( succ ) ) {
+			std::uintptr_t expected( node_type::bits( curr ) );
+			if( !(*pred)[i].compare_exchange_strong( expected, succ & ~std::uintptr_t( 1 ) ) ) {
+			    goto retry;
+			}
+			curr = node_type::ptr( succ );
+			if( !curr ) break;
+			succ = (*curr)[i].load();
+		    }
+		    if( !curr ) break;
+		    if( less( curr, k ) ) {
+			pred = curr;
+			curr = node_type::ptr( succ );
+		    } else {
+			break;
+		    }
+		}
+		preds[i] = pred;
+		succs[i] = curr;
+		if( 0==i ) break;
+	    }
+	    return curr && equal( curr, k );
+	}
+
+	// Reader's search: skips over marked nodes without helping.
+	node_ptr search( K const & k ) const {
+	    node_ptr pred( m_head );
+	    node_ptr curr( 0 );
+	    for( unsigned int i(maxheight-1);; --i ) {
+		curr = node_type::ptr( (*pred)[i].load( std::memory_order_acquire ) );
+		while( curr ) {
+		    std::uintptr_t succ( (*curr)[i].load( std::memory_order_acquire ) );
+		    while( node_type::marked( succ ) ) {
+			curr = node_type::ptr( succ );
+			if( !curr ) break;
+			succ = (*curr)[i].load( std::memory_order_acquire );
+		    }
+		    if( !curr ) break;
+		    if( less( curr, k ) ) {
+			pred = curr;
+			curr = node_type::ptr( succ );
+		    } else {
+			break;
+		    }
+		}
+		if( 0==i ) break;
+	    }
+	    if( curr && equal( curr, k ) && !node_type::marked( (*curr)[0].load() ) ) {
+		return curr;
+	    }
+	    return node_ptr();
+	}
+
+    public:
+	bool insert_node( value_type const & v ) {
+	    typename domain_type::guard g( m_domain );
+	    K const & k( extract_key()( v ) );
+	    node_ptr preds[maxheight];
+	    node_ptr succs[maxheight];
+	    node_ptr node( 0 );
+	    unsigned int height( pickheight() );
+	    for(;;) {
+		if( find( k, preds, succs ) ) {
+		    if( node ) delete_node( node );
+		    return false;
+		}
+		if( !node ) node = new_node( v, height );
+		for( unsigned int i(0); i<height; ++i ) {
+		    (*node)[i].store( node_type::bits( succs[i] ), std::memory_order_relaxed );
+		}
+		std::uintptr_t expected( node_type::bits( succs[0] ) );
+		if( (*preds[0])[0].compare_exchange_strong( expected, node_type::bits( node ) ) ) {
+		    break;
+		}
+	    }
+	    ++m_size;
+	    for( unsigned int i(1); i<height; ++i ) {
+		for(;;) {
+		    std::uintptr_t cur( (*node)[i].load() );
+		    if( node_type::marked( cur ) ) goto done;
+		    if( cur != node_type::bits( succs[i] ) && !(*node)[i].compare_exchange_strong( cur, node_type::bits( succs[i] ) ) ) {
+			goto done;
+		    }
+		    std::uintptr_t expected( node_type::bits( succs[i] ) );
+		    if( (*preds[i])[i].compare_exchange_strong( expected, node_type::bits( node ) ) ) {
+			break;
+		    }
+		    find( k, preds, succs );
+		    if( succs[0] != node ) goto done;
+		}
+	    }
+	done:
+	    // A deleter may have missed the levels we were still linking.
+	    if( node_type::marked( (*node)[0].load() ) ) {
+		find( k, preds, succs );
+	    }
+	    release( node );
+	    return true;
+	}
+
+	bool erase_node( K const & k ) {
+	    typename domain_type::guard g( m_domain );
+	    node_ptr preds[maxheight];
+	    node_ptr succs[maxheight];
+	    if( !find( k, preds, succs ) ) {
+		return false;
+	    }
+	    node_ptr node( succs[0] );
+	    for( unsigned int i( node->height()-1 ); i>0; --i ) {
+		std::uintptr_t succ( (*node)[i].load() );
+		while( !node_type::marked( succ ) ) {
+		    (*node)[i].compare_exchange_weak( succ, succ | 1 );
+		}
+	    }
+	    std::uintptr_t succ( (*node)[0].load() );
+	    while( !node_type::marked( succ ) ) {
+		if( (*node)[0].compare_exchange_weak( succ, succ | 1 ) ) {
+		    --m_size;
+		    find( k, preds, succs );
+		    release( node );
+		    return true;
+		}
+	    }
+	    return false;
+	}
+
+	bool contains( K const & k ) const {
+	    typename domain_type::guard g( m_domain );
+	    return search( k );
+	}
+
+	// Calls f on the value under the guard; the node may be reclaimed
+	// as soon as it drops, so f must copy anything it wants to keep.
+	template< typename F > bool visit( K const & k, F f ) const {
+	    typename domain_type::guard g( m_domain );
+	    node_ptr n( search( k ) );
+	    if( !n ) return false;
+	    f( n->value() );
+	    return true;
+	}
+
+	template< typename F > void for_each( F f ) const {
+	    typename domain_type::guard g( m_domain );
+	    std::uintptr_t p( (*m_head)[0].load( std::memory_order_acquire ) );
+	    while( node_ptr n = node_type::ptr( p ) ) {
+		p = (*n)[0].load( std::memory_order_acquire );
+		if( !node_type::marked( p ) ) {
+		    f( n->value() );
+		}
+	    }
+	}
+
+	// Exact when quiescent, approximate otherwise.
+	std::size_t size() const {
+	    return m_size.load( std::memory_order_relaxed );
+	}
+    };
+
+    /*
+      Thread-safe map. Every operation may be called from any thread
+      without external locking; lookups are lock-free and never write
+      to shared memory apart from their own epoch record.
+      Values are immutable once inserted, and are copied out, since
+      there is no safe way to hand out an iterator.
+    */
+    template< typename K, typename V, typename L=std::less<K>, typename A=std::allocator< std::pair<K const,V> > > class concurrent_map : private ConcurrentSkiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L,A> {
+    public:
+	typedef ConcurrentSkiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L,A> parent_type;
+	typedef typename parent_type::value_type value_type;
+	typedef typename parent_type::key_type key_type;
+	typedef V mapped_type;
+	explicit concurrent_map( const L& comp=L(), const A& alloc=A() ) : parent_type( comp, alloc ) {}
+
+	using parent_type::size;
+	using parent_type::for_each;
+
+	bool empty() const {
+	    return size() == 0;
+	}
+
+	bool insert( value_type const & v ) {
+	    return this->insert_node( v );
+	}
+
+	bool erase( key_type const & k ) {
+	    return this->erase_node( k );
+	}
+
+	bool contains( key_type const & k ) const {
+	    return parent_type::contains( k );
+	}
+	std::size_t count( key_type const & k ) const {
+	    return parent_type::contains( k ) ? 1 : 0;
+	}
+
+	bool find( key_type const & k, mapped_type & out ) const {
+	    return this->visit( k, copy_mapped( out ) );
+	}
+
+    private:
+	class copy_mapped {
+	    mapped_type & m_out;
+	public:
+	    copy_mapped( mapped_type & out ) : m_out( out ) {}
+	    void operator()( value_type const & v ) {
+		m_out = v.second;
+	    }
+	};
+    };
+}
+
+#endif
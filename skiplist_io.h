@@ -0,0 +1,470 @@
+// -*- C++ -*-
+
+// Copyright 2004-2006 Dave Cridland <dave@cridland.net>
+
+#ifndef SKIPLIST_IO_H
+#define SKIPLIST_IO_H
+
+#include "skiplist.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <istream>
+#include <iterator>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+#include <unistd.h>
+
+/*
+  Saving maps to disk and loading them back.
+
+  The file is a header, then blocks of entries in key order, each
+  length-prefixed and CRC-32 checked, then an empty block to end it.
+  Integral keys may be stored as varint deltas from the one before.
+  Without that, entries of fixed-size types go out as the in-memory
+  array, and load hands the map each entry where it was read.
+  Loading feeds the entries straight to the map's bulk build, so the
+  whole thing is linear, with no searching.
+
+  Types other than trivially copyable ones and std::string need an
+  io_traits specialisation.
+*/
+
+namespace skip {
+    typedef std::vector<unsigned char> io_buffer;
+
+    inline void io_error( char const * what ) {
+	throw std::runtime_error( std::string( "skip::load: " ) + what );
+    }
+
+    inline void write_varint( io_buffer & out, std::uint64_t v ) {
+	while( v >= 0x80 ) {
+	    out.push_back( static_cast<unsigned char>( v | 0x80 ) );
+	    v >>= 7;
+	}
+	out.push_back( static_cast<unsigned char>( v ) );
+    }
+
+    inline std::uint64_t read_varint( unsigned char const *& p, unsigned char const * end ) {
+	std::uint64_t v( 0 );
+	for( unsigned int shift(0); shift<64; shift+=7 ) {
+	    if( p == end ) io_error( "truncated entry" );
+	    unsigned char c( *p++ );
+	    v |= std::uint64_t( c & 0x7F ) << shift;
+	    if( !( c & 0x80 ) ) return v;
+	}
+	io_error( "bad varint" );
+	return 0;
+    }
+
+    inline std::uint32_t crc32( unsigned char const * p, std::size_t n, std::uint32_t crc=0 ) {
+	struct table {
+	    std::uint32_t m_t[256];
+	    table() {
+		for( std::uint32_t i(0); i<256; ++i ) {
+		    std::uint32_t c( i );
+		    for( int k(0); k<8; ++k ) {
+			c = ( c & 1 ) ? 0xEDB88320u ^ ( c >> 1 ) : c >> 1;
+		    }
+		    m_t[i] = c;
+		}
+	    }
+	};
+	static const table t;
+	crc = ~crc;
+	while( n-- ) {
+	    crc = t.m_t[ ( crc ^ *p++ ) & 0xFF ] ^ ( crc >> 8 );
+	}
+	return ~crc;
+    }
+
+    /*
+      How one key or value is encoded. fixed types are written as their
+      bytes, and may be loaded in place.
+    */
+    template< typename T, typename Enable=void > struct io_traits {
+	static_assert( std::is_trivially_copyable<T>::value, "skip::io_traits needs specialising for this type" );
+	static const bool fixed = true;
+	static void write( io_buffer & out, T const & t ) {
+	    unsigned char const * p( reinterpret_cast<unsigned char const *>( &t ) );
+	    out.insert( out.end(), p, p + sizeof(T) );
+	}
+	static T read( unsigned char const *& p, unsigned char const * end ) {
+	    if( static_cast<std::size_t>( end - p ) < sizeof(T) ) io_error( "truncated entry" );
+	    T t;
+	    std::memcpy( static_cast<void *>( &t ), p, sizeof(T) );
+	    p += sizeof(T);
+	    return t;
+	}
+    };
+
+    template< typename C, typename T, typename A > struct io_traits< std::basic_string<C,T,A> > {
+	typedef std::basic_string<C,T,A> string_type;
+	static_assert( std::is_trivially_copyable<C>::value, "skip::io_traits needs specialising for this type" );
+	static const bool fixed = false;
+	static void write( io_buffer & out, string_type const & s ) {
+	    write_varint( out, s.size() );
+	    unsigned char const * p( reinterpret_cast<unsigned char const *>( s.data() ) );
+	    out.insert( out.end(), p, p + s.size() * sizeof(C) );
+	}
+	static string_type read( unsigned char const *& p, unsigned char const * end ) {
+	    std::uint64_t n( read_varint( p, end ) );
+	    if( n > static_cast<std::size_t>( end - p ) / sizeof(C) ) io_error( "truncated entry" );
+	    string_type s( n, C() );
+	    std::memcpy( static_cast<void *>( &s[0] ), p, n * sizeof(C) );
+	    p += n * sizeof(C);
+	    return s;
+	}
+    };
+
+    /*
+      Delta coding of sorted integral keys, as varints of the unsigned
+      difference; the first key of a block is relative to zero.
+    */
+    template< typename K, bool integral=std::is_integral<K>::value > class io_delta {
+    public:
+	void reset() {}
+	void write( io_buffer &, K const & ) {}
+	K read( unsigned char const *&, unsigned char const * ) {
+	    io_error( "delta keys for a non-integral key type" );
+	    return K();
+	}
+    };
+    template< typename K > class io_delta<K,true> {
+	typedef typename std::make_unsigned<K>::type delta_type;
+	delta_type m_prev;
+    public:
+	io_delta() : m_prev( 0 ) {}
+	void reset() {
+	    m_prev = 0;
+	}
+	void write( io_buffer & out, K const & k ) {
+	    delta_type d( static_cast<delta_type>( k ) );
+	    write_varint( out, static_cast<delta_type>( d - m_prev ) );
+	    m_prev = d;
+	}
+	K read( unsigned char const *& p, unsigned char const * end ) {
+	    m_prev = static_cast<delta_type>( m_prev + static_cast<delta_type>( read_varint( p, end ) ) );
+	    return static_cast<K>( m_prev );
+	}
+    };
+
+    // Where save writes to, and load reads from.
+    class ostream_sink {
+	std::ostream & m_os;
+    public:
+	explicit ostream_sink( std::ostream & os ) : m_os( os ) {}
+	void write( void const * p, std::size_t n ) {
+	    if( !m_os.write( static_cast<char const *>( p ), n ) ) {
+		throw std::runtime_error( "skip::save: write failed" );
+	    }
+	}
+    };
+    class fd_sink {
+	int m_fd;
+    public:
+	explicit fd_sink( int fd ) : m_fd( fd ) {}
+	void write( void const * p, std::size_t n ) {
+	    char const * c( static_cast<char const *>( p ) );
+	    while( n ) {
+		ssize_t r( ::write( m_fd, c, n ) );
+		if( r < 0 ) {
+		    if( errno == EINTR ) continue;
+		    throw std::system_error( errno, std::generic_category(), "skip::save" );
+		}
+		c += r;
+		n -= r;
+	    }
+	}
+    };
+    class istream_source {
+	std::istream & m_is;
+    public:
+	explicit istream_source( std::istream & is ) : m_is( is ) {}
+	bool read( void * p, std::size_t n ) {
+	    return static_cast<std::size_t>( m_is.read( static_cast<char *>( p ), n ).gcount() ) == n;
+	}
+    };
+    class fd_source {
+	int m_fd;
+    public:
+	explicit fd_source( int fd ) : m_fd( fd ) {}
+	bool read( void * p, std::size_t n ) {
+	    char * c( static_cast<char *>( p ) );
+	    while( n ) {
+		ssize_t r( ::read( m_fd, c, n ) );
+		if( r < 0 ) {
+		    if( errno == EINTR ) continue;
+		    throw std::system_error( errno, std::generic_category(), "skip::load" );
+		}
+		if( r == 0 ) return false;
+		c += r;
+		n -= r;
+	    }
+	    return true;
+	}
+    };
+
+    struct io_header {
+	char m_magic[8];
+	std::uint32_t m_byte_order;
+	std::uint32_t m_flags;
+	std::uint32_t m_key_size;
+	std::uint32_t m_value_size;
+	std::uint64_t m_count;
+	std::uint32_t m_pad;
+	std::uint32_t m_crc;	// Of everything before it.
+
+	static const std::uint32_t delta_keys = 1;
+	static const std::uint32_t raw_entries = 2;
+	static const std::size_t block_target = 64 * 1024;
+    };
+
+    /*
+      Format shared by the saver and loader for map type M. raw means
+      entries go out as the value_type array itself; delta means
+      integral keys are varint differences.
+    */
+    template< typename M > class io_format {
+    public:
+	typedef typename M::key_type key_type;
+	typedef typename M::mapped_type mapped_type;
+	typedef typename M::value_type value_type;
+	typedef io_traits<key_type> key_traits;
+	typedef io_traits<mapped_type> mapped_traits;
+	static const bool can_delta = std::is_integral<key_type>::value;
+	static const bool can_raw = key_traits::fixed && mapped_traits::fixed && std::is_trivially_copy_constructible<value_type>::value;
+
+	static std::uint32_t flags( bool delta ) {
+	    if( delta && can_delta ) return io_header::delta_keys;
+	    if( can_raw ) return io_header::raw_entries;
+	    return 0;
+	}
+	static std::uint32_t key_size() {
+	    return key_traits::fixed ? sizeof(key_type) : 0;
+	}
+	static std::uint32_t value_size() {
+	    return can_raw ? sizeof(value_type) : 0;
+	}
+	// Longest block the saver writes, or zero if an entry has no bound.
+	static std::size_t max_block( std::uint32_t flags ) {
+	    if( flags & io_header::raw_entries ) return io_header::block_target + sizeof(value_type);
+	    if( !key_traits::fixed || !mapped_traits::fixed ) return 0;
+	    std::size_t key( ( flags & io_header::delta_keys ) ? ( sizeof(key_type) * 8 + 6 ) / 7 : sizeof(key_type) );
+	    return io_header::block_target + key + sizeof(mapped_type);
+	}
+    };
+
+    template< typename M, typename S > void save_to( M const & m, S & sink, bool delta ) {
+	typedef io_format<M> format;
+	typedef typename format::key_type key_type;
+	typedef typename format::value_type value_type;
+	io_header h;
+	std::memset( &h, 0, sizeof(h) );
+	std::memcpy( h.m_magic, "SKIPMAP1", 8 );
+	h.m_byte_order = 0x01020304;
+	h.m_flags = format::flags( delta );
+	h.m_key_size = format::key_size();
+	h.m_value_size = format::value_size();
+	h.m_count = m.size();
+	h.m_crc = crc32( reinterpret_cast<unsigned char const *>( &h ), offsetof( io_header, m_crc ) );
+	sink.write( &h, sizeof(h) );
+
+	io_buffer block;
+	block.reserve( io_header::block_target + 256 );
+	std::uint32_t entries( 0 );
+	io_delta<key_type> delta_keys;
+	typename M::const_iterator i( m.begin() );
+	for( ;; ) {
+	    bool done( i == m.end() );
+	    if( done || block.size() >= io_header::block_target ) {
+		std::uint32_t len[2] = { static_cast<std::uint32_t>( block.size() ), entries };
+		std::uint32_t crc( crc32( reinterpret_cast<unsigned char const *>( len ), sizeof(len) ) );
+		crc = crc32( block.data(), block.size(), crc );
+		sink.write( len, sizeof(len) );
+		sink.write( block.data(), block.size() );
+		sink.write( &crc, sizeof(crc) );
+		if( done && !entries ) break;
+		block.clear();
+		entries = 0;
+		delta_keys.reset();
+		continue;
+	    }
+	    value_type const & v( *i );
+	    if( h.m_flags & io_header::raw_entries ) {
+		// Zeroed first, so padding goes out as zeroes.
+		std::size_t at( block.size() );
+		block.resize( at + sizeof(value_type) );
+		new( &block[at] ) value_type( v );
+	    } else {
+		if( h.m_flags & io_header::delta_keys ) {
+		    delta_keys.write( block, v.first );
+		} else {
+		    format::key_traits::write( block, v.first );
+		}
+		format::mapped_traits::write( block, v.second );
+	    }
+	    ++entries;
+	    ++i;
+	}
+    }
+
+    /*
+      Input iterator over a saved file, for the map's bulk build. Each
+      block is read and checked whole; raw blocks are then handed out
+      in place, others decoded into a vector first.
+    */
+    template< typename M, typename S > class load_iterator {
+    public:
+	typedef io_format<M> format;
+	typedef typename format::key_type key_type;
+	typedef typename format::mapped_type mapped_type;
+	typedef typename format::value_type value_type;
+	typedef value_type const & reference;
+	typedef value_type const * pointer;
+	typedef std::ptrdiff_t difference_type;
+	typedef std::input_iterator_tag iterator_category;
+    private:
+	struct state {
+	    S m_source;
+	    std::uint32_t m_flags;
+	    std::uint64_t m_count;
+	    std::uint64_t m_seen;
+	    // Raw blocks land here; u64 keeps the entries aligned.
+	    std::vector<std::uint64_t> m_raw;
+	    std::vector<value_type> m_decoded;
+	    value_type const * m_entries;
+	    std::size_t m_n;
+	    std::size_t m_pos;
+	    explicit state( S const & s ) : m_source( s ), m_flags( 0 ), m_count( 0 ), m_seen( 0 ), m_entries( 0 ), m_n( 0 ), m_pos( 0 ) {}
+	};
+	state * m_state;
+
+    public:
+	load_iterator() : m_state( 0 ) {
+	}
+	explicit load_iterator( state * s ) : m_state( s ) {
+	    read_header();
+	    next_block();
+	}
+
+	reference operator*() const {
+	    return m_state->m_entries[m_state->m_pos];
+	}
+	pointer operator->() const {
+	    return &m_state->m_entries[m_state->m_pos];
+	}
+	load_iterator & operator++() {
+	    if( ++m_state->m_pos == m_state->m_n ) {
+		next_block();
+	    }
+	    return *this;
+	}
+	bool operator==( load_iterator const & i ) const {
+	    return at_end() == i.at_end();
+	}
+	bool operator!=( load_iterator const & i ) const {
+	    return at_end() != i.at_end();
+	}
+
+	static M load( S const & source ) {
+	    state s( source );
+	    return M( load_iterator( &s ), load_iterator() );
+	}
+
+    private:
+	bool at_end() const {
+	    return !m_state || m_state->m_pos == m_state->m_n;
+	}
+
+	void read_header() {
+	    io_header h;
+	    if( !m_state->m_source.read( &h, sizeof(h) ) ) io_error( "no header" );
+	    if( std::memcmp( h.m_magic, "SKIPMAP1", 8 ) != 0 ) io_error( "not a saved map" );
+	    if( h.m_crc != crc32( reinterpret_cast<unsigned char const *>( &h ), offsetof( io_header, m_crc ) ) ) io_error( "bad header checksum" );
+	    if( h.m_byte_order != 0x01020304 ) io_error( "saved with another byte order" );
+	    if( ( h.m_flags & io_header::delta_keys ) && !format::can_delta ) io_error( "delta keys for a non-integral key type" );
+	    if( ( h.m_flags & io_header::raw_entries ) && !format::can_raw ) io_error( "raw entries for a variable-size type" );
+	    if( h.m_key_size != format::key_size() || ( ( h.m_flags & io_header::raw_entries ) && h.m_value_size != format::value_size() ) ) {
+		io_error( "saved with other key or value types" );
+	    }
+	    m_state->m_flags = h.m_flags;
+	    m_state->m_count = h.m_count;
+	}
+
+	void next_block() {
+	    state & s( *m_state );
+	    s.m_pos = 0;
+	    s.m_n = 0;
+	    std::uint32_t len[2];
+	    if( !s.m_source.read( len, sizeof(len) ) ) io_error( "truncated file" );
+	    std::size_t bytes( len[0] );
+	    std::size_t most( format::max_block( s.m_flags ) );
+	    if( most && bytes > most ) io_error( "bad block length" );
+	    // Otherwise the buffer grows only as the bytes turn up, so a bad length runs out of file first.
+	    std::size_t chunk( io_header::block_target );
+	    for( std::size_t got(0); got<bytes; ) {
+		std::size_t n( std::min( bytes - got, chunk ) );
+		s.m_raw.resize( ( got + n + sizeof(std::uint64_t) - 1 ) / sizeof(std::uint64_t) );
+		if( !s.m_source.read( reinterpret_cast<unsigned char *>( s.m_raw.data() ) + got, n ) ) io_error( "truncated file" );
+		got += n;
+	    }
+	    unsigned char * data( reinterpret_cast<unsigned char *>( s.m_raw.data() ) );
+	    std::uint32_t crc;
+	    if( !s.m_source.read( &crc, sizeof(crc) ) ) io_error( "truncated file" );
+	    std::uint32_t check( crc32( reinterpret_cast<unsigned char const *>( len ), sizeof(len) ) );
+	    if( crc != crc32( data, bytes, check ) ) io_error( "bad block checksum" );
+	    if( !len[1] ) {
+		if( s.m_seen != s.m_count ) io_error( "entry count mismatch" );
+		return;
+	    }
+	    if( s.m_flags & io_header::raw_entries ) {
+		if( bytes != std::size_t( len[1] ) * sizeof(value_type) ) io_error( "bad block length" );
+		s.m_entries = reinterpret_cast<value_type const *>( data );
+	    } else {
+		// Every entry takes a byte at least.
+		if( len[1] > bytes ) io_error( "bad block length" );
+		s.m_decoded.clear();
+		s.m_decoded.reserve( len[1] );
+		unsigned char const * p( data );
+		unsigned char const * end( data + bytes );
+		io_delta<key_type> delta_keys;
+		bool delta( s.m_flags & io_header::delta_keys );
+		for( std::uint32_t i(0); i<len[1]; ++i ) {
+		    key_type k( delta ? delta_keys.read( p, end ) : format::key_traits::read( p, end ) );
+		    mapped_type v( format::mapped_traits::read( p, end ) );
+		    s.m_decoded.emplace_back( std::move( k ), std::move( v ) );
+		}
+		if( p != end ) io_error( "bad block length" );
+		s.m_entries = s.m_decoded.data();
+	    }
+	    s.m_n = len[1];
+	    s.m_seen += len[1];
+	}
+    };
+
+    // delta only applies to integral keys.
+    template< typename M > void save( M const & m, std::ostream & os, bool delta=true ) {
+	ostream_sink s( os );
+	save_to( m, s, delta );
+    }
+    template< typename M > void save( M const & m, int fd, bool delta=true ) {
+	fd_sink s( fd );
+	save_to( m, s, delta );
+    }
+
+    // Throws std::runtime_error if the file is damaged or of another type.
+    template< typename M > M load( std::istream & is ) {
+	return load_iterator<M,istream_source>::load( istream_source( is ) );
+    }
+    template< typename M > M load( int fd ) {
+	return load_iterator<M,fd_source>::load( fd_source( fd ) );
+    }
+}
+
+#endif
@@ -0,0 +1,578 @@
+// -*- C++ -*-
+
+// Copyright 2004-2006 Dave Cridland <dave@cridland.net>
+
+#ifndef SKIPLIST_MVCC_H
+#define SKIPLIST_MVCC_H
+
+#include "skiplist_concurrent.h"
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <iterator>
+#include <functional>
+
+namespace skip {
+    /*
+      Node of a versioned skiplist. Laid out like the others - value in
+      front, tower behind - plus the version that created it and the
+      version that erased it. Values are never changed in place: an
+      update is a new node, so every version of an entry has its own.
+    */
+    template< typename V >
+    class VersionedSkiplistNode {
+    public:
+	typedef V value_type;
+	typedef VersionedSkiplistNode<V> my_type;
+	typedef std::atomic<my_type *> link_type;
+	static const std::uint64_t never = ~std::uint64_t( 0 );
+    private:
+	unsigned int m_height;
+	std::uint64_t m_born;
+	std::atomic<std::uint64_t> m_died;
+	my_type * m_retired_next;
+	link_type m_ptrs[1];
+
+	// Unimplemented:
+	VersionedSkiplistNode( VersionedSkiplistNode const & );
+	VersionedSkiplistNode & operator = ( VersionedSkiplistNode const & );
+
+    public:
+	VersionedSkiplistNode( unsigned int h, std::uint64_t born ) : m_height( h ), m_born( born ), m_died( never ), m_retired_next( 0 ) {
+	    for( unsigned int i(0); i<m_height; ++i ) {
+		new( &m_ptrs[i] ) link_type( 0 );
+	    }
+	}
+
+	inline link_type & operator[]( int i ) {
+	    return m_ptrs[i];
+	}
+	inline my_type * next( int i ) const {
+	    return m_ptrs[i].load( std::memory_order_acquire );
+	}
+
+	// Offset of the node from the start of the block; keeps the atomics aligned.
+	static const std::size_t value_offset = ( ( sizeof(value_type) + alignof(link_type) - 1 ) / alignof(link_type) ) * alignof(link_type);
+
+	inline value_type const & value() const {
+	    return *value_ptr();
+	}
+	inline const value_type * value_ptr() const {
+	    return reinterpret_cast<const value_type *>( reinterpret_cast<const unsigned char *>( this ) - value_offset );
+	}
+	inline value_type * value_ptr() {
+	    return reinterpret_cast<value_type *>( reinterpret_cast<unsigned char *>( this ) - value_offset );
+	}
+
+	inline unsigned int height() const {
+	    return m_height;
+	}
+	inline std::uint64_t born() const {
+	    return m_born;
+	}
+	inline std::uint64_t died() const {
+	    return m_died.load( std::memory_order_acquire );
+	}
+	inline bool live() const {
+	    return died() == never;
+	}
+	inline void kill( std::uint64_t v ) {
+	    m_died.store( v, std::memory_order_release );
+	}
+	// Whether a reader at version s sees this node.
+	inline bool visible( std::uint64_t s ) const {
+	    return m_born <= s && s < died();
+	}
+	inline my_type *& retired_next() {
+	    return m_retired_next;
+	}
+
+	static inline std::size_t alloc_size( unsigned int h ) {
+	    return value_offset + sizeof(my_type) + ( h - 1 ) * sizeof(link_type);
+	}
+    };
+
+    /*
+      Multi-version skiplist. Writers take a mutex among themselves, and
+      each write is one step of a global version; readers take no locks
+      at all, and read as of a version - either the latest, or one held
+      by a snapshot. A snapshot pins its version, and nodes erased after
+      it stay linked, so its scans see exactly the entries of that
+      moment however long they take, and writers never wait for them.
+      Once no snapshot can see a dead node, the next writer unlinks it
+      and hands it to the epoch domain.
+      Versions of one key sit together, newest first.
+    */
+    template< typename K, typename V, typename X, typename L, typename A > class VersionedSkiplist {
+    public:
+	typedef K key_type;
+	typedef V value_type;
+	typedef X extract_key;
+	typedef L key_compare;
+	typedef A allocator_type;
+	typedef VersionedSkiplist<K,V,X,L,A> my_type;
+	typedef VersionedSkiplistNode<value_type> node_type;
+	typedef typename allocator_type::template rebind< unsigned char >::other raw_allocator;
+	typedef node_type * node_ptr;
+	typedef epoch_domain<node_type> domain_type;
+	static const unsigned int maxheight = 32;
+	static const std::uint64_t never = node_type::never;
+    private:
+	// A snapshot's claim on its version; recycled, never freed until the list is.
+	struct pin_record {
+	    std::atomic<std::uint64_t> m_version;
+	    std::atomic<bool> m_used;
+	    pin_record * m_next;
+	    pin_record() : m_version( never ), m_used( true ), m_next( 0 ) {
+	    }
+	};
+
+	node_ptr m_head;
+	key_compare m_comp;
+	std::atomic<std::uint64_t> m_version;
+	std::atomic<std::size_t> m_size;
+	std::atomic<pin_record *> m_pins;
+	std::mutex m_write;
+	// Erased nodes still visible to some snapshot, oldest first.
+	node_ptr m_dead_head;
+	node_ptr m_dead_tail;
+	raw_allocator m_alloc;
+	mutable domain_type m_domain;
+
+	// Unimplemented:
+	VersionedSkiplist( my_type const & );
+	my_type & operator=( my_type const & );
+
+    public:
+	VersionedSkiplist( L const & l, A const & a ) : m_head( 0 ), m_comp( l ), m_version( 1 ), m_size( 0 ), m_pins( 0 ), m_dead_head( 0 ), m_dead_tail( 0 ), m_alloc( a ), m_domain( &reclaim, this ) {
+	    m_head = new_node( maxheight, 0 );
+	}
+	// Not thread-safe; all other users, and all snapshots, must be gone.
+	virtual ~VersionedSkiplist() {
+	    node_ptr current( (*m_head)[0].load() );
+	    while( current ) {
+		node_ptr next( (*current)[0].load() );
+		delete_node( current );
+		current = next;
+	    }
+	    destroy_node( m_head );
+	    pin_record * p( m_pins.load() );
+	    while( p ) {
+		pin_record * next( p->m_next );
+		delete p;
+		p = next;
+	    }
+	}
+
+    private:
+	static unsigned int pickheight() {
+	    static thread_local std::uint64_t t_state( 0 );
+	    if( !t_state ) {
+		t_state = reinterpret_cast<std::uintptr_t>( &t_state ) ^ 0x9E3779B97F4A7C15ull;
+	    }
+	    t_state ^= t_state << 13;
+	    t_state ^= t_state >> 7;
+	    t_state ^= t_state << 17;
+	    unsigned int h( 1 + __builtin_clzll( t_state | 1 ) / 2 );
+	    return h > maxheight ? maxheight : h;
+	}
+
+	node_ptr new_node( unsigned int height, std::uint64_t born ) {
+	    unsigned char * p( m_alloc.allocate( node_type::alloc_size( height ) ) );
+	    p += node_type::value_offset;
+	    new( p ) node_type( height, born );
+	    return reinterpret_cast<node_ptr>( p );
+	}
+	node_ptr new_node( value_type const & v, unsigned int height, std::uint64_t born ) {
+	    node_ptr p( new_node( height, born ) );
+	    try {
+		new( p->value_ptr() ) value_type( v );
+	    } catch( ... ) {
+		destroy_node( p );
+		throw;
+	    }
+	    return p;
+	}
+	void delete_node( node_ptr p ) {
+	    p->value_ptr()->~value_type();
+	    destroy_node( p );
+	}
+	void destroy_node( node_ptr p ) {
+	    unsigned char * pp( reinterpret_cast<unsigned char *>( p ) - node_type::value_offset );
+	    unsigned int h( p->height() );
+	    p->~node_type();
+	    m_alloc.deallocate( pp, node_type::alloc_size( h ) );
+	}
+	static void reclaim( void * ctx, node_type * p ) {
+	    static_cast<my_type *>( ctx )->delete_node( p );
+	}
+
+	bool less( node_ptr n, K const & k ) const {
+	    return m_comp( extract_key()( n->value() ), k );
+	}
+	bool equal( node_ptr n, K const & k ) const {
+	    return !m_comp( k, extract_key()( n->value() ) ) && !less( n, k );
+	}
+
+	/*
+	  Finds the first node whose key isn't less than k and which is no
+	  newer than born, filling preds[] on the way. With born left as
+	  never that's the newest version of k, if there is one.
+	*/
+	node_ptr find( K const & k, node_ptr preds[], std::uint64_t born=never ) const {
+	    node_ptr pred( m_head );
+	    node_ptr curr( 0 );
+	    for( unsigned int i(maxheight-1);; --i ) {
+		curr = pred->next( i );
+		while( curr && ( less( curr, k ) || ( curr->born() > born && equal( curr, k ) ) ) ) {
+		    pred = curr;
+		    curr = pred->next( i );
+		}
+		if( preds ) {
+		    preds[i] = pred;
+		}
+		if( 0==i ) break;
+	    }
+	    return curr;
+	}
+
+	// Links a new version in ahead of succ's, at version v.
+	node_ptr link( value_type const & v, node_ptr preds[], std::uint64_t version ) {
+	    unsigned int height( pickheight() );
+	    node_ptr node( new_node( v, height, version ) );
+	    for( unsigned int i(0); i<height; ++i ) {
+		(*node)[i].store( preds[i]->next( i ), std::memory_order_relaxed );
+	    }
+	    for( unsigned int i(0); i<height; ++i ) {
+		(*preds[i])[i].store( node, std::memory_order_release );
+	    }
+	    return node;
+	}
+
+	// Erases node as of version v; it stays linked until unseen.
+	void bury( node_ptr node, std::uint64_t v ) {
+	    node->kill( v );
+	    node->retired_next() = 0;
+	    if( m_dead_tail ) {
+		m_dead_tail->retired_next() = node;
+	    } else {
+		m_dead_head = node;
+	    }
+	    m_dead_tail = node;
+	}
+
+	// The oldest version anyone might still be reading at.
+	std::uint64_t horizon() const {
+	    std::uint64_t h( m_version.load() );
+	    for( pin_record * p( m_pins.load() ); p; p = p->m_next ) {
+		std::uint64_t v( p->m_version.load() );
+		if( v < h ) h = v;
+	    }
+	    return h;
+	}
+
+	/*
+	  Unlinks and retires dead nodes no snapshot can see. They died in
+	  version order, so this stops at the first one still needed.
+	  Writers only, while pinned.
+	*/
+	void collect() {
+	    if( !m_dead_head ) return;
+	    std::uint64_t h( horizon() );
+	    node_ptr preds[maxheight];
+	    while( m_dead_head && m_dead_head->died() <= h ) {
+		node_ptr node( m_dead_head );
+		m_dead_head = node->retired_next();
+		if( !m_dead_head ) m_dead_tail = 0;
+		find( extract_key()( node->value() ), preds, node->born() );
+		for( unsigned int i(0); i<node->height(); ++i ) {
+		    (*preds[i])[i].store( node->next( i ), std::memory_order_release );
+		}
+		m_domain.retire( node );
+	    }
+	}
+
+    public:
+	bool insert_node( value_type const & v ) {
+	    std::lock_guard<std::mutex> l( m_write );
+	    typename domain_type::guard g( m_domain );
+	    K const & k( extract_key()( v ) );
+	    node_ptr preds[maxheight];
+	    node_ptr n( find( k, preds ) );
+	    if( n && equal( n, k ) && n->live() ) {
+		return false;
+	    }
+	    std::uint64_t version( m_version.load() + 1 );
+	    link( v, preds, version );
+	    m_version.store( version );
+	    ++m_size;
+	    return true;
+	}
+
+	// The old value, if any, and the new one swap at the same version.
+	bool assign_node( value_type const & v ) {
+	    std::lock_guard<std::mutex> l( m_write );
+	    typename domain_type::guard g( m_domain );
+	    K const & k( extract_key()( v ) );
+	    node_ptr preds[maxheight];
+	    node_ptr n( find( k, preds ) );
+	    std::uint64_t version( m_version.load() + 1 );
+	    link( v, preds, version );
+	    bool replaced( n && equal( n, k ) && n->live() );
+	    if( replaced ) {
+		bury( n, version );
+	    } else {
+		++m_size;
+	    }
+	    m_version.store( version );
+	    collect();
+	    return !replaced;
+	}
+
+	bool erase_node( K const & k ) {
+	    std::lock_guard<std::mutex> l( m_write );
+	    typename domain_type::guard g( m_domain );
+	    node_ptr n( find( k, 0 ) );
+	    if( !n || !equal( n, k ) || !n->live() ) {
+		return false;
+	    }
+	    std::uint64_t version( m_version.load() + 1 );
+	    bury( n, version );
+	    m_version.store( version );
+	    --m_size;
+	    collect();
+	    return true;
+	}
+
+	std::uint64_t version() const {
+	    return m_version.load();
+	}
+
+	// Exact when quiescent, approximate otherwise.
+	std::size_t size() const {
+	    return m_size.load( std::memory_order_relaxed );
+	}
+
+	/*
+	  Reads as of version s. The caller must either be pinned in the
+	  epoch domain or hold a snapshot at s or earlier; the nodes that
+	  come back are visible at s, so a snapshot keeps them alive.
+	*/
+	node_ptr first_at( std::uint64_t s ) const {
+	    typename domain_type::guard g( m_domain );
+	    return visible_from( m_head->next( 0 ), s );
+	}
+	node_ptr next_at( node_ptr n, std::uint64_t s ) const {
+	    typename domain_type::guard g( m_domain );
+	    return visible_from( n->next( 0 ), s );
+	}
+	node_ptr lower_bound_at( K const & k, std::uint64_t s ) const {
+	    typename domain_type::guard g( m_domain );
+	    return visible_from( find( k, 0 ), s );
+	}
+	node_ptr find_at( K const & k, std::uint64_t s ) const {
+	    node_ptr n( lower_bound_at( k, s ) );
+	    return n && equal( n, k ) ? n : node_ptr();
+	}
+
+	/*
+	  Calls f on the latest value for k, under the guard. There's no
+	  pin, so a writer may unlink the version of k we're after while
+	  we look - but only once a newer version is out, so a miss
+	  stands only if the version hasn't moved; otherwise we look again.
+	*/
+	template< typename F > bool visit( K const & k, F f ) const {
+	    typename domain_type::guard g( m_domain );
+	    std::uint64_t s( m_version.load() );
+	    node_ptr n;
+	    while( !( n = find_at( k, s ) ) ) {
+		std::uint64_t now( m_version.load() );
+		if( now == s ) return false;
+		s = now;
+	    }
+	    f( n->value() );
+	    return true;
+	}
+
+	class const_iterator {
+	    my_type const * m_list;
+	    node_ptr m_node;
+	    std::uint64_t m_version;
+	public:
+	    typedef V const value_type;
+	    typedef V const & reference;
+	    typedef V const * pointer;
+	    typedef std::ptrdiff_t difference_type;
+	    typedef std::forward_iterator_tag iterator_category;
+
+	    const_iterator( my_type const * list, node_ptr n, std::uint64_t s ) : m_list( list ), m_node( n ), m_version( s ) {
+	    }
+	    const_iterator & operator++() {
+		m_node = m_list->next_at( m_node, m_version );
+		return *this;
+	    }
+	    reference operator*() const {
+		return m_node->value();
+	    }
+	    pointer operator->() const {
+		return m_node->value_ptr();
+	    }
+	    bool operator==( const_iterator const & i ) const {
+		return m_node==i.m_node;
+	    }
+	    bool operator!=( const_iterator const & i ) const {
+		return m_node!=i.m_node;
+	    }
+	};
+
+	/*
+	  A read-only view as of one version. Creating one takes no lock,
+	  and holding one blocks nobody; it only delays freeing whatever
+	  has been erased since. Not to be shared between threads.
+	*/
+	class view {
+	    my_type * m_list;
+	    pin_record * m_pin;
+	    std::uint64_t m_version;
+
+	    // Unimplemented:
+	    view( view const & );
+	    view & operator=( view const & );
+
+	public:
+	    explicit view( my_type * list ) : m_list( list ), m_pin( list->acquire_pin() ) {
+		// Claim the oldest possible version while reading the real one,
+		// so a writer looking at the pins in between frees nothing.
+		m_pin->m_version.store( 0 );
+		m_version = m_list->m_version.load();
+		m_pin->m_version.store( m_version );
+	    }
+	    view( view && v ) : m_list( v.m_list ), m_pin( v.m_pin ), m_version( v.m_version ) {
+		v.m_list = 0;
+	    }
+	    ~view() {
+		if( m_list ) m_list->release_pin( m_pin );
+	    }
+
+	    std::uint64_t version() const {
+		return m_version;
+	    }
+	    const_iterator begin() const {
+		return const_iterator( m_list, m_list->first_at( m_version ), m_version );
+	    }
+	    const_iterator end() const {
+		return const_iterator( m_list, node_ptr(), m_version );
+	    }
+	    const_iterator lower_bound( K const & k ) const {
+		return const_iterator( m_list, m_list->lower_bound_at( k, m_version ), m_version );
+	    }
+	    const_iterator find( K const & k ) const {
+		return const_iterator( m_list, m_list->find_at( k, m_version ), m_version );
+	    }
+	};
+
+	view snapshot() {
+	    return view( this );
+	}
+
+    private:
+	node_ptr visible_from( node_ptr n, std::uint64_t s ) const {
+	    while( n && !n->visible( s ) ) {
+		n = n->next( 0 );
+	    }
+	    return n;
+	}
+
+	pin_record * acquire_pin() {
+	    for( pin_record * p( m_pins.load() ); p; p = p->m_next ) {
+		bool idle( false );
+		if( p->m_used.compare_exchange_strong( idle, true ) ) {
+		    return p;
+		}
+	    }
+	    pin_record * p( new pin_record );
+	    pin_record * head( m_pins.load() );
+	    do {
+		p->m_next = head;
+	    } while( !m_pins.compare_exchange_weak( head, p ) );
+	    return p;
+	}
+
+	void release_pin( pin_record * p ) {
+	    p->m_version.store( never );
+	    p->m_used.store( false );
+	    // Free what only we were holding on to - unless a writer's busy,
+	    // in which case it'll see to it.
+	    std::unique_lock<std::mutex> l( m_write, std::try_to_lock );
+	    if( l.owns_lock() ) {
+		typename domain_type::guard g( m_domain );
+		collect();
+	    }
+	}
+    };
+
+    /*
+      Thread-safe map with snapshots. Writers serialize on a mutex, but
+      readers - point lookups and snapshot scans alike - never take it,
+      and never hold writers up. Like concurrent_map, values are
+      immutable; insert_or_assign swaps in a new one atomically.
+    */
+    template< typename K, typename V, typename L=std::less<K>, typename A=std::allocator< std::pair<K const,V> > > class mvcc_map : private VersionedSkiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L,A> {
+    public:
+	typedef VersionedSkiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L,A> parent_type;
+	typedef typename parent_type::value_type value_type;
+	typedef typename parent_type::key_type key_type;
+	typedef typename parent_type::const_iterator const_iterator;
+	typedef typename parent_type::view view;
+	typedef V mapped_type;
+	explicit mvcc_map( const L& comp=L(), const A& alloc=A() ) : parent_type( comp, alloc ) {}
+
+	using parent_type::size;
+	using parent_type::version;
+	using parent_type::snapshot;
+
+	bool empty() const {
+	    return size() == 0;
+	}
+
+	bool insert( value_type const & v ) {
+	    return this->insert_node( v );
+	}
+	// True if it inserted, false if it replaced.
+	bool insert_or_assign( value_type const & v ) {
+	    return this->assign_node( v );
+	}
+
+	bool erase( key_type const & k ) {
+	    return this->erase_node( k );
+	}
+
+	bool contains( key_type const & k ) const {
+	    return this->visit( k, ignore() );
+	}
+	std::size_t count( key_type const & k ) const {
+	    return contains( k ) ? 1 : 0;
+	}
+
+	bool find( key_type const & k, mapped_type & out ) const {
+	    return this->visit( k, copy_mapped( out ) );
+	}
+
+    private:
+	class ignore {
+	public:
+	    void operator()( value_type const & ) {}
+	};
+	class copy_mapped {
+	    mapped_type & m_out;
+	public:
+	    copy_mapped( mapped_type & out ) : m_out( out ) {}
+	    void operator()( value_type const & v ) {
+		m_out = v.second;
+	    }
+	};
+    };
+}
+
+#endif
@@ -0,0 +1,492 @@
+// -*- C++ -*-
+
+// Copyright 2004-2006 Dave Cridland <dave@cridland.net>
+
+#ifndef SKIPLIST_PERSISTENT_H
+#define SKIPLIST_PERSISTENT_H
+
+#include "skiplist.h"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace skip {
+    /*
+      Start of a persistent skiplist file. Everything else is found by
+      byte offset from the start of the file, so the mapping is free to
+      move; offset 0 is the header, so it doubles as the null link.
+    */
+    struct persistent_header {
+	static const unsigned int maxheight = 32;
+	char m_magic[8];
+	std::uint32_t m_value_size;
+	std::uint32_t m_value_align;
+	std::uint32_t m_maxheight;
+	std::uint32_t m_clean;	// Zero while open; size is recounted if found so.
+	std::uint64_t m_size;
+	std::uint64_t m_height;
+	std::uint64_t m_used;	// End of allocated space.
+	std::uint64_t m_head;
+	std::uint64_t m_free[maxheight + 1];	// Free nodes by height, chained through link 0.
+    };
+
+    /*
+      Skiplist living in a memory-mapped file. Nodes are laid out as in
+      memory - value first, then height, then the tower - but links are
+      file offsets, so a file can be reopened and used straight away.
+      Keys and values must be trivially copyable, and the file is only
+      portable between builds with the same layout.
+
+      One writer. Links are written in an order that keeps the list
+      valid at every step: a new node is complete before level 0 points
+      at it, and it only joins the upper levels after; erase leaves
+      level 0 last. A crash at worst leaks a node. In durable mode each
+      of those steps is also flushed to disk before the next.
+    */
+    template< typename K, typename V, typename X, typename L > class PersistentSkiplist {
+    public:
+	typedef K key_type;
+	typedef V value_type;
+	typedef X extract_key;
+	typedef L key_compare;
+	typedef PersistentSkiplist<K,V,X,L> my_type;
+	typedef std::uint64_t node_ptr;
+	static const unsigned int maxheight = persistent_header::maxheight;
+    private:
+	static_assert( std::is_trivially_copy_constructible<value_type>::value && std::is_trivially_destructible<value_type>::value, "persistent skiplists need trivially copyable entries" );
+	static_assert( alignof(value_type) <= alignof(std::uint64_t), "persistent skiplist entries must be at most 8-byte aligned" );
+
+	static const std::size_t height_offset = ( sizeof(value_type) + 7 ) & ~std::size_t( 7 );
+	static const std::size_t links_offset = height_offset + sizeof(std::uint64_t);
+	static const std::size_t initial_size = 1 << 20;
+
+	int m_fd;
+	unsigned char * m_base;
+	std::size_t m_mapped;
+	bool m_durable;
+	key_compare m_comp;
+	std::uint64_t m_rng;
+
+	// Unimplemented:
+	PersistentSkiplist( my_type const & );
+	my_type & operator=( my_type const & );
+
+    public:
+	PersistentSkiplist( L const & l ) : m_fd( -1 ), m_base( 0 ), m_mapped( 0 ), m_durable( false ), m_comp( l ), m_rng( 0x9E3779B97F4A7C15ull ) {
+	}
+	virtual ~PersistentSkiplist() {
+	    close();
+	}
+
+	/*
+	  Opens path, creating it if needed. Throws std::system_error if
+	  the file can't be opened or mapped, and std::runtime_error if it
+	  isn't a skiplist of this type.
+	*/
+	void open( char const * path, bool durable=false ) {
+	    close();
+	    int fd( ::open( path, O_RDWR | O_CREAT, 0644 ) );
+	    if( fd < 0 ) fail( "open" );
+	    struct stat st;
+	    if( ::fstat( fd, &st ) != 0 ) {
+		int e( errno );
+		::close( fd );
+		errno = e;
+		fail( "fstat" );
+	    }
+	    m_fd = fd;
+	    m_durable = durable;
+	    try {
+		if( st.st_size == 0 ) {
+		    create();
+		} else {
+		    attach( st.st_size );
+		}
+	    } catch( ... ) {
+		if( m_base ) ::munmap( m_base, m_mapped );
+		::close( m_fd );
+		m_base = 0;
+		m_mapped = 0;
+		m_fd = -1;
+		throw;
+	    }
+	}
+
+	// Flushes everything and marks the file clean.
+	void close() {
+	    if( m_fd < 0 ) return;
+	    ::msync( m_base, m_mapped, MS_SYNC );
+	    header()->m_clean = 1;
+	    ::msync( m_base, m_mapped, MS_SYNC );
+	    ::munmap( m_base, m_mapped );
+	    ::close( m_fd );
+	    m_base = 0;
+	    m_mapped = 0;
+	    m_fd = -1;
+	}
+
+	bool is_open() const {
+	    return m_fd >= 0;
+	}
+
+	void sync() {
+	    if( m_fd >= 0 ) ::msync( m_base, m_mapped, MS_SYNC );
+	}
+
+	std::size_t size() const {
+	    return header()->m_size;
+	}
+
+	value_type & value( node_ptr n ) const {
+	    return *reinterpret_cast<value_type *>( m_base + n );
+	}
+	node_ptr next( node_ptr n ) const {
+	    return link( n, 0 );
+	}
+	node_ptr first() const {
+	    return link( header()->m_head, 0 );
+	}
+
+	node_ptr lower_bound( K const & k ) const {
+	    return find( k, 0 );
+	}
+	node_ptr find_node( K const & k ) const {
+	    node_ptr n( find( k, 0 ) );
+	    return n && !m_comp( k, extract_key()( value( n ) ) ) ? n : 0;
+	}
+
+	// The node holding v's key, and whether it's new.
+	std::pair<node_ptr,bool> insert_node( value_type const & v ) {
+	    node_ptr update[maxheight];
+	    K const & k( extract_key()( v ) );
+	    node_ptr n( find( k, update ) );
+	    if( n && !m_comp( k, extract_key()( value( n ) ) ) ) {
+		return std::make_pair( n, false );
+	    }
+	    unsigned int h( pickheight() );
+	    persistent_header * hdr( header() );
+	    if( h > hdr->m_height ) {
+		for( unsigned int i( hdr->m_height ); i<h; ++i ) {
+		    update[i] = hdr->m_head;
+		}
+		hdr->m_height = h;
+		persist( &hdr->m_height, sizeof(hdr->m_height) );
+	    }
+	    node_ptr node( allocate( h ) );
+	    new( &value( node ) ) value_type( v );
+	    for( unsigned int i(0); i<h; ++i ) {
+		link( node, i ) = link( update[i], i );
+	    }
+	    persist( &value( node ), links_offset + h * sizeof(std::uint64_t) );
+	    // Level 0 commits the insert; the rest are shortcuts.
+	    link( update[0], 0 ) = node;
+	    persist( &link( update[0], 0 ), sizeof(std::uint64_t) );
+	    for( unsigned int i(1); i<h; ++i ) {
+		link( update[i], i ) = node;
+		persist( &link( update[i], i ), sizeof(std::uint64_t) );
+	    }
+	    ++header()->m_size;
+	    return std::make_pair( node, true );
+	}
+
+	std::size_t erase_node( K const & k ) {
+	    node_ptr update[maxheight];
+	    node_ptr n( find( k, update ) );
+	    if( !n || m_comp( k, extract_key()( value( n ) ) ) ) {
+		return 0;
+	    }
+	    // Top down, so the node never sits in a level above one it's left.
+	    // A crash can leave it out of some upper levels already.
+	    for( unsigned int i( height( n ) - 1 ); i>0; --i ) {
+		if( link( update[i], i ) == n ) {
+		    link( update[i], i ) = link( n, i );
+		    persist( &link( update[i], i ), sizeof(std::uint64_t) );
+		}
+	    }
+	    link( update[0], 0 ) = link( n, 0 );
+	    persist( &link( update[0], 0 ), sizeof(std::uint64_t) );
+	    --header()->m_size;
+	    release( n );
+	    return 1;
+	}
+
+	void clear() {
+	    persistent_header * hdr( header() );
+	    link( hdr->m_head, 0 ) = 0;
+	    persist( &link( hdr->m_head, 0 ), sizeof(std::uint64_t) );
+	    for( unsigned int i(1); i<maxheight; ++i ) {
+		link( hdr->m_head, i ) = 0;
+	    }
+	    for( unsigned int i(0); i<=maxheight; ++i ) {
+		hdr->m_free[i] = 0;
+	    }
+	    hdr->m_height = 1;
+	    hdr->m_size = 0;
+	    hdr->m_used = hdr->m_head + node_size( maxheight );
+	    persist( hdr, hdr->m_used );
+	}
+
+    private:
+	static void fail( char const * what ) {
+	    throw std::system_error( errno, std::generic_category(), std::string( "skip::persistent_map: " ) + what );
+	}
+
+	static std::size_t node_size( unsigned int h ) {
+	    return links_offset + h * sizeof(std::uint64_t);
+	}
+
+	persistent_header * header() const {
+	    return reinterpret_cast<persistent_header *>( m_base );
+	}
+	std::uint64_t & link( node_ptr n, unsigned int i ) const {
+	    return reinterpret_cast<std::uint64_t *>( m_base + n + links_offset )[i];
+	}
+	std::uint64_t & height( node_ptr n ) const {
+	    return *reinterpret_cast<std::uint64_t *>( m_base + n + height_offset );
+	}
+
+	/*
+	  Orders the writes before it ahead of those after; durably so
+	  with msync, otherwise just against the compiler, which is enough
+	  for the page cache to hold them in order if the process dies.
+	*/
+	void persist( void const * p, std::size_t len ) {
+	    std::atomic_signal_fence( std::memory_order_seq_cst );
+	    if( !m_durable ) return;
+	    std::uintptr_t page( ::sysconf( _SC_PAGESIZE ) );
+	    std::uintptr_t start( reinterpret_cast<std::uintptr_t>( p ) & ~( page - 1 ) );
+	    std::uintptr_t end( reinterpret_cast<std::uintptr_t>( p ) + len );
+	    if( ::msync( reinterpret_cast<void *>( start ), end - start, MS_SYNC ) != 0 ) fail( "msync" );
+	}
+
+	node_ptr find( K const & k, node_ptr update[] ) const {
+	    persistent_header * hdr( header() );
+	    node_ptr x( hdr->m_head );
+	    node_ptr n( 0 );
+	    for( unsigned int i( hdr->m_height ); i-->0; ) {
+		while( ( n = link( x, i ) ) && m_comp( extract_key()( value( n ) ), k ) ) {
+		    x = n;
+		}
+		if( update ) update[i] = x;
+	    }
+	    return n;
+	}
+
+	unsigned int pickheight() {
+	    m_rng ^= m_rng >> 12;
+	    m_rng ^= m_rng << 25;
+	    m_rng ^= m_rng >> 27;
+	    std::uint64_t r( m_rng * 0x2545F4914F6CDD1Dull );
+	    unsigned int h( 1 + __builtin_clzll( r | 1 ) / 2 );
+	    return h > maxheight ? maxheight : h;
+	}
+
+	// A crash between taking space and linking it in only leaks it.
+	node_ptr allocate( unsigned int h ) {
+	    persistent_header * hdr( header() );
+	    node_ptr n( hdr->m_free[h] );
+	    if( n ) {
+		hdr->m_free[h] = link( n, 0 );
+		persist( &hdr->m_free[h], sizeof(std::uint64_t) );
+	    } else {
+		n = hdr->m_used;
+		std::size_t need( n + node_size( h ) );
+		if( need > m_mapped ) {
+		    grow( need );
+		    hdr = header();
+		}
+		hdr->m_used = need;
+		persist( &hdr->m_used, sizeof(std::uint64_t) );
+	    }
+	    height( n ) = h;
+	    return n;
+	}
+
+	void release( node_ptr n ) {
+	    persistent_header * hdr( header() );
+	    unsigned int h( height( n ) );
+	    link( n, 0 ) = hdr->m_free[h];
+	    persist( &link( n, 0 ), sizeof(std::uint64_t) );
+	    hdr->m_free[h] = n;
+	    persist( &hdr->m_free[h], sizeof(std::uint64_t) );
+	}
+
+	void grow( std::size_t need ) {
+	    std::size_t size( m_mapped * 2 );
+	    while( size < need ) size *= 2;
+	    if( ::ftruncate( m_fd, size ) != 0 ) fail( "ftruncate" );
+	    void * p( ::mremap( m_base, m_mapped, size, MREMAP_MAYMOVE ) );
+	    if( p == MAP_FAILED ) fail( "mremap" );
+	    m_base = static_cast<unsigned char *>( p );
+	    m_mapped = size;
+	}
+
+	void map( std::size_t size ) {
+	    void * p( ::mmap( 0, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0 ) );
+	    if( p == MAP_FAILED ) fail( "mmap" );
+	    m_base = static_cast<unsigned char *>( p );
+	    m_mapped = size;
+	}
+
+	void create() {
+	    if( ::ftruncate( m_fd, initial_size ) != 0 ) fail( "ftruncate" );
+	    map( initial_size );
+	    persistent_header * hdr( header() );
+	    std::memset( static_cast<void *>( hdr ), 0, sizeof(persistent_header) );
+	    hdr->m_value_size = sizeof(value_type);
+	    hdr->m_value_align = alignof(value_type);
+	    hdr->m_maxheight = maxheight;
+	    hdr->m_height = 1;
+	    hdr->m_head = ( sizeof(persistent_header) + 7 ) & ~std::size_t( 7 );
+	    hdr->m_used = hdr->m_head + node_size( maxheight );
+	    height( hdr->m_head ) = maxheight;
+	    for( unsigned int i(0); i<maxheight; ++i ) {
+		link( hdr->m_head, i ) = 0;
+	    }
+	    // The magic goes last; a file without it is just garbage.
+	    ::msync( m_base, m_mapped, MS_SYNC );
+	    std::memcpy( hdr->m_magic, "SKIPLST1", 8 );
+	    ::msync( m_base, m_mapped, MS_SYNC );
+	}
+
+	void attach( std::size_t size ) {
+	    if( size < sizeof(persistent_header) ) {
+		throw std::runtime_error( "skip::persistent_map: file too short" );
+	    }
+	    map( size );
+	    persistent_header * hdr( header() );
+	    if( std::memcmp( hdr->m_magic, "SKIPLST1", 8 ) != 0 ) {
+		throw std::runtime_error( "skip::persistent_map: not a skiplist file" );
+	    }
+	    if( hdr->m_value_size != sizeof(value_type) || hdr->m_value_align != alignof(value_type) || hdr->m_maxheight != maxheight ) {
+		throw std::runtime_error( "skip::persistent_map: file holds a different type" );
+	    }
+	    if( hdr->m_used > size || hdr->m_height == 0 || hdr->m_height > maxheight ) {
+		throw std::runtime_error( "skip::persistent_map: file is damaged" );
+	    }
+	    if( !hdr->m_clean ) {
+		// Not closed properly: level 0 is right, the count may not be.
+		std::uint64_t count( 0 );
+		for( node_ptr n( first() ); n; n = next( n ) ) {
+		    ++count;
+		}
+		hdr->m_size = count;
+	    }
+	    hdr->m_clean = 0;
+	    persist( &hdr->m_clean, sizeof(hdr->m_clean) );
+	}
+    };
+
+    /*
+      Map kept in a file. Opening an existing file maps it in place; no
+      rebuild. Mapped values may be changed through iterators, but such
+      changes aren't ordered against a crash. Iterators hold offsets
+      into the file and stay valid until their entry is erased, but an
+      insert may grow the file and move the mapping, so references and
+      pointers from operator*, operator-> and operator[] last only until
+      the next insert.
+    */
+    template< typename K, typename V, typename L=std::less<K> > class persistent_map : private PersistentSkiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L> {
+    public:
+	typedef PersistentSkiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L> parent_type;
+	typedef typename parent_type::value_type value_type;
+	typedef typename parent_type::key_type key_type;
+	typedef typename parent_type::node_ptr node_ptr;
+	typedef V mapped_type;
+
+	class iterator {
+	    parent_type const * m_list;
+	    node_ptr m_node;
+	public:
+	    typedef typename parent_type::value_type value_type;
+	    typedef value_type & reference;
+	    typedef value_type * pointer;
+	    typedef std::ptrdiff_t difference_type;
+	    typedef std::forward_iterator_tag iterator_category;
+
+	    iterator( parent_type const * l, node_ptr n ) : m_list( l ), m_node( n ) {
+	    }
+	    iterator & operator++() {
+		m_node = m_list->next( m_node );
+		return *this;
+	    }
+	    iterator operator++( int ) {
+		iterator tmp( *this );
+		++*this;
+		return tmp;
+	    }
+	    reference operator*() const {
+		return m_list->value( m_node );
+	    }
+	    pointer operator->() const {
+		return &m_list->value( m_node );
+	    }
+	    bool operator==( iterator const & i ) const {
+		return m_node==i.m_node;
+	    }
+	    bool operator!=( iterator const & i ) const {
+		return m_node!=i.m_node;
+	    }
+	};
+	typedef iterator const_iterator;
+
+	explicit persistent_map( const L& comp=L() ) : parent_type( comp ) {}
+	explicit persistent_map( char const * path, bool durable=false, const L& comp=L() ) : parent_type( comp ) {
+	    this->open( path, durable );
+	}
+
+	using parent_type::open;
+	using parent_type::close;
+	using parent_type::is_open;
+	using parent_type::sync;
+	using parent_type::size;
+	using parent_type::clear;
+
+	bool empty() const {
+	    return size() == 0;
+	}
+
+	iterator begin() const {
+	    return iterator( this, this->first() );
+	}
+	iterator end() const {
+	    return iterator( this, 0 );
+	}
+
+	iterator find( key_type const & k ) const {
+	    return iterator( this, this->find_node( k ) );
+	}
+	iterator lower_bound( key_type const & k ) const {
+	    return iterator( this, parent_type::lower_bound( k ) );
+	}
+	std::size_t count( key_type const & k ) const {
+	    return this->find_node( k ) ? 1 : 0;
+	}
+
+	std::pair<iterator,bool> insert( value_type const & v ) {
+	    std::pair<node_ptr,bool> r( this->insert_node( v ) );
+	    return std::make_pair( iterator( this, r.first ), r.second );
+	}
+
+	// The reference dies with the next insert: m[a] = m[b] may read b from an old mapping.
+	mapped_type & operator[]( key_type const & k ) {
+	    return this->value( this->insert_node( value_type( k, mapped_type() ) ).first ).second;
+	}
+
+	std::size_t erase( key_type const & k ) {
+	    return this->erase_node( k );
+	}
+    };
+}
+
+#endif
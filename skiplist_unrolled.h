@@ -0,0 +1,749 @@
+// -*- C++ -*-
+
+// Copyright 2004-2006 Dave Cridland <dave@cridland.net>
+
+#ifndef SKIPLIST_UNROLLED_H
+#define SKIPLIST_UNROLLED_H
+
+#include "skiplist.h"
+#include <functional>
+#include <limits>
+#include <type_traits>
+#include <iterator>
+#include <new>
+
+namespace skip {
+    /*
+      Dense copy of a block's keys, for arithmetic keys under std::less.
+      Unused slots hold the largest value, so a lower bound is a
+      branch-free count over the whole block, which the compiler turns
+      into vector compares. Other key types search the entries directly.
+    */
+    template< typename K, typename L, unsigned int B, bool D = std::is_arithmetic<K>::value && std::is_same< L, std::less<K> >::value > class UnrolledKeys {
+    public:
+	static const bool dense = false;
+	void set( unsigned int, K const & ) {}
+	void clear( unsigned int ) {}
+	unsigned int lower( K const &, unsigned int ) const { return 0; }
+    };
+
+    template< typename K, typename L, unsigned int B > class UnrolledKeys<K,L,B,true> {
+	K m_keys[B];
+	static K top() {
+	    return std::numeric_limits<K>::has_infinity ? std::numeric_limits<K>::infinity() : std::numeric_limits<K>::max();
+	}
+    public:
+	static const bool dense = true;
+	void set( unsigned int i, K const & k ) {
+	    m_keys[i] = k;
+	}
+	void clear( unsigned int i ) {
+	    m_keys[i] = top();
+	}
+	unsigned int lower( K const & k, unsigned int ) const {
+	    unsigned int n( 0 );
+	    for( unsigned int i(0); i<B; ++i ) {
+		n += ( m_keys[i] < k );
+	    }
+	    return n;
+	}
+    };
+
+    /*
+      Node of an unrolled skiplist: a sorted block of up to B entries,
+      with one tower for the lot. The block is ordered against its
+      neighbours by its first key.
+    */
+    template< typename V, typename KS, unsigned int B >
+    class UnrolledNode {
+    public:
+	typedef V value_type;
+	typedef UnrolledNode<V,KS,B> my_type;
+    private:
+	unsigned int m_count;
+	unsigned int m_height;
+	my_type * m_prev;
+	KS m_keys;
+	typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type m_values[B];
+	my_type * m_ptrs[1];
+
+	// Unimplemented:
+	UnrolledNode( UnrolledNode const & );
+	UnrolledNode & operator = ( UnrolledNode const & );
+
+    public:
+	UnrolledNode( unsigned int h ) : m_count( 0 ), m_height( h ), m_prev( 0 ) {
+	    for( unsigned int i(0); i<B; ++i ) {
+		m_keys.clear( i );
+	    }
+	    for( unsigned int i(0); i<m_height; ++i ) {
+		m_ptrs[i] = 0;
+	    }
+	}
+
+	inline my_type *& operator[]( int i ) {
+	    return m_ptrs[i];
+	}
+	inline my_type *& prev() {
+	    return m_prev;
+	}
+	inline unsigned int height() const {
+	    return m_height;
+	}
+	inline unsigned int & count() {
+	    return m_count;
+	}
+	inline KS & keys() {
+	    return m_keys;
+	}
+	inline value_type & value( unsigned int i ) {
+	    return *reinterpret_cast<value_type *>( &m_values[i] );
+	}
+	inline value_type * value_ptr( unsigned int i ) {
+	    return reinterpret_cast<value_type *>( &m_values[i] );
+	}
+
+	static inline std::size_t alloc_size( unsigned int h ) {
+	    return sizeof(my_type) + ( h - 1 ) * sizeof(my_type *);
+	}
+    };
+
+    /*
+      Iterator over an unrolled skiplist: a block and a slot in it.
+      Like a vector's, it is invalidated by inserts and erases that
+      shuffle its block.
+    */
+    template<typename N, typename IV> class unrolled_iterator {
+    private:
+	N * m_node;
+	unsigned int m_index;
+	N * const * m_tail;
+    public:
+	typedef IV value_type;
+	typedef IV & reference;
+	typedef IV * pointer;
+	typedef std::ptrdiff_t difference_type;
+	typedef std::bidirectional_iterator_tag iterator_category;
+
+	unrolled_iterator( N * n, unsigned int i, N * const * tail ) : m_node( n ), m_index( i ), m_tail( tail ) {
+	}
+	template<typename IVX> unrolled_iterator( unrolled_iterator<N,IVX> const & m ) : m_node( m.priv_node() ), m_index( m.priv_index() ), m_tail( m.priv_tail() ) {
+	}
+	unrolled_iterator & operator++() {
+	    if( ++m_index == m_node->count() ) {
+		m_node = (*m_node)[0];
+		m_index = 0;
+	    }
+	    return *this;
+	}
+	unrolled_iterator & operator--() {
+	    if( !m_node ) {
+		m_node = *m_tail;
+		m_index = m_node->count();
+	    } else if( !m_index ) {
+		m_node = m_node->prev();
+		m_index = m_node->count();
+	    }
+	    --m_index;
+	    return *this;
+	}
+	IV & operator*() const {
+	    return m_node->value( m_index );
+	}
+	IV * operator->() const {
+	    return m_node->value_ptr( m_index );
+	}
+	bool operator==( unrolled_iterator const & i ) const {
+	    return m_node==i.m_node && m_index==i.m_index;
+	}
+	bool operator!=( unrolled_iterator const & i ) const {
+	    return !( *this == i );
+	}
+
+	N * priv_node() const {
+	    return m_node;
+	}
+	unsigned int priv_index() const {
+	    return m_index;
+	}
+	N * const * priv_tail() const {
+	    return m_tail;
+	}
+    };
+
+    // About two cache lines of keys, within sensible bounds.
+    template< typename K > struct unrolled_capacity {
+	static const unsigned int value = 128 / sizeof(K) < 8 ? 8 : ( 128 / sizeof(K) > 64 ? 64 : 128 / sizeof(K) );
+    };
+
+    /*
+      Skiplist of blocks. A descent compares against the first key of
+      each block, so it takes one miss per block rather than per entry;
+      the last step is a search within a block that's already in cache.
+      Full blocks split in half - except at the very end, where appends
+      start a fresh block so that ascending keys pack densely - and
+      blocks that drop below a quarter full absorb their successor.
+      Keys are unique.
+    */
+    template< typename K, typename V, typename X, typename L, typename A, unsigned int B > class UnrolledSkiplist {
+    public:
+	typedef K key_type;
+	typedef V value_type;
+	typedef X extract_key;
+	typedef L key_compare;
+	typedef A allocator_type;
+	typedef UnrolledSkiplist<K,V,X,L,A,B> my_type;
+	typedef UnrolledKeys<K,L,B> keys_type;
+	typedef UnrolledNode<value_type,keys_type,B> node_type;
+	typedef typename allocator_type::template rebind< unsigned char >::other raw_allocator;
+	typedef node_type * node_ptr;
+	typedef typename allocator_type::size_type size_type;
+	typedef unrolled_iterator<node_type,value_type> iterator;
+	typedef unrolled_iterator<node_type,value_type const> const_iterator;
+	typedef std::reverse_iterator<iterator> reverse_iterator;
+	typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+	static const unsigned int maxheight = 32;
+	static const unsigned int capacity = B;
+    private:
+	raw_allocator m_alloc;
+	node_ptr m_head;
+	node_ptr m_tail;
+	key_compare m_comp;
+	std::size_t m_size;
+	unsigned int m_level;
+	std::uint64_t m_rng;
+
+	// Unimplemented:
+	UnrolledSkiplist( my_type const & );
+	my_type & operator=( my_type const & );
+
+    public:
+	UnrolledSkiplist( L const & l, A const & a ) : m_alloc( a ), m_head( new_node( maxheight ) ), m_tail( 0 ), m_comp( l ), m_size( 0 ), m_level( 1 ), m_rng( 0x9E3779B97F4A7C15ull ) {
+	}
+	virtual ~UnrolledSkiplist() {
+	    clear();
+	    destroy_node( m_head );
+	}
+
+    private:
+	unsigned int pickheight() {
+	    m_rng ^= m_rng >> 12;
+	    m_rng ^= m_rng << 25;
+	    m_rng ^= m_rng >> 27;
+	    unsigned int h( 1 + __builtin_clzll( ( m_rng * 0x2545F4914F6CDD1Dull ) | 1 ) / 2 );
+	    return h > maxheight ? maxheight : h;
+	}
+
+	node_ptr new_node( unsigned int height ) {
+	    unsigned char * p( &*m_alloc.allocate( node_type::alloc_size( height ) ) );
+	    new( p ) node_type( height );
+	    return reinterpret_cast<node_ptr>( p );
+	}
+	void destroy_node( node_ptr p ) {
+	    std::size_t octets( node_type::alloc_size( p->height() ) );
+	    p->~node_type();
+	    m_alloc.deallocate( reinterpret_cast<unsigned char *>( p ), octets );
+	}
+
+	K const & key( node_ptr n, unsigned int i ) const {
+	    return extract_key()( n->value( i ) );
+	}
+
+	// Number of entries in n less than k.
+	unsigned int position( node_ptr n, K const & k ) const {
+	    if( keys_type::dense ) {
+		return n->keys().lower( k, n->count() );
+	    }
+	    unsigned int lo( 0 ), hi( n->count() );
+	    while( lo < hi ) {
+		unsigned int mid( ( lo + hi ) / 2 );
+		if( m_comp( key( n, mid ), k ) ) {
+		    lo = mid + 1;
+		} else {
+		    hi = mid;
+		}
+	    }
+	    return lo;
+	}
+
+	// The last block whose first key is less than k, or the head.
+	node_ptr find_block( K const & k, node_ptr update[] = 0 ) const {
+	    node_ptr current( m_head );
+	    if( update ) {
+		for( unsigned int i(m_level); i<maxheight; ++i ) {
+		    update[i] = m_head;
+		}
+	    }
+	    for( unsigned int i(m_level-1);; --i ) {
+		node_ptr next( (*current)[i] );
+		while( next && m_comp( key( next, 0 ), k ) ) {
+		    current = next;
+		    next = (*current)[i];
+		}
+		if( update ) {
+		    update[i] = current;
+		}
+		if( 0==i ) break;
+	    }
+	    return current;
+	}
+
+	// Fills update[] with the last block at each level, or the head.
+	void find_end( node_ptr update[] ) const {
+	    node_ptr current( m_head );
+	    for( unsigned int i(maxheight-1);; --i ) {
+		while( node_ptr next = (*current)[i] ) {
+		    current = next;
+		}
+		update[i] = current;
+		if( 0==i ) break;
+	    }
+	}
+
+	// The block and slot of the first entry not less than k; a null block for the end.
+	std::pair<node_ptr,unsigned int> locate( K const & k ) const {
+	    node_ptr t( find_block( k ) );
+	    unsigned int p( t == m_head ? 0 : position( t, k ) );
+	    if( t == m_head || p == t->count() ) {
+		return std::make_pair( (*t)[0], 0u );
+	    }
+	    return std::make_pair( t, p );
+	}
+
+	template< typename VV > void put( node_ptr n, unsigned int i, VV && v ) {
+	    new( n->value_ptr( i ) ) value_type( std::forward<VV>( v ) );
+	    n->keys().set( i, key( n, i ) );
+	}
+	// Moves entry from of a into slot to of b, which must be empty.
+	void move( node_ptr a, unsigned int from, node_ptr b, unsigned int to ) {
+	    new( b->value_ptr( to ) ) value_type( std::move( a->value( from ) ) );
+	    a->value( from ).~value_type();
+	    b->keys().set( to, key( b, to ) );
+	    a->keys().clear( from );
+	}
+
+	// Links n after t, with preds from update[] above t's own height.
+	void link_after( node_ptr t, node_ptr n, node_ptr update[] ) {
+	    for( unsigned int i(0); i<n->height(); ++i ) {
+		node_ptr pred( t->height() > i ? t : update[i] );
+		(*n)[i] = (*pred)[i];
+		(*pred)[i] = n;
+	    }
+	    if( n->height() > m_level ) {
+		m_level = n->height();
+	    }
+	    n->prev() = ( t == m_head ) ? node_ptr() : t;
+	    if( (*n)[0] ) {
+		(*n)[0]->prev() = n;
+	    } else {
+		m_tail = n;
+	    }
+	}
+
+	// n must still hold its first entry.
+	void unlink( node_ptr n ) {
+	    node_ptr update[maxheight];
+	    find_block( key( n, 0 ), update );
+	    for( unsigned int i(0); i<n->height(); ++i ) {
+		(*update[i])[i] = (*n)[i];
+	    }
+	    if( (*n)[0] ) {
+		(*n)[0]->prev() = n->prev();
+	    } else {
+		m_tail = n->prev();
+	    }
+	}
+
+	/*
+	  Puts v in at slot p of t, splitting t first if it's full.
+	  update[] holds t's predecessors, as find_block leaves them for
+	  any key in t; if null, they're found only should t split.
+	*/
+	template< typename VV > iterator insert_at( node_ptr t, unsigned int p, VV && v, node_ptr update[] ) {
+	    node_ptr path[maxheight];
+	    if( t->count() == B ) {
+		if( !update ) {
+		    find_block( key( t, 0 ), path );
+		    update = path;
+		}
+		node_ptr n( new_node( pickheight() ) );
+		if( p == B && !(*t)[0] ) {
+		    // Appending: start afresh rather than leave t half empty.
+		    t = n;
+		    p = 0;
+		    link_after( m_tail, n, update );
+		} else {
+		    for( unsigned int i(B/2); i<B; ++i ) {
+			move( t, i, n, i - B/2 );
+		    }
+		    t->count() = B/2;
+		    n->count() = B - B/2;
+		    link_after( t, n, update );
+		    if( p > B/2 ) {
+			t = n;
+			p -= B/2;
+		    }
+		}
+	    }
+	    for( unsigned int i( t->count() ); i>p; --i ) {
+		move( t, i-1, t, i );
+	    }
+	    put( t, p, std::forward<VV>( v ) );
+	    ++t->count();
+	    ++m_size;
+	    return iterator( t, p, &m_tail );
+	}
+
+	// Erases slot p of t; returns where the entry after it ends up.
+	iterator erase_at( node_ptr t, unsigned int p ) {
+	    --m_size;
+	    if( t->count() == 1 ) {
+		node_ptr next( (*t)[0] );
+		unlink( t );
+		t->value( 0 ).~value_type();
+		destroy_node( t );
+		return iterator( next, 0, &m_tail );
+	    }
+	    t->value( p ).~value_type();
+	    t->keys().clear( p );
+	    for( unsigned int i(p+1); i<t->count(); ++i ) {
+		move( t, i, t, i-1 );
+	    }
+	    --t->count();
+	    node_ptr n( (*t)[0] );
+	    if( n && t->count() < B/4 && t->count() + n->count() <= B/2 ) {
+		unlink( n );
+		for( unsigned int i(0); i<n->count(); ++i ) {
+		    move( n, i, t, t->count() + i );
+		}
+		t->count() += n->count();
+		destroy_node( n );
+	    }
+	    if( p == t->count() ) {
+		return iterator( (*t)[0], 0, &m_tail );
+	    }
+	    return iterator( t, p, &m_tail );
+	}
+
+    public:
+	template< typename VV > std::pair<bool,iterator> insert_node( VV && v ) {
+	    node_ptr update[maxheight];
+	    K const & k( extract_key()( v ) );
+	    if( m_tail && m_tail->count() < B && m_comp( key( m_tail, m_tail->count() - 1 ), k ) ) {
+		// Room at the very end; no need to look.
+		unsigned int p( m_tail->count()++ );
+		put( m_tail, p, std::forward<VV>( v ) );
+		++m_size;
+		return std::make_pair( true, iterator( m_tail, p, &m_tail ) );
+	    }
+	    node_ptr t( find_block( k, update ) );
+	    if( t == m_head ) {
+		t = (*m_head)[0];
+		if( !t ) {
+		    t = new_node( pickheight() );
+		    put( t, 0, std::forward<VV>( v ) );
+		    ++t->count();
+		    link_after( m_head, t, update );
+		    ++m_size;
+		    return std::make_pair( true, iterator( t, 0, &m_tail ) );
+		}
+	    }
+	    unsigned int p( position( t, k ) );
+	    if( p < t->count() ) {
+		if( !m_comp( k, key( t, p ) ) ) {
+		    return std::make_pair( false, iterator( t, p, &m_tail ) );
+		}
+	    } else if( node_ptr n = (*t)[0] ) {
+		if( !m_comp( k, key( n, 0 ) ) ) {
+		    return std::make_pair( false, iterator( n, 0, &m_tail ) );
+		}
+	    }
+	    return std::make_pair( true, insert_at( t, p, std::forward<VV>( v ), update ) );
+	}
+
+	/*
+	  Puts v in just before the entry at slot p of t - or at the end,
+	  if t is null - when its key belongs there: at the end of the
+	  block before, if that has room, else in the hint's own block.
+	  There's no search unless the block must split. A key that
+	  belongs elsewhere is inserted as usual.
+	*/
+	template< typename VV > std::pair<bool,iterator> insert_hint_node( node_ptr t, unsigned int p, VV && v ) {
+	    if( !m_tail ) {
+		return insert_node( std::forward<VV>( v ) );
+	    }
+	    K const & k( extract_key()( v ) );
+	    if( t && !m_comp( k, key( t, p ) ) ) {
+		if( !m_comp( key( t, p ), k ) ) {
+		    return std::make_pair( false, iterator( t, p, &m_tail ) );
+		}
+		return insert_node( std::forward<VV>( v ) );
+	    }
+	    // The entry before the hint, if there is one, is slot pp-1 of pt.
+	    node_ptr pt( t ? t : m_tail );
+	    unsigned int pp( t ? p : m_tail->count() );
+	    if( !pp && ( pt = pt->prev() ) ) {
+		pp = pt->count();
+	    }
+	    if( pt && !m_comp( key( pt, pp-1 ), k ) ) {
+		if( !m_comp( k, key( pt, pp-1 ) ) ) {
+		    return std::make_pair( false, iterator( pt, pp-1, &m_tail ) );
+		}
+		return insert_node( std::forward<VV>( v ) );
+	    }
+	    if( pt && pt->count() < B ) {
+		t = pt;
+		p = pp;
+	    } else if( !t ) {
+		t = m_tail;
+		p = t->count();
+	    }
+	    return std::make_pair( true, insert_at( t, p, std::forward<VV>( v ), 0 ) );
+	}
+
+	/*
+	  Inserts [first,last). Keys past the end go straight onto the
+	  tail, new blocks being linked from the last block at each level,
+	  so sorted input is built without a single search; others are
+	  inserted as usual.
+	*/
+	template< typename I > void insert_range( I first, I last ) {
+	    node_ptr path[maxheight];
+	    bool ready( false );
+	    for( ; first!=last; ++first ) {
+		// Converted once, should the input be of some other type.
+		value_type const & v( *first );
+		if( m_tail && !m_comp( key( m_tail, m_tail->count() - 1 ), extract_key()( v ) ) ) {
+		    insert_node( v );
+		    // That may have added a block that's last at some level.
+		    ready = false;
+		    continue;
+		}
+		if( m_tail && m_tail->count() < B ) {
+		    put( m_tail, m_tail->count()++, v );
+		} else {
+		    if( !ready ) {
+			find_end( path );
+			ready = true;
+		    }
+		    node_ptr n( new_node( pickheight() ) );
+		    put( n, 0, v );
+		    ++n->count();
+		    link_after( m_tail ? m_tail : m_head, n, path );
+		    for( unsigned int i(0); i<n->height(); ++i ) {
+			path[i] = n;
+		    }
+		}
+		++m_size;
+	    }
+	}
+
+	size_type erase_node( K const & k ) {
+	    std::pair<node_ptr,unsigned int> at( locate( k ) );
+	    if( !at.first || m_comp( k, key( at.first, at.second ) ) ) {
+		return 0;
+	    }
+	    erase_at( at.first, at.second );
+	    return 1;
+	}
+	iterator erase_node( const_iterator i ) {
+	    return erase_at( i.priv_node(), i.priv_index() );
+	}
+	// Entries shift as they go, so last is held by its key.
+	iterator erase_node( const_iterator first, const_iterator last ) {
+	    iterator i( first.priv_node(), first.priv_index(), &m_tail );
+	    if( !last.priv_node() ) {
+		while( i != end() ) {
+		    i = erase_at( i.priv_node(), i.priv_index() );
+		}
+		return i;
+	    }
+	    K const k( key( last.priv_node(), last.priv_index() ) );
+	    while( m_comp( key( i.priv_node(), i.priv_index() ), k ) ) {
+		i = erase_at( i.priv_node(), i.priv_index() );
+	    }
+	    return i;
+	}
+
+	void clear() {
+	    node_ptr current( (*m_head)[0] );
+	    while( current ) {
+		node_ptr next( (*current)[0] );
+		for( unsigned int i(0); i<current->count(); ++i ) {
+		    current->value( i ).~value_type();
+		}
+		destroy_node( current );
+		current = next;
+	    }
+	    for( unsigned int i(0); i<maxheight; ++i ) {
+		(*m_head)[i] = 0;
+	    }
+	    m_tail = 0;
+	    m_size = 0;
+	    m_level = 1;
+	}
+
+	iterator lower_bound( key_type const & k ) {
+	    std::pair<node_ptr,unsigned int> at( locate( k ) );
+	    return iterator( at.first, at.second, &m_tail );
+	}
+	const_iterator lower_bound( key_type const & k ) const {
+	    std::pair<node_ptr,unsigned int> at( locate( k ) );
+	    return const_iterator( at.first, at.second, &m_tail );
+	}
+	iterator upper_bound( key_type const & k ) {
+	    iterator i( lower_bound( k ) );
+	    if( i != end() && !m_comp( k, extract_key()( *i ) ) ) ++i;
+	    return i;
+	}
+	const_iterator upper_bound( key_type const & k ) const {
+	    const_iterator i( lower_bound( k ) );
+	    if( i != end() && !m_comp( k, extract_key()( *i ) ) ) ++i;
+	    return i;
+	}
+	iterator search( key_type const & k ) {
+	    iterator i( lower_bound( k ) );
+	    if( i != end() && m_comp( k, extract_key()( *i ) ) ) return end();
+	    return i;
+	}
+	const_iterator search( key_type const & k ) const {
+	    const_iterator i( lower_bound( k ) );
+	    if( i != end() && m_comp( k, extract_key()( *i ) ) ) return end();
+	    return i;
+	}
+	// Whether i, a lower bound for k, points at k itself.
+	bool holds( const_iterator i, key_type const & k ) const {
+	    return i != end() && !m_comp( k, extract_key()( *i ) );
+	}
+
+	size_type size() const {
+	    return m_size;
+	}
+
+	iterator begin() {
+	    return iterator( (*m_head)[0], 0, &m_tail );
+	}
+	const_iterator begin() const {
+	    return const_iterator( (*m_head)[0], 0, &m_tail );
+	}
+	iterator end() {
+	    return iterator( node_ptr(), 0, &m_tail );
+	}
+	const_iterator end() const {
+	    return const_iterator( node_ptr(), 0, &m_tail );
+	}
+	reverse_iterator rbegin() {
+	    return reverse_iterator( end() );
+	}
+	const_reverse_iterator rbegin() const {
+	    return const_reverse_iterator( end() );
+	}
+	reverse_iterator rend() {
+	    return reverse_iterator( begin() );
+	}
+	const_reverse_iterator rend() const {
+	    return const_reverse_iterator( begin() );
+	}
+    };
+
+    /*
+      Map over an unrolled skiplist. The interface is skip::map's, less
+      the positional, batch, split and parallel operations. Entries
+      move between slots as blocks fill and empty, so - as with a
+      vector - inserts and erases invalidate iterators and references.
+    */
+    template< typename K, typename V, typename L=std::less<K>, typename A=std::allocator< std::pair<K const,V> >, unsigned int B=unrolled_capacity<K>::value > class unrolled_map : private UnrolledSkiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L,A,B> {
+    public:
+	typedef UnrolledSkiplist<K,std::pair<const K,V>,ExtractFirst<K,V>,L,A,B> parent_type;
+	typedef typename parent_type::iterator iterator;
+	typedef typename parent_type::const_iterator const_iterator;
+	typedef typename parent_type::reverse_iterator reverse_iterator;
+	typedef typename parent_type::const_reverse_iterator const_reverse_iterator;
+	typedef typename parent_type::value_type value_type;
+	typedef typename parent_type::key_type key_type;
+	typedef V mapped_type;
+	explicit unrolled_map( const L& comp=L(), const A& alloc=A() ) : parent_type( comp, alloc ) {}
+	// Sorted input is appended block by block, without searching.
+	template< typename I > unrolled_map( I first, I last, const L& comp=L(), const A& alloc=A() )
+	    : parent_type( comp, alloc ) {
+		this->insert_range( first, last );
+	    }
+
+	// Both const and non-const forms:
+	using parent_type::begin;
+	using parent_type::end;
+	using parent_type::rbegin;
+	using parent_type::rend;
+	using parent_type::lower_bound;
+	using parent_type::upper_bound;
+	// And these:
+	using parent_type::size;
+	using parent_type::clear;
+
+	bool empty() const {
+	    return size() == 0;
+	}
+
+	// One search; on a miss, the entry goes in where it found.
+	V & operator[]( const K & k ) {
+	    iterator i( lower_bound( k ) );
+	    if( !this->holds( i, k ) ) {
+		i = this->insert_hint_node( i.priv_node(), i.priv_index(), value_type( k, V() ) ).second;
+	    }
+	    return (*i).second;
+	}
+
+	iterator find( const K & k ) {
+	    return this->search( k );
+	}
+	const_iterator find( const K & k ) const {
+	    return this->search( k );
+	}
+	std::size_t count( const K & k ) const {
+	    return this->search( k ) != end();
+	}
+
+	std::pair<bool,iterator> insert( value_type const & v ) {
+	    return this->insert_node( v );
+	}
+	std::pair<bool,iterator> insert( value_type && v ) {
+	    return this->insert_node( std::move( v ) );
+	}
+	// Hinted inserts go straight in before the hint, if the key belongs there.
+	iterator insert( const_iterator hint, value_type const & v ) {
+	    return this->insert_hint_node( hint.priv_node(), hint.priv_index(), v ).second;
+	}
+	iterator insert( const_iterator hint, value_type && v ) {
+	    return this->insert_hint_node( hint.priv_node(), hint.priv_index(), std::move( v ) ).second;
+	}
+	template< typename I > void insert( I first, I last ) {
+	    this->insert_range( first, last );
+	}
+	template< typename... Args > std::pair<bool,iterator> emplace( Args&&... args ) {
+	    return this->insert_node( value_type( std::forward<Args>( args )... ) );
+	}
+	template< typename... Args > iterator emplace_hint( const_iterator hint, Args&&... args ) {
+	    return this->insert_hint_node( hint.priv_node(), hint.priv_index(), value_type( std::forward<Args>( args )... ) ).second;
+	}
+	// Leave args alone if k is already there.
+	template< typename... Args > std::pair<bool,iterator> try_emplace( const K & k, Args&&... args ) {
+	    iterator i( lower_bound( k ) );
+	    if( this->holds( i, k ) ) {
+		return std::make_pair( false, i );
+	    }
+	    return this->insert_hint_node( i.priv_node(), i.priv_index(), value_type( std::piecewise_construct, std::forward_as_tuple( k ), std::forward_as_tuple( std::forward<Args>( args )... ) ) );
+	}
+
+	std::size_t erase( key_type const & k ) {
+	    return this->erase_node( k );
+	}
+	iterator erase( const_iterator i ) {
+	    return this->erase_node( i );
+	}
+	iterator erase( const_iterator first, const_iterator last ) {
+	    return this->erase_node( first, last );
+	}
+    };
+}
+
+#endif
@@ -0,0 +1,267 @@
+// Copyright 2004-2006 Dave Cridland <dave@cridland.net>
+
+// skip::concurrent_map from several threads at once: disjoint inserts
+// must all land, and under mixed inserts and erases on shared keys the
+// successful calls must account for the size and for what for_each
+// sees. Then skip::maps split from one another, and so sharing a node
+// pool, are each worked on by a thread of their own while other maps
+// join them, taking their pool over, and while a split-off half is
+// deleted on yet another thread. Last, skip::mvcc_map lookups of keys
+// that are always present, while a writer keeps replacing their values,
+// must never miss. Exits non-zero on the first fault.
+// Usage: skiplist-threads [threads [split-rounds [mvcc-reads]]]
+
+#define SK_DEBUG_CHECK
+#include "skiplist_concurrent.h"
+#include "skiplist_mvcc.h"
+#include <map>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdint>
+
+namespace {
+    typedef skip::concurrent_map<long,long> cmap;
+
+    class rng {
+	std::uint64_t m_state;
+    public:
+	rng( std::uint64_t seed ) : m_state( seed * 0x9E3779B97F4A7C15ull + 1 ) {}
+	std::uint64_t operator()() {
+	    m_state ^= m_state << 13;
+	    m_state ^= m_state >> 7;
+	    m_state ^= m_state << 17;
+	    return m_state;
+	}
+    };
+
+    void require( bool ok, char const * what ) {
+	if( !ok ) {
+	    throw std::runtime_error( what );
+	}
+    }
+
+    // Counts entries, and whether they come in strictly ascending order.
+    class walk {
+	std::size_t & m_count;
+	bool & m_ordered;
+	long & m_last;
+    public:
+	walk( std::size_t & count, bool & ordered, long & last ) : m_count( count ), m_ordered( ordered ), m_last( last ) {}
+	void operator()( cmap::value_type const & v ) {
+	    if( m_count && v.first <= m_last ) m_ordered = false;
+	    m_last = v.first;
+	    ++m_count;
+	}
+    };
+
+    std::size_t walked( cmap const & m ) {
+	std::size_t count( 0 );
+	bool ordered( true );
+	long last( 0 );
+	m.for_each( walk( count, ordered, last ) );
+	require( ordered, "for_each went out of order" );
+	return count;
+    }
+
+    // Thread t owns the keys congruent to t.
+    void disjoint( cmap * m, unsigned int t, unsigned int threads, long per, unsigned long * failed ) {
+	unsigned long f( 0 );
+	for( long i(0); i<per; ++i ) {
+	    long k( i * threads + t );
+	    if( !m->insert( std::make_pair( k, -k ) ) ) ++f;
+	}
+	*failed = f;
+    }
+
+    void run_disjoint( unsigned int threads ) {
+	const long per( 20000 );
+	cmap m;
+	std::vector<std::thread> pool;
+	std::vector<unsigned long> failed( threads );
+	for( unsigned int t(0); t<threads; ++t ) {
+	    pool.push_back( std::thread( disjoint, &m, t, threads, per, &failed[t] ) );
+	}
+	for( unsigned int t(0); t<threads; ++t ) {
+	    pool[t].join();
+	    require( failed[t] == 0, "an insert of a new key failed" );
+	}
+	require( m.size() == static_cast<std::size_t>( per * threads ), "size differs from the inserts" );
+	require( walked( m ) == m.size(), "for_each count differs from size" );
+	for( long k(0); k<per*threads; ++k ) {
+	    long v( 0 );
+	    require( m.find( k, v ) && v == -k, "an inserted key is missing" );
+	}
+	std::cout << "disjoint\t" << threads << "\tok" << std::endl;
+    }
+
+    // Every thread works over the same small range, so most calls collide.
+    void mixed( cmap * m, unsigned int t, unsigned long ops, long * net ) {
+	rng r( t + 1 );
+	long n( 0 );
+	for( unsigned long i(0); i<ops; ++i ) {
+	    long k( r() % 512 );
+	    if( r() & 1 ) {
+		if( m->insert( std::make_pair( k, k ) ) ) ++n;
+	    } else {
+		if( m->erase( k ) ) --n;
+	    }
+	}
+	*net = n;
+    }
+
+    void run_mixed( unsigned int threads ) {
+	cmap m;
+	std::vector<std::thread> pool;
+	std::vector<long> net( threads );
+	for( unsigned int t(0); t<threads; ++t ) {
+	    pool.push_back( std::thread( mixed, &m, t, 200000, &net[t] ) );
+	}
+	long total( 0 );
+	for( unsigned int t(0); t<threads; ++t ) {
+	    pool[t].join();
+	    total += net[t];
+	}
+	require( total >= 0 && static_cast<std::size_t>( total ) == m.size(), "inserts less erases differs from size" );
+	require( walked( m ) == m.size(), "for_each count differs from size" );
+	std::cout << "mixed\t" << threads << "\tok\t" << m.size() << " left" << std::endl;
+    }
+
+    typedef skip::map<long,long> smap;
+    typedef std::map<long,long> rmap;
+
+    // Churn on keys [base,base+span) of one map, mirrored in r; busy is bumped a little way in.
+    void churn( smap * m, rmap * r, long base, long span, unsigned int seed, std::atomic<unsigned int> * busy ) {
+	rng rnd( seed );
+	for( int i(0); i<5000; ++i ) {
+	    if( i == 500 && busy ) ++*busy;
+	    long k( base + static_cast<long>( rnd() % span ) );
+	    if( rnd() % 3 ) {
+		(*m)[k] = i;
+		(*r)[k] = i;
+	    } else {
+		m->erase( k );
+		r->erase( k );
+	    }
+	}
+    }
+
+    void same( smap & m, rmap const & r ) {
+	m.check();
+	require( m.size() == r.size(), "split map size differs" );
+	rmap::const_iterator j( r.begin() );
+	for( smap::const_iterator i( m.begin() ); i!=m.end(); ++i, ++j ) {
+	    require( (*i).first == j->first && (*i).second == j->second, "split map entries differ" );
+	}
+    }
+
+    smap * build( rmap & r, long from, long to ) {
+	smap * m( new smap );
+	for( long k(from); k<to; ++k ) {
+	    (*m)[k] = k;
+	    r[k] = k;
+	}
+	return m;
+    }
+
+    // Moves r's entries from k up into a fresh reference.
+    rmap split_ref( rmap & r, long k ) {
+	rmap out( r.lower_bound( k ), r.end() );
+	r.erase( r.lower_bound( k ), r.end() );
+	return out;
+    }
+
+    void doomed( smap * e, rmap * r ) {
+	churn( e, r, 1400, 100, 99, 0 );
+	delete e;
+    }
+
+    void run_split( unsigned int rounds ) {
+	for( unsigned int round(0); round<rounds; ++round ) {
+	    rmap ra, rz;
+	    smap * a( build( ra, 0, 2000 ) );
+	    rmap rb( split_ref( ra, 1000 ) );
+	    smap b( a->split( 1000 ) );
+	    rmap rc( split_ref( rb, 1500 ) );
+	    smap * c( new smap( b.split( 1500 ) ) );
+	    // a, b and c now share one pool; z has its own.
+	    smap * z( build( rz, -500, 0 ) );
+	    std::atomic<unsigned int> busy( 0 );
+	    std::thread ta( churn, a, &ra, 0, 1000, round + 1, &busy );
+	    std::thread tb( churn, &b, &rb, 1000, 500, round + 2, &busy );
+	    // z takes c's pool over - and so a's and b's - while they're busy.
+	    while( busy.load() < 2 ) std::this_thread::yield();
+	    z->join( *c );
+	    rz.insert( rc.begin(), rc.end() );
+	    // The old pool goes once a and b have followed it on to z's.
+	    require( c->empty(), "join left entries behind" );
+	    delete c;
+	    churn( z, &rz, -500, 2500, round + 3, 0 );
+	    ta.join();
+	    tb.join();
+	    same( *a, ra );
+	    same( b, rb );
+	    same( *z, rz );
+	    // One half goes away on its own thread while the other carries on.
+	    rmap re( split_ref( rb, 1400 ) );
+	    std::thread te( doomed, new smap( b.split( 1400 ) ), &re );
+	    churn( &b, &rb, 1000, 400, round + 4, 0 );
+	    delete a;
+	    te.join();
+	    same( b, rb );
+	    delete z;
+	}
+	std::cout << "split\t" << rounds << "\tok" << std::endl;
+    }
+
+    typedef skip::mvcc_map<long,long> vmap;
+
+    // Replaces every value over and over; the keys themselves never go.
+    void replace( vmap * m, long keys, std::atomic<bool> * stop ) {
+	for( long round(1); !stop->load(); ++round ) {
+	    for( long k(0); k<keys && !stop->load(); ++k ) {
+		m->insert_or_assign( std::make_pair( k, k + round * keys ) );
+	    }
+	}
+    }
+
+    void run_versions( unsigned long reads ) {
+	const long keys( 64 );
+	vmap m;
+	for( long k(0); k<keys; ++k ) {
+	    m.insert( std::make_pair( k, k ) );
+	}
+	std::atomic<bool> stop( false );
+	std::thread writer( replace, &m, keys, &stop );
+	rng rnd( 1 );
+	unsigned long misses( 0 );
+	for( unsigned long i(0); i<reads; ++i ) {
+	    long k( rnd() % keys );
+	    long v( -1 );
+	    if( !m.find( k, v ) || v % keys != k ) ++misses;
+	}
+	stop.store( true );
+	writer.join();
+	require( misses == 0, "a lookup missed a key that was always there" );
+	require( m.size() == static_cast<std::size_t>( keys ), "replacing changed the size" );
+	std::cout << "versions\t" << reads << "\tok" << std::endl;
+    }
+}
+
+int main( int argc, char ** argv ) {
+    unsigned int threads( argc > 1 ? std::atoi( argv[1] ) : 4 );
+    if( !threads ) threads = 1;
+    try {
+	run_disjoint( threads );
+	run_mixed( threads );
+	run_split( argc > 2 ? std::atoi( argv[2] ) : 20 );
+	run_versions( argc > 3 ? std::atol( argv[3] ) : 2000000 );
+    } catch( std::exception & e ) {
+	std::cout << "FAILED: " << e.what() << std::endl;
+	return 1;
+    }
+    return 0;
+}